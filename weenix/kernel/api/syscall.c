@@ -19,6 +19,7 @@
 #include "mm/pframe.h"
 #include "mm/kmalloc.h"
 
+#include "fs/lseek.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 
@@ -70,6 +71,148 @@ sys_write(write_args_t *arg)
         return -1;
 }
 
+/* Most bounce pages a single do_readv()/do_writev() call made by
+ * sys_rw_vec() is staged through */
+#define RW_VEC_PAGES IOV_MAX
+
+/*
+ * Does a read or write for the user through do_readv()/do_writev(): the
+ * user's buffers uiov (already copied in) are cut into page-sized chunks
+ * and staged, in order, through up to RW_VEC_PAGES bounce pages, and
+ * each batch of chunks is handed over in one call. Only a request which
+ * needs more than one batch takes more than one call, so only such a
+ * request can be interleaved with other reads and writes of the file.
+ * The transfer ends at the first batch which comes up short. off is as
+ * for do_readv().
+ */
+static int
+sys_rw_vec(int fd, const struct iovec *uiov, int iovcnt, off_t off, int write)
+{
+        void *bounce[RW_VEC_PAGES];
+        struct iovec kiov[RW_VEC_PAGES];
+        char *ubuf[RW_VEC_PAGES];
+        size_t done = 0, batch, copied, len;
+        int i = 0, n, j, nbounce = 0, fault = 0, err, ret = 0, total = 0;
+
+        while (i < iovcnt && !fault) {
+                /* stage the next batch; if a bounce page can't be had,
+                 * go with the ones we have */
+                n = 0;
+                batch = 0;
+                while (n < RW_VEC_PAGES && i < iovcnt) {
+                        if (done == uiov[i].iov_len) {
+                                i++;
+                                done = 0;
+                                continue;
+                        }
+                        if (n == nbounce) {
+                                if (NULL == (bounce[n] = page_alloc()))
+                                        break;
+                                nbounce++;
+                        }
+                        kiov[n].iov_base = bounce[n];
+                        kiov[n].iov_len = MIN(uiov[i].iov_len - done, PAGE_SIZE);
+                        ubuf[n] = (char *)uiov[i].iov_base + done;
+                        if (write && 0 > (err = copy_from_user(kiov[n].iov_base,
+                                                               ubuf[n], kiov[n].iov_len))) {
+                                /* write what came before the fault */
+                                fault = err;
+                                break;
+                        }
+                        done += kiov[n].iov_len;
+                        batch += kiov[n].iov_len;
+                        n++;
+                }
+                if (0 == n) {
+                        if (!fault && i < iovcnt)
+                                ret = -ENOMEM;
+                        break;
+                }
+
+                if (write)
+                        ret = do_writev(fd, kiov, n, (-1 == off) ? -1 : off + total);
+                else
+                        ret = do_readv(fd, kiov, n, (-1 == off) ? -1 : off + total);
+                if (ret <= 0)
+                        break;
+
+                for (j = 0, copied = 0; !write && copied < (size_t)ret; j++) {
+                        len = MIN(kiov[j].iov_len, ret - copied);
+                        if (0 > (err = copy_to_user(ubuf[j], kiov[j].iov_base, len))) {
+                                /* the file position only covers what the
+                                 * user actually got */
+                                if (-1 == off)
+                                        do_lseek(fd, (int)copied - ret, SEEK_CUR);
+                                ret = copied;
+                                fault = err;
+                                break;
+                        }
+                        copied += len;
+                }
+                total += ret;
+                if ((size_t)ret < batch)
+                        break;
+        }
+
+        for (j = 0; j < nbounce; j++)
+                page_free(bounce[j]);
+        if (0 == total && (0 > ret || fault)) {
+                curthr->kt_errno = (0 > ret) ? -ret : -fault;
+                return -1;
+        }
+        return total;
+}
+
+/*
+ * readv() and writev(): copy in the iovec array, then transfer.
+ */
+static int
+sys_rwv(rwv_args_t *arg, int write)
+{
+        rwv_args_t kern_args;
+        struct iovec uiov[IOV_MAX];
+
+        if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+        if (kern_args.iovcnt <= 0 || kern_args.iovcnt > IOV_MAX) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+        if (copy_from_user(uiov, kern_args.iov,
+                           kern_args.iovcnt * sizeof(struct iovec)) < 0) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        return sys_rw_vec(kern_args.fd, uiov, kern_args.iovcnt, -1, write);
+}
+
+/*
+ * pread() and pwrite(): a single buffer at an offset, leaving the file
+ * position alone.
+ */
+static int
+sys_prw(prw_args_t *arg, int write)
+{
+        prw_args_t kern_args;
+        struct iovec uiov;
+
+        if (copy_from_user(&kern_args, arg, sizeof(kern_args)) < 0) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+        if (kern_args.offset < 0) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        uiov.iov_base = kern_args.buf;
+        uiov.iov_len = kern_args.nbytes;
+        return sys_rw_vec(kern_args.fd, &uiov, 1, kern_args.offset, write);
+}
+
 /*
  * This is another tricly sys_* function that you will need to write.
  * It's pretty similar to sys_read(), but you don't need
@@ -756,6 +899,18 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_write:
                         return sys_write((write_args_t *)args);
 
+                case SYS_readv:
+                        return sys_rwv((rwv_args_t *)args, 0);
+
+                case SYS_writev:
+                        return sys_rwv((rwv_args_t *)args, 1);
+
+                case SYS_pread:
+                        return sys_prw((prw_args_t *)args, 0);
+
+                case SYS_pwrite:
+                        return sys_prw((prw_args_t *)args, 1);
+
                 case SYS_dup:
                         return sys_dup((int)args);
 
@@ -1,9 +1,20 @@
 #include "kernel.h"
 #include "types.h"
+#include "errno.h"
+
+#include "main/cpuid.h"
+#include "main/interrupt.h"
+
+#include "proc/sched.h"
+
+#include "util/bits.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
 
 #include "drivers/blockdev.h"
+#include "drivers/bytedev.h"
 #include "drivers/disk/ata.h"
 
 #include "mm/pframe.h"
@@ -14,26 +25,55 @@ static void blockdev_put(mmobj_t *o);
 static int blockdev_lookuppage(mmobj_t *o, uint32_t pagenum,
                                int forwrite, pframe_t **pf);
 static int blockdev_fillpage(mmobj_t *o, pframe_t *pf);
+static int blockdev_fillpages(mmobj_t *o, pframe_t **pf, int npages);
 static int blockdev_dirtypage(mmobj_t *o, pframe_t *pf);
 static int blockdev_cleanpage(mmobj_t *o, pframe_t *pf);
+static int blockdev_cleanpages(mmobj_t *o, pframe_t **pf, int npages);
 
 static mmobj_ops_t blockdev_mmobj_ops = {
         .ref = blockdev_ref,
         .put = blockdev_put,
         .lookuppage = blockdev_lookuppage,
         .fillpage = blockdev_fillpage,
+        .fillpages = blockdev_fillpages,
         .dirtypage = blockdev_dirtypage,
-        .cleanpage = blockdev_cleanpage
+        .cleanpage = blockdev_cleanpage,
+        .cleanpages = blockdev_cleanpages
+};
+
+static int blockdev_iostat_read(bytedev_t *dev, int offset, void *buf, int count);
+static int blockdev_iostat_write(bytedev_t *dev, int offset, const void *buf,
+                                 int count);
+
+static bytedev_ops_t blockdev_iostat_ops = {
+        .read = blockdev_iostat_read,
+        .write = blockdev_iostat_write
+};
+
+/* /dev/iostat: reads return blockdev_info() */
+static bytedev_t blockdev_iostat_dev = {
+        .cd_id = MEM_IOSTAT_DEVID,
+        .cd_ops = &blockdev_iostat_ops
 };
 
 static list_t blockdevs;
 
+/* Masks the interrupts of every block device, so that the request
+ * queues can be touched outside of interrupt context */
+#define BLOCKDEV_IPL INTR_DISK_SECONDARY
+
+/* Most requests blockdev_transfer keeps queued at once */
+#define BLOCKDEV_TRANSFER_REQS 8
+
 void
 blockdev_init()
 {
         list_init(&blockdevs);
         /* Initialize all subsystems */
         ata_init();
+
+        if (0 > bytedev_register(&blockdev_iostat_dev))
+                panic("Could not register the iostat device\n");
 }
 
 int
@@ -53,9 +93,18 @@ blockdev_register(blockdev_t *dev)
                         return -1;
         } list_iterate_end();
 
+        KASSERT(dev->bd_max_blocks <= BLOCKDEV_MAX_BLOCKS);
+        if (NULL != dev->bd_ops->start_request && 0 == dev->bd_max_blocks)
+                return -1;
+
         /* Initialize its object here */
         mmobj_init(&dev->bd_mmobj, &blockdev_mmobj_ops);
 
+        list_init(&dev->bd_queue);
+        list_init(&dev->bd_active);
+        dev->bd_head = 0;
+        memset(&dev->bd_stats, 0, sizeof(dev->bd_stats));
+
         list_insert_tail(&blockdevs, &dev->bd_link);
         return 0;
 }
@@ -72,34 +121,307 @@ blockdev_lookup(devid_t id)
 }
 
 /*
- * Clean and then free all resident pages belonging to this
- * particular block device.
- * As with pframe_clean_all, this is not guaranteed to terminate.
+ * Average of a cycle total. The kernel has no 64-bit division, so both
+ * the total and the count are scaled down until the total fits.
  */
-void
-blockdev_flush_all(blockdev_t *dev)
+static uint32_t
+blockdev_cycles_avg(uint64_t cycles, uint32_t count)
+{
+        while (cycles >> 32) {
+                cycles >>= 1;
+                count >>= 1;
+        }
+        return count ? (uint32_t)cycles / count : 0;
+}
+
+size_t
+blockdev_info(const void *arg, char *buf, size_t osize)
 {
-        pframe_t *pf;
+        size_t size = osize;
+        blockdev_t *bd;
+        blockdev_stats_t stats, *bs = &stats;
+        uint8_t oldipl;
+        int i;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
 
-        /* Clean all pages - see pframe_clean_all for
-         * explanation of this loop */
-clean:
-        list_iterate_begin(&dev->bd_mmobj.mmo_respages, pf,
-                           pframe_t, pf_olink) {
-                if (pframe_is_dirty(pf)) {
-                        pframe_clean(pf);
-                        goto clean;
+        list_iterate_begin(&blockdevs, bd, blockdev_t, bd_link) {
+                /* The interrupt handler updates the counters, so take a
+                 * consistent copy of them before printing any */
+                oldipl = intr_getipl();
+                intr_setipl(BLOCKDEV_IPL);
+                stats = bd->bd_stats;
+                intr_setipl(oldipl);
+
+                iprintf(&buf, &size, "device %u.%u: %u pages filled, %u cleaned\n",
+                        MAJOR(bd->bd_id), MINOR(bd->bd_id), bs->bs_fills, bs->bs_cleans);
+                iprintf(&buf, &size, "%6s %10s %10s\n", "OP", "REQUESTS", "BLOCKS");
+                iprintf(&buf, &size, "%6s %10u %10u\n", "read",
+                        bs->bs_reads, bs->bs_read_blocks);
+                iprintf(&buf, &size, "%6s %10u %10u\n", "write",
+                        bs->bs_writes, bs->bs_write_blocks);
+                iprintf(&buf, &size, "%u errors, %u transfers, %u requests merged\n",
+                        bs->bs_errors, bs->bs_transfers, bs->bs_merged);
+                iprintf(&buf, &size, "queue depth %u, max %u\n",
+                        bs->bs_queued, bs->bs_max_queued);
+                iprintf(&buf, &size, "service time: avg %u cycles, busy %u Kcycles\n",
+                        blockdev_cycles_avg(bs->bs_busy_cycles, bs->bs_transfers),
+                        (uint32_t)(bs->bs_busy_cycles >> 10));
+                iprintf(&buf, &size, "%10s %10s\n", "<CYCLES", "TRANSFERS");
+                for (i = 0; i < BLOCKDEV_HIST_BUCKETS; i++) {
+                        if (0 == bs->bs_hist[i])
+                                continue;
+                        if (BLOCKDEV_HIST_BUCKETS - 1 == i)
+                                iprintf(&buf, &size, "%10s %10u\n", "more", bs->bs_hist[i]);
+                        else
+                                iprintf(&buf, &size, "%10u %10u\n",
+                                        1U << (BLOCKDEV_HIST_MIN_SHIFT + i), bs->bs_hist[i]);
                 }
         } list_iterate_end();
 
-        /* Free all pages */
-        list_iterate_begin(&dev->bd_mmobj.mmo_respages, pf,
-                           pframe_t, pf_olink) {
-                KASSERT(!pframe_is_dirty(pf));
-                pframe_free(pf);
+        return size;
+}
+
+static int
+blockdev_iostat_read(bytedev_t *dev, int offset, void *buf, int count)
+{
+        char *page;
+        int len;
+
+        if (NULL == (page = (char *)page_alloc()))
+                return -ENOMEM;
+
+        len = PAGE_SIZE - blockdev_info(NULL, page, PAGE_SIZE);
+        if (offset >= len) {
+                len = 0;
+        } else {
+                len = MIN(count, len - offset);
+                memcpy(buf, page + offset, len);
+        }
+
+        page_free(page);
+        return len;
+}
+
+static int
+blockdev_iostat_write(bytedev_t *dev, int offset, const void *buf, int count)
+{
+        return -EINVAL;
+}
+
+/* Request queue: */
+
+/* Position of a request in C-LOOK order: requests at or past the head
+ * are served on this sweep, the rest on the next one */
+#define blockdev_req_sweep(bd, req) ((req)->br_block < (bd)->bd_head)
+
+static int
+blockdev_req_before(blockdev_t *bd, blockdev_req_t *a, blockdev_req_t *b)
+{
+        if (blockdev_req_sweep(bd, a) != blockdev_req_sweep(bd, b))
+                return blockdev_req_sweep(bd, a) < blockdev_req_sweep(bd, b);
+        return a->br_block < b->br_block;
+}
+
+/*
+ * Completes and unlinks every request of the current transfer, at
+ * BLOCKDEV_IPL.
+ */
+static void
+blockdev_done_all(blockdev_t *bd, int status)
+{
+        blockdev_req_t *req;
+
+        list_iterate_begin(&bd->bd_active, req, blockdev_req_t, br_link) {
+                if (0 > status)
+                        bd->bd_stats.bs_errors++;
+                else if (req->br_write) {
+                        bd->bd_stats.bs_writes++;
+                        bd->bd_stats.bs_write_blocks += req->br_count;
+                } else {
+                        bd->bd_stats.bs_reads++;
+                        bd->bd_stats.bs_read_blocks += req->br_count;
+                }
+
+                list_remove(&req->br_link);
+                req->br_status = status;
+                req->br_done(req);
         } list_iterate_end();
 }
 
+/*
+ * If the device is idle, starts a transfer for the request at the front
+ * of the queue, merged with the ones after it for the blocks which
+ * follow. Called at BLOCKDEV_IPL.
+ */
+static void
+blockdev_dispatch(blockdev_t *bd)
+{
+        blockdev_req_t *req, *next;
+        blocknum_t start;
+        size_t count, i;
+        int ret;
+
+        while (list_empty(&bd->bd_active) && !list_empty(&bd->bd_queue)) {
+                req = list_head(&bd->bd_queue, blockdev_req_t, br_link);
+                start = req->br_block;
+                count = 0;
+
+                /* The queue is sorted, so requests which can be merged
+                 * are next to each other */
+                while (1) {
+                        list_remove(&req->br_link);
+                        list_insert_tail(&bd->bd_active, &req->br_link);
+                        bd->bd_stats.bs_queued--;
+                        if (0 < count)
+                                bd->bd_stats.bs_merged++;
+                        for (i = 0; i < req->br_count; i++)
+                                bd->bd_bufs[count++] = req->br_bufs[i];
+
+                        if (list_empty(&bd->bd_queue))
+                                break;
+                        next = list_head(&bd->bd_queue, blockdev_req_t, br_link);
+                        if (next->br_block != start + count
+                            || next->br_write != req->br_write
+                            || count + next->br_count > bd->bd_max_blocks)
+                                break;
+                        req = next;
+                }
+
+                /* Requests behind the new head now wait for the next
+                 * sweep, which keeps the queue sorted */
+                bd->bd_head = start;
+
+                bd->bd_stats.bs_transfers++;
+                bd->bd_start = rdtsc();
+                ret = bd->bd_ops->start_request(bd, bd->bd_bufs, start, count,
+                                                req->br_write);
+                if (0 > ret)
+                        blockdev_done_all(bd, ret);
+        }
+}
+
+void
+blockdev_submit(blockdev_t *bd, blockdev_req_t *req)
+{
+        list_link_t *link;
+        uint8_t oldipl;
+
+        KASSERT(NULL != bd->bd_ops->start_request);
+        KASSERT(0 < req->br_count && req->br_count <= bd->bd_max_blocks);
+
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+
+        for (link = bd->bd_queue.l_next; link != &bd->bd_queue; link = link->l_next) {
+                if (blockdev_req_before(bd, req,
+                                        list_item(link, blockdev_req_t, br_link)))
+                        break;
+        }
+        list_insert_before(link, &req->br_link);
+        if (++bd->bd_stats.bs_queued > bd->bd_stats.bs_max_queued)
+                bd->bd_stats.bs_max_queued = bd->bd_stats.bs_queued;
+        blockdev_dispatch(bd);
+
+        intr_setipl(oldipl);
+}
+
+void
+blockdev_complete(blockdev_t *bd, int status)
+{
+        uint32_t cycles = (uint32_t)(rdtsc() - bd->bd_start);
+        int bucket = 0;
+
+        /* a spurious interrupt, with no transfer to complete */
+        if (list_empty(&bd->bd_active)) {
+                dbg(DBG_DISK, "device %u.%u: completion with no transfer\n",
+                    MAJOR(bd->bd_id), MINOR(bd->bd_id));
+                return;
+        }
+
+        bd->bd_stats.bs_busy_cycles += cycles;
+        if (cycles >> BLOCKDEV_HIST_MIN_SHIFT)
+                bucket = MIN(bit_fls(cycles) - BLOCKDEV_HIST_MIN_SHIFT + 1,
+                             BLOCKDEV_HIST_BUCKETS - 1);
+        bd->bd_stats.bs_hist[bucket]++;
+
+        blockdev_done_all(bd, status);
+        blockdev_dispatch(bd);
+}
+
+typedef struct blockdev_wait {
+        int             bw_pending;
+        int             bw_status;
+        ktqueue_t       bw_waitq;
+} blockdev_wait_t;
+
+static void
+blockdev_transfer_done(blockdev_req_t *req)
+{
+        blockdev_wait_t *wait = (blockdev_wait_t *)req->br_arg;
+
+        if (0 > req->br_status)
+                wait->bw_status = req->br_status;
+        if (0 == --wait->bw_pending)
+                sched_wakeup_on(&wait->bw_waitq);
+}
+
+int
+blockdev_transfer(blockdev_t *bd, char **bufs, blocknum_t loc,
+                  size_t count, int write)
+{
+        blockdev_req_t reqs[BLOCKDEV_TRANSFER_REQS];
+        blockdev_wait_t wait;
+        uint8_t oldipl;
+        size_t n;
+        int i;
+
+        wait.bw_status = 0;
+        sched_queue_init(&wait.bw_waitq);
+
+        /* The interrupt handler must not complete our requests between
+         * our checking bw_pending and going to sleep */
+        oldipl = intr_getipl();
+        intr_setipl(BLOCKDEV_IPL);
+
+        while (count > 0 && 0 == wait.bw_status) {
+                wait.bw_pending = 0;
+                for (i = 0; i < BLOCKDEV_TRANSFER_REQS && count > 0; i++) {
+                        n = MIN(count, bd->bd_max_blocks);
+                        reqs[i].br_block = loc;
+                        reqs[i].br_count = n;
+                        reqs[i].br_bufs = bufs;
+                        reqs[i].br_write = write;
+                        reqs[i].br_done = blockdev_transfer_done;
+                        reqs[i].br_arg = &wait;
+                        wait.bw_pending++;
+                        blockdev_submit(bd, &reqs[i]);
+                        bufs += n;
+                        loc += n;
+                        count -= n;
+                }
+                while (0 < wait.bw_pending)
+                        sched_sleep_on(&wait.bw_waitq);
+        }
+
+        intr_setipl(oldipl);
+        return wait.bw_status;
+}
+
+/*
+ * Clean and then free all resident pages belonging to this
+ * particular block device.
+ * As with pframe_clean_all, this is not guaranteed to terminate.
+ */
+void
+blockdev_flush_all(blockdev_t *dev)
+{
+        /* Clean all pages in block order, then free them */
+        pframe_clean_range(&dev->bd_mmobj, 0, PFRAME_MAX_PAGENUM);
+        pframe_free_range(&dev->bd_mmobj, 0, PFRAME_MAX_PAGENUM);
+}
+
 /* Implementation of mmobj entry points: */
 
 /* Block device mmobjs don't need to ref or put, as they will
@@ -122,9 +444,45 @@ blockdev_fillpage(mmobj_t *o, pframe_t *pf)
         /* Find the corresponding blockdev */
         blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
         /* And fill in the page by reading from it */
+        bd->bd_stats.bs_fills++;
         return bd->bd_ops->read_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
 }
 
+static int
+blockdev_fillpages(mmobj_t *o, pframe_t **pf, int npages)
+{
+        blockdev_t *bd = CONTAINER_OF(o, blockdev_t, bd_mmobj);
+        char *buf, *bufs[PFRAME_CLUSTER_MAX];
+        int i, ret;
+
+        bd->bd_stats.bs_fills += npages;
+
+        /* if the device can scatter the blocks itself, let it */
+        if (NULL != bd->bd_ops->read_blockv && npages <= PFRAME_CLUSTER_MAX) {
+                for (i = 0; i < npages; i++)
+                        bufs[i] = pf[i]->pf_addr;
+                return bd->bd_ops->read_blockv(bd, bufs, pf[0]->pf_pagenum, npages);
+        }
+
+        /* read_block takes a single buffer, so read into one and scatter
+         * from there; if we can't get one, fall back to a read per page */
+        if (NULL == (buf = page_alloc_n(npages))) {
+                for (i = 0; i < npages; i++) {
+                        if (0 > (ret = bd->bd_ops->read_block(bd, pf[i]->pf_addr,
+                                                              pf[i]->pf_pagenum, 1)))
+                                return ret;
+                }
+                return 0;
+        }
+
+        if (0 == (ret = bd->bd_ops->read_block(bd, buf, pf[0]->pf_pagenum, npages))) {
+                for (i = 0; i < npages; i++)
+                        memcpy(pf[i]->pf_addr, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        page_free_n(buf, npages);
+        return ret;
+}
+
 /* block devices don't need to make use of this entry point: */
 static int
 blockdev_dirtypage(mmobj_t *o, pframe_t *pf)
@@ -139,5 +497,40 @@ blockdev_cleanpage(mmobj_t *o, pframe_t *pf)
         /* Find the corresponding blockdev */
         blockdev_t *bd = CONTAINER_OF(pf->pf_obj, blockdev_t, bd_mmobj);
         /* Clean the corresponding page by writing it back */
+        bd->bd_stats.bs_cleans++;
         return bd->bd_ops->write_block(bd, pf->pf_addr, pf->pf_pagenum, 1);
 }
+
+static int
+blockdev_cleanpages(mmobj_t *o, pframe_t **pf, int npages)
+{
+        blockdev_t *bd = CONTAINER_OF(o, blockdev_t, bd_mmobj);
+        char *buf, *bufs[PFRAME_CLUSTER_MAX];
+        int i, ret;
+
+        bd->bd_stats.bs_cleans += npages;
+
+        /* if the device can gather the pages itself, let it */
+        if (NULL != bd->bd_ops->write_blockv && npages <= PFRAME_CLUSTER_MAX) {
+                for (i = 0; i < npages; i++)
+                        bufs[i] = pf[i]->pf_addr;
+                return bd->bd_ops->write_blockv(bd, bufs, pf[0]->pf_pagenum, npages);
+        }
+
+        /* write_block takes a single buffer, so gather the pages into
+         * one; if we can't get one, fall back to a write per page */
+        if (NULL == (buf = page_alloc_n(npages))) {
+                for (i = 0; i < npages; i++) {
+                        if (0 > (ret = bd->bd_ops->write_block(bd, pf[i]->pf_addr,
+                                                               pf[i]->pf_pagenum, 1)))
+                                return ret;
+                }
+                return 0;
+        }
+
+        for (i = 0; i < npages; i++)
+                memcpy(buf + i * BLOCK_SIZE, pf[i]->pf_addr, BLOCK_SIZE);
+        ret = bd->bd_ops->write_block(bd, buf, pf[0]->pf_pagenum, npages);
+        page_free_n(buf, npages);
+        return ret;
+}
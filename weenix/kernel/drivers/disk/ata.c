@@ -3,6 +3,9 @@
 #include "main/interrupt.h"
 #include "main/io.h"
 
+#include "kernel.h"
+#include "errno.h"
+
 #include "util/string.h"
 #include "util/debug.h"
 #include "util/list.h"
@@ -12,9 +15,6 @@
 #include "drivers/dev.h"
 #include "drivers/disk/dma.h"
 
-#include "proc/sched.h"
-#include "proc/kmutex.h"
-
 #include "mm/kmalloc.h"
 #include "mm/page.h"
 
@@ -24,9 +24,9 @@
 
 /*
  * Huge pile of helpful definitions (copied from OSDev). Note that we
- * do not support busmaster, drive detection, or LBA48 We support
- * secondary channel and slave drive, but probably won't ever use
- * them.
+ * do not support drive detection. We support secondary channel and
+ * slave drive, but probably won't ever use them. Disks are addressed
+ * with 28-bit LBA, or 48-bit LBA if the drive supports it.
  */
 
 /* Interface type (we will only use ATA) */
@@ -89,7 +89,20 @@ static struct ata_channel {
 
 #define ATA_NUM_CHANNELS 2
 
-#define ATA_SECTOR_SIZE 512 /* Pretty much always true */
+#define ATA_SECTOR_SIZE 512 /* Unless the drive says otherwise */
+
+/* Most sectors one command can transfer; written to the sector count
+ * register as 0 */
+#define ATA_MAX_SECTORS     256
+#define ATA_MAX_SECTORS_EXT 65536
+
+/* 28-bit commands can only address this many sectors */
+#define ATA_LBA28_SECTORS   (1U << 28)
+
+/* Most blocks one command can transfer */
+#define ata_max_blocks(adisk) \
+        MIN((adisk)->ata_max_sectors / (adisk)->ata_sectors_per_block, \
+            MIN(BLOCKDEV_MAX_BLOCKS, DMA_MAX_PRDS))
 
 /* Port address offsets for registers */
 /* Command registers */
@@ -106,7 +119,9 @@ static struct ata_channel {
 #define ATA_REG_DRIVEHEAD  0x06 /* Special drive info (used to set master/slave) */
 #define ATA_REG_COMMAND    0x07 /* Write only */
 #define ATA_REG_STATUS     0x07 /* Read only */
-#define ATA_REG_SECCOUNT1  0x08 /* These four are only used in lba48 */
+/* These four are only used in lba48. They are not real ports: the high
+ * bytes are written to SECCOUNT0 and LBA0-2 just before the low ones */
+#define ATA_REG_SECCOUNT1  0x08
 #define ATA_REG_LBA3       0x09
 #define ATA_REG_LBA4       0x0A
 #define ATA_REG_LBA5       0x0B /* --- */
@@ -160,7 +175,21 @@ static struct ata_channel {
 #define ATA_DRIVEHEAD_CHS 0x00
 #define ATA_DRIVEHEAD_LBA 0x40
 
-#define ATA_IDENT_MAX_LBA 30
+/* Word offsets into the identification space */
+#define ATA_IDENT_MAX_LBA       60  /* 2 words: sectors addressable with LBA28 */
+#define ATA_IDENT_COMMAND_SETS  83
+#define ATA_IDENT_MAX_LBA_EXT   100 /* 4 words: sectors addressable with LBA48 */
+#define ATA_IDENT_SECTOR_SIZE   106
+#define ATA_IDENT_LOGICAL_SIZE  117 /* 2 words: logical sector size in words */
+
+#define ATA_COMMAND_SETS_LBA48  0x0400
+/* ATA_IDENT_SECTOR_SIZE is valid if bit 14 is set and bit 15 clear */
+#define ATA_SECTOR_SIZE_VALID   0xc000
+#define ATA_SECTOR_SIZE_VALID_V 0x4000
+#define ATA_SECTOR_SIZE_LOGICAL 0x1000
+
+#define ata_ident_dword(ident, word) \
+        ((uint32_t)(ident)[(word)] | ((uint32_t)(ident)[(word) + 1] << 16))
 
 /* Reads from the command registers, NOT the control registers */
 #define ata_inb_reg(channel, reg) inb(ATA_CHANNELS[channel].atac_cmd + reg)
@@ -207,19 +236,18 @@ typedef struct ata_disk {
         uint8_t    ata_drive;
 
         /* Size of disk in number of sectors */
-        uint32_t   ata_size;
+        uint64_t   ata_size;
 
+        uint32_t   ata_sector_size;
         uint32_t   ata_sectors_per_block;
 
-        /* Threads making blocking disk operations wait one this
-         * queue, and disk interrupt wakes them up */
-        ktqueue_t  ata_waitq;
+        /* Whether to use 48-bit commands, and the most sectors one
+         * command can transfer */
+        int        ata_lba48;
+        uint32_t   ata_max_sectors;
 
-        /* Disk mutex since only one process can be using the disk at
-         * any time */
-        kmutex_t   ata_mutex;
-
-        /* Underlying block device */
+        /* Underlying block device, whose request queue serializes
+         * operations on the disk */
         blockdev_t ata_bdev;
 } ata_disk_t;
 
@@ -230,13 +258,20 @@ static int ata_read(blockdev_t *bdev, char *data,
                     blocknum_t blocknum, unsigned int count);
 static int ata_write(blockdev_t *bdev, const char *data,
                      blocknum_t blocknum, unsigned int count);
-static int ata_do_operation(ata_disk_t *adisk, char *data, \
-                            blocknum_t sectornum, int write);
+static int ata_readv(blockdev_t *bdev, char **bufs,
+                     blocknum_t blocknum, unsigned int count);
+static int ata_writev(blockdev_t *bdev, char **bufs,
+                      blocknum_t blocknum, unsigned int count);
+static int ata_start_request(blockdev_t *bdev, char **bufs,
+                             blocknum_t blocknum, size_t count, int write);
 static void ata_intr(regs_t *regs, void *arg);
 
 static blockdev_ops_t ata_disk_ops = {
-        .read_block  = ata_read,
-        .write_block = ata_write
+        .read_block    = ata_read,
+        .write_block   = ata_write,
+        .read_blockv   = ata_readv,
+        .write_blockv  = ata_writev,
+        .start_request = ata_start_request
 };
 
 void
@@ -255,6 +290,7 @@ ata_init()
         for (ii = 0; ii < NDISKS; ii++) {
                 int i;
                 uint32_t ident_buf[ATA_IDENT_BUFSIZE];
+                uint16_t *ident = (uint16_t *)ident_buf;
                 int channel = ii; /* No slave drive support */
                 ata_disk_t *adisk;
 
@@ -289,20 +325,44 @@ ata_init()
                         ident_buf[i] = ata_inl_reg(adisk->ata_channel,
                                                    ATA_REG_DATA);
                 }
-                /* Determine disk size */
-                adisk->ata_size = ident_buf[ATA_IDENT_MAX_LBA];
+                /* Determine disk geometry. The LBA28 sector count
+                 * saturates for disks too large for it, in which case
+                 * the LBA48 count has the real size */
+                adisk->ata_lba48 = !!(ident[ATA_IDENT_COMMAND_SETS]
+                                      & ATA_COMMAND_SETS_LBA48);
+                if (adisk->ata_lba48) {
+                        adisk->ata_size = (uint64_t)
+                                          ata_ident_dword(ident, ATA_IDENT_MAX_LBA_EXT + 2) << 32
+                                          | ata_ident_dword(ident, ATA_IDENT_MAX_LBA_EXT);
+                        adisk->ata_max_sectors = ATA_MAX_SECTORS_EXT;
+                } else {
+                        adisk->ata_size = ata_ident_dword(ident, ATA_IDENT_MAX_LBA);
+                        adisk->ata_max_sectors = ATA_MAX_SECTORS;
+                }
+
+                adisk->ata_sector_size = ATA_SECTOR_SIZE;
+                if (ATA_SECTOR_SIZE_VALID_V == (ident[ATA_IDENT_SECTOR_SIZE]
+                                                & ATA_SECTOR_SIZE_VALID)
+                    && (ident[ATA_IDENT_SECTOR_SIZE] & ATA_SECTOR_SIZE_LOGICAL))
+                        adisk->ata_sector_size =
+                                2 * ata_ident_dword(ident, ATA_IDENT_LOGICAL_SIZE);
+                if (adisk->ata_sector_size < ATA_SECTOR_SIZE
+                    || adisk->ata_sector_size > BLOCK_SIZE
+                    || 0 != BLOCK_SIZE % adisk->ata_sector_size)
+                        panic("ATA sector size %u does not divide the block size\n",
+                              adisk->ata_sector_size);
                 /* In theory we could use this identification buffer
                  * to find out lots of other things but we don't
                  * really need to know any of them */
 
-                adisk->ata_sectors_per_block = BLOCK_SIZE / ATA_SECTOR_SIZE;
+                adisk->ata_sectors_per_block = BLOCK_SIZE / adisk->ata_sector_size;
 
-                sched_queue_init(&adisk->ata_waitq);
-                kmutex_init(&adisk->ata_mutex);
-
-                dbg(DBG_DISK, "Initialized ATA device %d, channel %s, drive %s, size %d\n",
+                dbg(DBG_DISK, "Initialized ATA device %d, channel %s, drive %s, "
+                    "%u MiB in %u byte sectors%s\n",
                     ii, (adisk->ata_channel ? "SECONDARY" : "PRIMARY"),
-                    (adisk->ata_drive ? "SLAVE" : "MASTER"), adisk->ata_size);
+                    (adisk->ata_drive ? "SLAVE" : "MASTER"),
+                    (uint32_t)((adisk->ata_size * adisk->ata_sector_size) >> 20),
+                    adisk->ata_sector_size, adisk->ata_lba48 ? ", LBA48" : "");
 
                 /* Set up corresponding handler */
                 intr_register(ATA_CHANNELS[adisk->ata_channel].atac_intr,
@@ -312,6 +372,7 @@ ata_init()
 
                 adisk->ata_bdev.bd_id = MKDEVID(DISK_MAJOR, ii);
                 adisk->ata_bdev.bd_ops = &ata_disk_ops;
+                adisk->ata_bdev.bd_max_blocks = ata_max_blocks(adisk);
                 blockdev_register(&adisk->ata_bdev);
         }
         intr_setipl(oldipl);
@@ -338,6 +399,31 @@ ata_intr_wrapper(regs_t *regs)
         panic("Received interrupt on channel we don't know about\n");
 }
 
+/* Most blocks ata_do_buffer hands to the request queue at once */
+#define ATA_BUFFER_BLOCKS BLOCKDEV_MAX_BLOCKS
+
+/*
+ * Transfers blocks held in a single buffer through the request queue.
+ */
+static int
+ata_do_buffer(ata_disk_t *adisk, char *data, blocknum_t blocknum,
+              unsigned int count, int write)
+{
+        char *bufs[ATA_BUFFER_BLOCKS];
+        unsigned int i, n;
+        int ret;
+
+        for (; count > 0; blocknum += n, count -= n) {
+                n = MIN(count, ATA_BUFFER_BLOCKS);
+                for (i = 0; i < n; i++, data += BLOCK_SIZE)
+                        bufs[i] = data;
+                if (0 > (ret = blockdev_transfer(&adisk->ata_bdev, bufs,
+                                                 blocknum, n, write)))
+                        return ret;
+        }
+        return 0;
+}
+
 /**
  * Reads a given number of blocks from a block device starting at a
  * given block number into a buffer.
@@ -351,8 +437,7 @@ ata_intr_wrapper(regs_t *regs)
 static int
 ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum, unsigned int count)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_read");
-        return -1;
+        return ata_do_buffer(bd_to_ata(bdev), data, blocknum, count, ATA_READ);
 }
 
 /**
@@ -368,109 +453,108 @@ ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum, unsigned int count)
 static int
 ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int count)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_write");
-        return -1;
+        return ata_do_buffer(bd_to_ata(bdev), (char *) data, blocknum, count, ATA_WRITE);
 }
 
 /**
- * Read/write the given block.
+ * Reads a given number of blocks from a block device starting at a
+ * given block number, each into its own buffer.
  *
- * @param adisk the disk to perform the operation on
- * @param data the buffer to write from or read into
- * @param blocknum which block on the disk to read or write
- * @param write true if writing, false if reading
- * @return 0 on sucess or <0 on error
+ * @param bdev the block device to read from
+ * @param bufs buffers to write to, one per block
+ * @param blocknum the block number to start reading at
+ * @param count the number of blocks to read
+ * @return 0 on success and <0 on error
  */
-/*
- * In this function you will perform a disk operation using
- * direct memory access (DMA). Follow these steps _VERY_
- * carefully. The steps are as follows:
- *
- *     o Lock the mutex and set the IPL. We don't want to
- *     other threads trying to perform an operation while we
- *     are in the middle of this operation. We also don't want
- *     to receive a disk interrupt, which is supposed to wake
- *     up this thread to alert us that the DMA operation has
- *     completed, before the thread goes to sleep and puts
- *     itself on the wait queue. Since the only interrupts we
- *     care about are disk interrupts, we do not have to mask
- *     all interrupts, just disk interrupts (and consequently,
- *     all interrupts with lower priority than disk
- *     interrupts). Try INTR_DISK_SECONDARY.
- *
- *     o Initialize DMA for this operation (see the dma_load()
- *     function)
- *
- *     o Write to the disk's registers to tell it the number
- *     of sectors that will be read/writen and the starting
- *     sector. Use the ata_outb_reg() function for writing
- *     to the hardware registers (as these are each one byte
- *     in size).
- *
- *     We use logical block addressing (LBA) to specify the
- *     starting sector. Our interface supports 24-bit sector
- *     numbers, and up to 256* sectors to be read/written at a
- *     time. Write the number of sectors to ATA_REG_SECCOUNT0.
- *     Write the sector number in little-endian order to
- *     ATA_REG_LBA{0-2} (least-significant eight bits to
- *     ATA_REG_LBA0, middle eight bits to ATA_REG_LBA1,
- *     most-significant eight bits to ATA_REG_LBA2).
- *
- *     (* Note that the special value 0 when written to this
- *     register will in fact write 256 sectors, though you will
- *     not ever be writing this value)
- *
- *     o Write to the disk's registers to tell it the type of
- *     operation it will be performing.
- *
- *     You should write either ATA_CMD_WRITE_DMA or
- *     ATA_CMD_READ_DMA to the ATA_REG_COMMAND register.
- *
- *     o Pause to make sure the disk is ready to go (see the
- *     ata_pause() function).
- *
- *     o Start the DMA operation (see the dma_start() function).
- *
- *     o Now that we have given the disk and the DMA
- *     controller the necessary information, all we have to do
- *     is wait. This is the whole point of DMA: this process
- *     can yield, allowing the CPU to perform other tasks
- *     while we wait for the disk to seek and perform the
- *     requested operation.
- *
- *     Specifically, we want to sleep on the disk's wait queue
- *     so we can be woken up by the interrupt handler, which
- *     will be called when the DMA operation is completed.
- *
- *     o Once we have woken up from sleep, we need to read
- *     the status of the DMA operation from the disk's
- *     ATA_REG_STATUS register (see the ata_inb_reg()
- *     function).
+static int
+ata_readv(blockdev_t *bdev, char **bufs, blocknum_t blocknum, unsigned int count)
+{
+        return blockdev_transfer(bdev, bufs, blocknum, count, ATA_READ);
+}
+
+/**
+ * Writes a given number of blocks to a block device starting at a
+ * given block number, each from its own buffer.
  *
- *     o Next, we check the status to see if the error bit is
- *     set (for status flags, see ATA_SR_* values). If there
- *     is an error, read the error code from the disk's
- *     ATA_REG_ERROR register (propagate it up as -error).
+ * @param bdev the block device to write to
+ * @param bufs buffers to read data from, one per block
+ * @param blocknum the block number to start writing at
+ * @param count the number of blocks to write
+ * @return 0 on success and <0 on error
+ */
+static int
+ata_writev(blockdev_t *bdev, char **bufs, blocknum_t blocknum, unsigned int count)
+{
+        return blockdev_transfer(bdev, bufs, blocknum, count, ATA_WRITE);
+}
+
+/**
+ * Starts reading or writing the given blocks with a single DMA
+ * command, and returns without waiting for it; ata_intr() reports
+ * the result to the request queue. Called at INTR_DISK_SECONDARY.
  *
- *     o Alert the DMA controller that we have received the
- *     interrupt and, if necessary, clear the error bit (see
- *     dma_reset() function).
+ * We use logical block addressing. With 28-bit commands the sector
+ * count goes to ATA_REG_SECCOUNT0 (where 0 means 256) and the starting
+ * sector to ATA_REG_LBA{0-2}, least-significant byte first, with its
+ * top four bits in ATA_REG_DRIVEHEAD. The 48-bit commands take a
+ * 16-bit count (0 means 65536) and a 48-bit sector: each of those
+ * registers is written twice, high byte first.
  *
- *     o Now we are finished. Restore the IPL, release any
- *     locks we have, and return the status of the DMA
- *     operation.
+ * @param bdev the block device to perform the operation on
+ * @param bufs the buffers to write from or read into, one per block
+ * @param blocknum which block on the disk to start reading or writing at
+ * @param count the number of blocks, at most ata_max_blocks(adisk)
+ * @param write true if writing, false if reading
+ * @return 0 if the command was started or <0 on error
  */
 static int
-ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
+ata_start_request(blockdev_t *bdev, char **bufs, blocknum_t blocknum,
+                  size_t count, int write)
 {
+        ata_disk_t *adisk = bd_to_ata(bdev);
+        uint8_t channel = adisk->ata_channel;
+        uint64_t sector = (uint64_t) blocknum * adisk->ata_sectors_per_block;
+        uint32_t nsectors = count * adisk->ata_sectors_per_block;
+        uint8_t cmd;
+
+        KASSERT(0 < count && nsectors <= adisk->ata_max_sectors);
+        if (sector + nsectors > adisk->ata_size)
+                return -EINVAL;
 
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_do_operation");
-        return -1;
+        dma_load_sg(channel, bufs, count, BLOCK_SIZE, write);
+
+        if (adisk->ata_lba48) {
+                ata_outb_reg(channel, ATA_REG_DRIVEHEAD,
+                             ATA_DRIVEHEAD_MASTER | ATA_DRIVEHEAD_LBA);
+                ata_outb_reg(channel, ATA_REG_SECCOUNT0, (nsectors >> 8) & 0xff);
+                ata_outb_reg(channel, ATA_REG_LBA0, (uint8_t)(sector >> 24));
+                ata_outb_reg(channel, ATA_REG_LBA1, (uint8_t)(sector >> 32));
+                ata_outb_reg(channel, ATA_REG_LBA2, (uint8_t)(sector >> 40));
+                cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        } else {
+                KASSERT(sector + nsectors <= ATA_LBA28_SECTORS);
+                ata_outb_reg(channel, ATA_REG_DRIVEHEAD,
+                             ATA_DRIVEHEAD_MASTER | ATA_DRIVEHEAD_LBA
+                             | ((uint8_t)(sector >> 24) & 0x0f));
+                cmd = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+        }
+
+        /* 256 (or 65536) sectors is written as 0 */
+        ata_outb_reg(channel, ATA_REG_SECCOUNT0, nsectors & 0xff);
+        ata_outb_reg(channel, ATA_REG_LBA0, (uint8_t) sector);
+        ata_outb_reg(channel, ATA_REG_LBA1, (uint8_t)(sector >> 8));
+        ata_outb_reg(channel, ATA_REG_LBA2, (uint8_t)(sector >> 16));
+        ata_outb_reg(channel, ATA_REG_COMMAND, cmd);
+        ata_pause(channel);
+
+        dma_start(channel);
+        return 0;
 }
 
 /**
  * Interrupt handler called by the disk when an operation has
- * completed.
+ * completed. Hands the result to the request queue, which starts the
+ * next operation right away.
  *
  * @param regs the register state
  * @param arg the disk the operation was performed on. This should be
@@ -479,6 +563,19 @@ ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
 static void
 ata_intr(regs_t *regs, void *arg)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_intr");
-}
+        ata_disk_t *adisk = (ata_disk_t *) arg;
+        uint8_t channel = adisk->ata_channel;
+        uint8_t status;
+        int ret = 0;
 
+        dma_stop(channel);
+
+        status = ata_inb_reg(channel, ATA_REG_STATUS);
+        if (status & ATA_SR_ERR) {
+                ret = -ata_inb_reg(channel, ATA_REG_ERROR);
+                dbg(DBG_DISK, "ATA error %d on channel %d\n", -ret, channel);
+        }
+        dma_reset(channel);
+
+        blockdev_complete(&adisk->ata_bdev, ret);
+}
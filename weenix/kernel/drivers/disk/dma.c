@@ -1,5 +1,7 @@
 #include "main/io.h"
 
+#include "kernel.h"
+
 #include "util/debug.h"
 #include "util/string.h"
 #include "util/delay.h"
@@ -40,13 +42,21 @@
 /* Index by channel */
 static uint16_t DMA_BASES[2] = { DMA_BASE_PRIMARY, DMA_BASE_SECONDARY };
 
+/* A physical region descriptor: one physically contiguous piece of a
+ * transfer. A region may not cross a 64KiB boundary, and a count of 0
+ * means 64KiB. */
 typedef struct {
         uint32_t prd_addr;
         uint16_t prd_count;
         uint16_t prd_last;
 } prd_t;
 
-static prd_t prd_table[2] __attribute__((aligned(32)));
+#define PRD_LAST       (1 << 15)
+#define PRD_BOUNDARY   0x10000
+
+/* Each channel's table is 1KiB and aligned to its size, so that it
+ * cannot cross a 64KiB boundary either */
+static prd_t prd_table[2][DMA_MAX_PRDS] __attribute__((aligned(1024)));
 
 static prd_t *DMA_PRDS[2];
 
@@ -54,22 +64,52 @@ void
 dma_init()
 {
         /* Clear the table */
-        memset(prd_table, 0, sizeof(prd_t) * 2);
-        /* Set pointers to it; note each channel only needs one PRD entry */
-        DMA_PRDS[0] = prd_table;
-        DMA_PRDS[1] = prd_table + 1;
+        memset(prd_table, 0, sizeof(prd_table));
+        DMA_PRDS[0] = prd_table[0];
+        DMA_PRDS[1] = prd_table[1];
 
 }
 
-void
-dma_load(uint8_t channel, void *start, int count, int write)
+/*
+ * Appends the physical pages backing [start, start + count) to the PRD
+ * table of channel, which already has nprds entries, merging pages which
+ * are physically adjacent. Returns the new number of entries.
+ */
+static int
+dma_add_prds(uint8_t channel, int nprds, char *start, int count)
 {
+        prd_t *prds = DMA_PRDS[channel];
+
         KASSERT(PAGE_ALIGNED(start));
-        memset(DMA_PRDS[channel], 0, 8);
+        for (; count > 0; start += PAGE_SIZE, count -= PAGE_SIZE) {
+                uint32_t paddr = pt_virt_to_phys((uintptr_t) start);
+                uint32_t len = MIN((uint32_t) count, PAGE_SIZE);
+
+                if (0 < nprds) {
+                        prd_t *prd = &prds[nprds - 1];
+                        uint32_t plen = prd->prd_count;
+                        if (prd->prd_addr + plen == paddr
+                            && (prd->prd_addr & ~(PRD_BOUNDARY - 1)) == ((paddr + len - 1) & ~(PRD_BOUNDARY - 1))) {
+                                /* 64KiB wraps around to 0, which means 64KiB */
+                                prd->prd_count = (uint16_t)(plen + len);
+                                continue;
+                        }
+                }
+                KASSERT(DMA_MAX_PRDS > nprds && "DMA transfer too fragmented");
+                prds[nprds].prd_addr = paddr;
+                prds[nprds].prd_count = (uint16_t) len;
+                prds[nprds].prd_last = 0;
+                nprds++;
+        }
+        return nprds;
+}
+
+static void
+dma_load_prds(uint8_t channel, int nprds, int write)
+{
+        KASSERT(0 < nprds);
+        DMA_PRDS[channel][nprds - 1].prd_last = PRD_LAST;
         dma_reset(channel);
-        DMA_PRDS[channel]->prd_addr = pt_virt_to_phys((uintptr_t) start);
-        DMA_PRDS[channel]->prd_count = (uint16_t) count;
-        DMA_PRDS[channel]->prd_last = (1 << 15);
         dma_outl_reg(channel, DMA_PRD,
                      pt_virt_to_phys((uintptr_t) DMA_PRDS[channel]));
         /* Write out the command's read/write code */
@@ -77,6 +117,24 @@ dma_load(uint8_t channel, void *start, int count, int write)
                      (write ? DMA_CMD_WRITE : DMA_CMD_READ));
 }
 
+void
+dma_load(uint8_t channel, void *start, int count, int write)
+{
+        KASSERT(0 < count && count <= DMA_MAX_BYTES);
+        dma_load_prds(channel, dma_add_prds(channel, 0, start, count), write);
+}
+
+void
+dma_load_sg(uint8_t channel, char **bufs, int nbufs, int bufsize, int write)
+{
+        int i, nprds = 0;
+
+        KASSERT(0 < nbufs && nbufs * bufsize <= DMA_MAX_BYTES);
+        for (i = 0; i < nbufs; i++)
+                nprds = dma_add_prds(channel, nprds, bufs[i], bufsize);
+        dma_load_prds(channel, nprds, write);
+}
+
 uint8_t
 dma_status(uint8_t channel)
 {
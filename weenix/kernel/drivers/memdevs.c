@@ -105,9 +105,17 @@ zero_read(bytedev_t *dev, int offset, void *buf, int count)
 
 /* Don't worry about these until VM. Once you're there, they shouldn't be hard. */
 
+/*
+ * A mapping of the zero device is just anonymous memory, whose pages are
+ * filled from the pool of pages zeroed while idle (see anon_fillpage).
+ */
 static int
 zero_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
 {
-        NOT_YET_IMPLEMENTED("VM: zero_mmap");
-        return -1;
+        mmobj_t *o;
+
+        if (NULL == (o = anon_create()))
+                return -ENOMEM;
+        *ret = o;
+        return 0;
 }
@@ -0,0 +1,217 @@
+#include "kernel.h"
+#include "config.h"
+#include "globals.h"
+
+#include "fs/dcache.h"
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/printf.h"
+#include "util/string.h"
+
+typedef struct dcache_entry {
+        fs_t           *de_fs;
+        ino_t           de_dir;         /* vnode number of the directory */
+        ino_t           de_vno;         /* of the entry, unless negative */
+        int             de_negative;    /* the name does not exist */
+        size_t          de_len;
+        char            de_name[NAME_LEN];
+        list_link_t     de_hash_link;   /* on a hash chain, if in use */
+        list_link_t     de_lru_link;    /* on dcache_lru or dcache_free */
+} dcache_entry_t;
+
+static dcache_entry_t dcache_entries[DCACHE_ENTRIES];
+static list_t dcache_hash[DCACHE_BUCKETS];
+static list_t dcache_lru;       /* entries in use, most recently used first */
+static list_t dcache_free;
+
+/* Bumped by every purge, see dcache_stamp() */
+static uint32_t dcache_purges = 0;
+
+static uint32_t dcache_hits = 0;
+static uint32_t dcache_neg_hits = 0;
+static uint32_t dcache_misses = 0;
+static uint32_t dcache_evictions = 0;
+
+static __attribute__((unused)) void
+dcache_init(void)
+{
+        int i;
+
+        for (i = 0; i < DCACHE_BUCKETS; ++i)
+                list_init(&dcache_hash[i]);
+        list_init(&dcache_lru);
+        list_init(&dcache_free);
+        for (i = 0; i < DCACHE_ENTRIES; ++i) {
+                list_link_init(&dcache_entries[i].de_hash_link);
+                list_insert_tail(&dcache_free, &dcache_entries[i].de_lru_link);
+        }
+}
+init_func(dcache_init);
+
+/* FNV-1a over the directory and the name */
+static list_t *
+dcache_chain(fs_t *fs, ino_t dir, const char *name, size_t len)
+{
+        uint32_t h = 2166136261U;
+        size_t i;
+
+        h = (h ^ (uint32_t)fs) * 16777619U;
+        h = (h ^ dir) * 16777619U;
+        for (i = 0; i < len; ++i)
+                h = (h ^ (unsigned char)name[i]) * 16777619U;
+        return &dcache_hash[h & (DCACHE_BUCKETS - 1)];
+}
+
+static dcache_entry_t *
+dcache_find(list_t *chain, fs_t *fs, ino_t dir, const char *name, size_t len)
+{
+        dcache_entry_t *de;
+
+        list_iterate_begin(chain, de, dcache_entry_t, de_hash_link) {
+                if (de->de_fs == fs && de->de_dir == dir && de->de_len == len
+                    && 0 == memcmp(de->de_name, name, len))
+                        return de;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+dcache_drop(dcache_entry_t *de)
+{
+        list_remove(&de->de_hash_link);
+        list_remove(&de->de_lru_link);
+        list_insert_head(&dcache_free, &de->de_lru_link);
+}
+
+int
+dcache_lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
+{
+        dcache_entry_t *de;
+
+        if (len > NAME_LEN)
+                return 0;
+
+        de = dcache_find(dcache_chain(dir->vn_fs, dir->vn_vno, name, len),
+                         dir->vn_fs, dir->vn_vno, name, len);
+        if (NULL == de) {
+                dcache_misses++;
+                return 0;
+        }
+
+        list_remove(&de->de_lru_link);
+        list_insert_head(&dcache_lru, &de->de_lru_link);
+        if (de->de_negative) {
+                dcache_neg_hits++;
+                *result = NULL;
+        } else {
+                dcache_hits++;
+                *result = vget(dir->vn_fs, de->de_vno);
+        }
+        return 1;
+}
+
+uint32_t
+dcache_stamp(void)
+{
+        return dcache_purges;
+}
+
+void
+dcache_enter(vnode_t *dir, const char *name, size_t len, vnode_t *result,
+             uint32_t stamp)
+{
+        dcache_entry_t *de;
+        list_t *chain;
+
+        if (stamp != dcache_purges || len > NAME_LEN)
+                return;
+        if (NULL != result && result->vn_fs != dir->vn_fs)
+                return;
+
+        chain = dcache_chain(dir->vn_fs, dir->vn_vno, name, len);
+        if (NULL == (de = dcache_find(chain, dir->vn_fs, dir->vn_vno, name, len))) {
+                if (list_empty(&dcache_free)) {
+                        dcache_drop(list_tail(&dcache_lru, dcache_entry_t, de_lru_link));
+                        dcache_evictions++;
+                }
+                de = list_head(&dcache_free, dcache_entry_t, de_lru_link);
+                de->de_fs = dir->vn_fs;
+                de->de_dir = dir->vn_vno;
+                de->de_len = len;
+                memcpy(de->de_name, name, len);
+                list_insert_head(chain, &de->de_hash_link);
+        }
+        list_remove(&de->de_lru_link);
+        list_insert_head(&dcache_lru, &de->de_lru_link);
+
+        de->de_negative = (NULL == result);
+        de->de_vno = (NULL == result) ? 0 : result->vn_vno;
+}
+
+void
+dcache_purge(vnode_t *dir, const char *name, size_t len)
+{
+        dcache_entry_t *de;
+
+        dcache_purges++;
+        if (len > NAME_LEN)
+                return;
+
+        de = dcache_find(dcache_chain(dir->vn_fs, dir->vn_vno, name, len),
+                         dir->vn_fs, dir->vn_vno, name, len);
+        if (NULL != de)
+                dcache_drop(de);
+}
+
+void
+dcache_purge_dir(fs_t *fs, ino_t vno)
+{
+        dcache_entry_t *de;
+
+        dcache_purges++;
+        list_iterate_begin(&dcache_lru, de, dcache_entry_t, de_lru_link) {
+                if (de->de_fs == fs && de->de_dir == vno)
+                        dcache_drop(de);
+        } list_iterate_end();
+}
+
+void
+dcache_purge_fs(fs_t *fs)
+{
+        dcache_entry_t *de;
+
+        dcache_purges++;
+        list_iterate_begin(&dcache_lru, de, dcache_entry_t, de_lru_link) {
+                if (de->de_fs == fs)
+                        dcache_drop(de);
+        } list_iterate_end();
+}
+
+size_t
+dcache_info(const void *arg, char *buf, size_t osize)
+{
+        dcache_entry_t *de;
+        uint32_t nentries = 0, nnegative = 0;
+        size_t size = osize;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        list_iterate_begin(&dcache_lru, de, dcache_entry_t, de_lru_link) {
+                nentries++;
+                if (de->de_negative)
+                        nnegative++;
+        } list_iterate_end();
+
+        iprintf(&buf, &size, "%u of %u entries in use, %u negative\n",
+                nentries, DCACHE_ENTRIES, nnegative);
+        iprintf(&buf, &size, "%u hits, %u negative hits, %u misses\n",
+                dcache_hits, dcache_neg_hits, dcache_misses);
+        iprintf(&buf, &size, "%u evictions, %u purges\n",
+                dcache_evictions, dcache_purges);
+        return size;
+}
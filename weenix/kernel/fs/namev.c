@@ -7,6 +7,7 @@
 #include "util/printf.h"
 #include "util/debug.h"
    
+#include "fs/dcache.h"
 #include "fs/dirent.h"
 #include "fs/fcntl.h"
 #include "fs/stat.h"
@@ -20,6 +21,9 @@
  * "." and/or ".." here depnding on your implementation.
  * 
  * If dir has no lookup(), return -ENOTDIR.
+ *
+ * Names found, and names found not to exist, are kept in the dcache so
+ * that resolving them again does not go to the file system.
  * 
  * Note: returns with the vnode refcount on *result incremented.
  */
@@ -55,93 +59,39 @@ lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
              {
                 *result=dir->
              }*/
+            if (dcache_lookup(dir, name, len, result))
+            {
+                dbg(DBG_VFS,"VFS: Leave lookup(), %s cached\n", name);
+                return (NULL == *result) ? -ENOENT : 0;
+            }
+            uint32_t stamp = dcache_stamp();
             int ret = dir->vn_ops->lookup(dir,name,len,result);
+            if (0 == ret)
+                dcache_enter(dir, name, len, *result, stamp);
+            else if (-ENOENT == ret)
+                dcache_enter(dir, name, len, NULL, stamp);
             dbg(DBG_VFS,"VFS: Leave lookup(), find %s, error=%d\n", name, ret);
             return ret;
         }
         
 }
 
-char newPath[999];
-
-void convert_path(const char *pathname) {
-        dbg_print("In convert_path, before path=%s\n", pathname);
-        /*******path pre process*******/
-        /*******handle for '///'**********/
-        char newpath[999];
-        int i=0;
-        int j=0;
-        while(pathname[i]!='\0')
-        {
-            if(pathname[i]!='/')
-            {
-                newpath[j++]=pathname[i++];
-            }
-            else
-            {
-                newpath[j++]=pathname[i++];
-                while(pathname[i]=='/'){i++;}
-            }
-        }
-
-        newpath[j--]='\0';
-        if(newpath[j]=='/')
-        {
-            newpath[j--]='\0';
-        }
-
-
-        /*******handle for '../'' './'*******/
-            int oldP = 0;
-
-            int dotCount = 0;
-            int newP = 0;
-            while(newpath[oldP] != '\0') {
-                if(newpath[oldP] == '.') {
-                    newPath[newP] = newpath[oldP];
-                    dotCount++;
-                }
-                else if(newpath[oldP] == '/') {
-                    /* back to parent */
-                    if(dotCount == 2) {
-                        int count = 0;
-                        while(count != 2 && newP >= -1) {
-                            if(newPath[newP--] == '/')
-                                count++;
-                        }
-                        newP++;
-                        dotCount = 0;
-                    }
-                    else if(dotCount == 1) {
-                        dotCount = 0;
-                        newP -= 2;
-                    }
-                    else {
-                        newPath[newP] = newpath[oldP];
-                        dotCount = 0;
-                    }
-                }
-                else {
-                    newPath[newP] = newpath[oldP];
-                }
-                newP++;
-                oldP++;
-            }
-            if(newPath[newP-1] == '.' && newPath[newP-2] == '/') {
-                newP -= 2;
-            }
-            if(newPath[newP-1] == '.' && newPath[newP-2] == '.' && newPath[newP-3] == '/') {
-                int count = 0;
-                while(count != 2 && newP >= -1) {
-                    if(newPath[newP--] == '/')
-                        count++;
-                }
-                newP += 2;
-            }
-            if(newPath[newP-1]=='/')
-                newP--;
-            newPath[newP] = '\0';
+/*
+ * Moves *pathp past any slashes and returns the length of the component
+ * which starts there, 0 at the end of the path.
+ */
+static size_t
+namev_next(const char **pathp)
+{
+        const char *p = *pathp;
+        size_t len = 0;
 
+        while ('/' == *p)
+                ++p;
+        *pathp = p;
+        while ('\0' != p[len] && '/' != p[len])
+                ++len;
+        return len;
 }
 
 /* When successful this function returns data in the following "out"-arguments:
@@ -159,6 +109,12 @@ void convert_path(const char *pathname) {
  * vfs_root_vn.  dir_namev() should call lookup() to take care of resolving each
  * piece of the pathname.
  *
+ * The path is walked in place, one component at a time, with "." and
+ * repeated or trailing slashes skipped as they are met; *name points into
+ * pathname. A path of nothing but slashes gives the root and ".". Nothing
+ * is shared between walks, so any number may be blocked in lookups at
+ * once.
+ *
  * Note: A successful call to this causes vnode refcount on *res_vnode to
  * be incremented.
  */
@@ -166,80 +122,68 @@ int
 dir_namev(const char *pathname, size_t *namelen, const char **name,
           vnode_t *base, vnode_t **res_vnode)
 {
-        dbg(DBG_VFS,"VFS: Enter dir_namev(), look for path %s\n", pathname);
-
-        convert_path(pathname);
-        pathname = newPath;
-        dbg_print("In dir_namev(), newpath=%s\n", pathname);
+        const char *comp, *next;
+        size_t len, nextlen;
+        vnode_t *dir, *child;
+        int err;
 
         KASSERT(NULL != pathname);
         KASSERT(NULL != namelen);
         KASSERT(NULL != name);
         KASSERT(NULL != res_vnode);
-        int err=0;
-        if(pathname[0]=='\0')
-        {
-            return -EINVAL;
+        dbg(DBG_VFS, "VFS: Enter dir_namev(), look for path %s\n", pathname);
+
+        if ('\0' == pathname[0])
+                return -EINVAL;
+
+        if ('/' == pathname[0])
+                dir = vfs_root_vn;
+        else
+                dir = (NULL == base) ? curproc->p_cwd : base;
+        /* Held for as long as the walk is in dir, since the lookups
+         * below may block while the cwd is changed by another thread */
+        vref(dir);
+
+        comp = pathname;
+        if (0 == (len = namev_next(&comp))) {
+                /* Nothing but slashes: the root itself */
+                *res_vnode = dir;
+                *name = ".";
+                *namelen = 1;
+                return 0;
         }
-        vnode_t* basic;
-        basic=base==NULL?curproc->p_cwd:base;
-        basic=pathname[0]=='/'?vfs_root_vn:basic;
-        int last=pathname[0]=='/'?1:0;
-        /*vget(basic->vn_fs,basic->vn_vno);*/
-        int i = last;
-        do
-        {
-            while(pathname[i++]!='/')
-            {
-                if(pathname[i]=='\0')
-                {
-                    if(i-last>STR_MAX)
-                    {
-                        /*vput(basic);*/
-                        dbg(DBG_VFS,"VFS: Leave dir_namev(), return error ENAMETOOLONG\n");
+
+        /* Trailing slashes belong to the last component, so a component
+         * is the last one when only slashes follow it */
+        for (next = comp + len; 0 != (nextlen = namev_next(&next));
+             comp = next, len = nextlen, next = comp + len) {
+                if (len >= NAME_LEN) {
+                        vput(dir);
                         return -ENAMETOOLONG;
-                    }
-                    *res_vnode=basic;
-                    *namelen=i-last;
-                    *name=&pathname[last];
-                    vget(basic->vn_fs,basic->vn_vno);
-                    KASSERT(NULL !=res_vnode);
-                    dbg(DBG_VFS,"VFS: Leave dir_namev(), find path %s\n", *name);
-                    return 0;
                 }
-            }
-            while(pathname[i]=='/')
-            {
-                i++;
-            }
-            if(pathname[i]!='\0')
-            {
-                if(i-last-1>STR_MAX) {
-                    dbg(DBG_VFS,"VFS: Leave dir_namev(), return error ENAMETOOLONG\n");
-                    return -ENAMETOOLONG;
+                /* "." stays put; ".." is looked up like any other name,
+                 * the file system knows the parent */
+                if (1 == len && '.' == comp[0])
+                        continue;
+                err = lookup(dir, comp, len, &child);
+                vput(dir);
+                if (0 != err) {
+                        dbg(DBG_VFS, "VFS: Leave dir_namev(), can't find %s: %d\n",
+                            pathname, err);
+                        return err;
                 }
-                dbg_print("VFS:In dir_namev(), before lookup(), look for %s, length=%d\n", pathname+last, i-last-1);
-                if((err=lookup(basic,pathname + last,i-last-1,res_vnode)))
-                {
-                    /*vput(basic);*/
-                    dbg(DBG_VFS,"VFS: Leave dir_namev(), return lookup error, can't find path %s\n", pathname + last);
-                    return err;
-                }
-                dbg(DBG_VFS,"VFS: Parent path:%s\n",pathname+last);
-                dbg(DBG_VFS,"VFS: Child name:%s\n",pathname+i);
-                last=i;
-                basic=*res_vnode;
-                vput(*res_vnode);
-            }
-            else/*handle*/
-            {
-                *res_vnode=basic;
-                namelen=0;
-                name=NULL;
-                dbg(DBG_VFS,"VFS: Leave dir_namev(), find /, special case\n");
-                return 0;
-            }
-        }while(1);
+                dir = child;
+        }
+
+        if (len >= NAME_LEN) {
+                vput(dir);
+                return -ENAMETOOLONG;
+        }
+        *res_vnode = dir;
+        *name = comp;
+        *namelen = len;
+        dbg(DBG_VFS, "VFS: Leave dir_namev(), vno %d holds %s\n", dir->vn_vno, comp);
+        return 0;
 }
 
 
@@ -256,8 +200,6 @@ open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
 {
         dbg(DBG_VFS,"VFS: Enter open_namev()\n");
 
-        convert_path(pathname);
-
         size_t len;
         const char *name;
         int err=0;
@@ -276,6 +218,7 @@ open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
             {
                 KASSERT(NULL != par->vn_ops->create);
                 int ret = par->vn_ops->create(par,name,len,res_vnode);
+                dcache_purge(par, name, len);
                 vput(par);
                 dbg(DBG_VFS,"VFS: Leave open_namev(), file not exist, create file\n");
                 return 0;
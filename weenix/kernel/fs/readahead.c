@@ -0,0 +1,170 @@
+#include "kernel.h"
+#include "config.h"
+#include "globals.h"
+
+#include "fs/readahead.h"
+
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+
+/*
+ * Readahead requests are handed to a daemon, so that the reader can go on
+ * copying out the pages it already has while the ones after them are
+ * being read in. Requests are only hints: if the queue is full, they are
+ * dropped.
+ */
+#define READAHEAD_QUEUE_LEN     16
+
+typedef struct readahead_req {
+        mmobj_t        *rr_obj;
+        uint32_t        rr_start;
+        uint32_t        rr_npages;
+} readahead_req_t;
+
+static readahead_req_t readahead_queue[READAHEAD_QUEUE_LEN];
+static int readahead_head = 0;      /* next request to service */
+static int readahead_count = 0;     /* number of requests queued */
+static int readahead_busy = 0;      /* 1 while a request is being serviced */
+static int readahead_stopping = 0;  /* no more requests are accepted */
+
+static proc_t *readahead_proc = NULL;
+static kthread_t *readahead_thr = NULL;
+static ktqueue_t readahead_waitq;   /* the daemon waits here for requests */
+static ktqueue_t readahead_idleq;   /* readahead_shutdown waits here */
+
+static void *readahead_run(int arg1, void *arg2);
+
+static __attribute__((unused)) void
+readahead_init(void)
+{
+        sched_queue_init(&readahead_waitq);
+        sched_queue_init(&readahead_idleq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        readahead_proc = proc_create("readaheadd");
+        KASSERT(NULL != readahead_proc);
+        readahead_thr = kthread_create(readahead_proc, readahead_run, 0, NULL);
+        KASSERT(NULL != readahead_thr);
+
+        sched_make_runnable(readahead_thr);
+}
+init_func(readahead_init);
+init_depends(sched_init);
+
+static void
+readahead_submit(mmobj_t *o, uint32_t start, uint32_t npages)
+{
+        readahead_req_t *req;
+
+        if (readahead_stopping || READAHEAD_QUEUE_LEN == readahead_count) {
+                dbg(DBG_VFS, "readahead: dropping pages %u-%u of obj %p\n",
+                    start, start + npages - 1, o);
+                return;
+        }
+
+        req = &readahead_queue[(readahead_head + readahead_count) % READAHEAD_QUEUE_LEN];
+        o->mmo_ops->ref(o);
+        req->rr_obj = o;
+        req->rr_start = start;
+        req->rr_npages = npages;
+        readahead_count++;
+
+        sched_broadcast_on(&readahead_waitq);
+}
+
+void
+readahead_access(readahead_t *ra, mmobj_t *o, uint32_t pagenum,
+                 uint32_t npages, uint32_t endpage)
+{
+        uint32_t end = pagenum + npages;
+
+        /* Sequential if we pick up where the last read stopped, which may
+         * be in the middle of its last page */
+        if (pagenum != ra->ra_next && pagenum + 1 != ra->ra_next) {
+                ra->ra_size = 0;
+                ra->ra_next = end;
+                return;
+        }
+        ra->ra_next = end;
+
+        if (0 == ra->ra_size) {
+                ra->ra_start = end;
+                ra->ra_size = READAHEAD_MIN_PAGES;
+        } else if (end > ra->ra_start) {
+                /* the reader is in the last window, so issue the next one
+                 * (if the reader has overtaken it, start after the reader) */
+                ra->ra_start = MAX(ra->ra_start + ra->ra_size, end);
+                ra->ra_size = MIN(ra->ra_size << 1, (uint32_t)READAHEAD_MAX_PAGES);
+        } else {
+                return;
+        }
+
+        if (ra->ra_start < endpage)
+                readahead_submit(o, ra->ra_start,
+                                 MIN(ra->ra_size, endpage - ra->ra_start));
+}
+
+void
+readahead_shutdown(void)
+{
+        int child;
+
+        KASSERT(PID_IDLE == curproc->p_pid);
+
+        readahead_stopping = 1;
+        while (readahead_busy || 0 < readahead_count)
+                sched_sleep_on(&readahead_idleq);
+
+        kthread_cancel(readahead_thr, (void *) 0);
+        readahead_thr = NULL;
+        child = do_waitpid(readahead_proc->p_pid, 0, NULL);
+        KASSERT(child == readahead_proc->p_pid);
+        readahead_proc = NULL;
+}
+
+/*
+ * The readahead daemon: reads in the pages of each request which are not
+ * resident yet, in order. The window is handed to pframe_prefetch in
+ * clusters, so that the pages of each cluster which are missing are read
+ * with as few requests as the object allows rather than one at a time.
+ * If reading fails, e.g. because it is past the end of the device, the
+ * rest of the request is dropped.
+ * Both arguments unused.
+ */
+static void *
+readahead_run(int arg1, void *arg2)
+{
+        while (1) {
+                readahead_req_t req;
+                uint32_t i, n;
+
+                while (0 == readahead_count) {
+                        sched_broadcast_on(&readahead_idleq);
+                        if (sched_cancellable_sleep_on(&readahead_waitq))
+                                kthread_exit((void *) 0);
+                }
+
+                req = readahead_queue[readahead_head];
+                readahead_head = (readahead_head + 1) % READAHEAD_QUEUE_LEN;
+                readahead_count--;
+                readahead_busy = 1;
+
+                for (i = 0; i < req.rr_npages; i += n) {
+                        n = MIN(req.rr_npages - i, (uint32_t)PFRAME_CLUSTER_MAX);
+                        if (0 > pframe_prefetch(req.rr_obj, req.rr_start + i, n))
+                                break;
+                }
+
+                req.rr_obj->mmo_ops->put(req.rr_obj);
+                readahead_busy = 0;
+        }
+        return NULL;
+}
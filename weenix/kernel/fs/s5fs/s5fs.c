@@ -59,8 +59,10 @@ static int  s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen);
 static int  s5fs_readdir(vnode_t *vnode, int offset, struct dirent *d);
 static int  s5fs_stat(vnode_t *vnode, struct stat *ss);
 static int  s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf);
+static int  s5fs_fillpages(vnode_t *vnode, off_t offset, void **pagebufs, int npages);
 static int  s5fs_dirtypage(vnode_t *vnode, off_t offset);
 static int  s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf);
+static int  s5fs_cleanpages(vnode_t *vnode, off_t offset, void **pagebufs, int npages);
 
 fs_ops_t s5fs_fsops = {
         s5fs_read_vnode,
@@ -84,8 +86,10 @@ static vnode_ops_t s5fs_dir_vops = {
         .readdir = s5fs_readdir,
         .stat = s5fs_stat,
         .fillpage = s5fs_fillpage,
+        .fillpages = s5fs_fillpages,
         .dirtypage = s5fs_dirtypage,
-        .cleanpage = s5fs_cleanpage
+        .cleanpage = s5fs_cleanpage,
+        .cleanpages = s5fs_cleanpages
 };
 
 /* vnode operations table for regular files: */
@@ -103,8 +107,10 @@ static vnode_ops_t s5fs_file_vops = {
         .readdir = NULL,
         .stat = s5fs_stat,
         .fillpage = s5fs_fillpage,
+        .fillpages = s5fs_fillpages,
         .dirtypage = s5fs_dirtypage,
-        .cleanpage = s5fs_cleanpage
+        .cleanpage = s5fs_cleanpage,
+        .cleanpages = s5fs_cleanpages
 };
 
 /*
@@ -158,12 +164,16 @@ s5fs_mount(struct fs *fs)
 
         pframe_pin(vp);
 
-        /*     init s5f_mutex: */
-        kmutex_init(&s5->s5f_mutex);
+        /*     init s5f_inode_mutex and s5f_block_mutex: */
+        kmutex_init(&s5->s5f_inode_mutex);
+        kmutex_init(&s5->s5f_block_mutex);
 
         /*     init s5f_fs: */
         s5->s5f_fs = fs;
 
+        s5->s5f_alloc_rotor = s5->s5f_super->s5s_bitmap_block
+                              + s5->s5f_super->s5s_bitmap_blocks;
+        memset(s5->s5f_bmap, 0, sizeof(s5->s5f_bmap));
 
         /* Init the members of fs that we (the fs-implementation) are
          * responsible for initializing: */
@@ -449,7 +459,8 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
  * it). Remember that the directory must be empty (except for "." and
  * "..").
  *
- * You probably want to use s5_find_dirent() and s5_remove_dirent().
+ * You probably want to use s5_find_dirent(), s5_dir_entries() and
+ * s5_remove_dirent().
  */
 static int
 s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
@@ -462,7 +473,7 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 /*
  * See the comment in vnode.h for what is expected of this function.
  *
- * Here you need to use s5_read_file() to read a s5_dirent_t from a directory
+ * Here you need to use s5_read_dirent() to read a s5_dirent_t from a directory
  * and copy that data into the given dirent. The value of d_off is dependent on
  * your implementation and may or may not b e necessary.  Finally, return the
  * number of bytes read.
@@ -505,6 +516,45 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
         return -1;
 }
 
+/*
+ * Reads npages pages at once, for readahead. s5_block_run() finds each
+ * run of blocks which are next to each other on disk, and the run is
+ * read straight into the page buffers with a single request to the
+ * device if it takes vectors, or a block at a time if it doesn't.
+ * Sparse runs read as zeroes.
+ */
+static int
+s5fs_fillpages(vnode_t *vnode, off_t offset, void **pagebufs, int npages)
+{
+        blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
+        uint32_t run, i;
+        int done, block, ret = 0;
+
+        KASSERT(S5_BLOCK_SIZE == PAGE_SIZE);
+
+        for (done = 0; done < npages; done += run) {
+                block = s5_block_run(vnode, offset + done * S5_BLOCK_SIZE,
+                                     npages - done, &run);
+                if (0 > block)
+                        return block;
+
+                if (0 == block) {
+                        for (i = 0; i < run; i++)
+                                memset(pagebufs[done + i], 0, S5_BLOCK_SIZE);
+                } else if (NULL != bd->bd_ops->read_blockv) {
+                        ret = bd->bd_ops->read_blockv(bd, (char **)&pagebufs[done],
+                                                      block, run);
+                } else {
+                        for (i = 0; i < run && 0 == ret; i++)
+                                ret = bd->bd_ops->read_block(bd, pagebufs[done + i],
+                                                             block + i, 1);
+                }
+                if (0 > ret)
+                        return ret;
+        }
+        return 0;
+}
+
 
 /*
  * if this offset is NOT within a sparse region of the file
@@ -537,6 +587,42 @@ s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
         return -1;
 }
 
+/*
+ * Writes npages pages at once, for writeback. Like s5fs_fillpages, each
+ * run of blocks which are next to each other on disk goes out with a
+ * single request if the device takes vectors. The pages are dirty, so
+ * their blocks were allocated by dirtypage and none of them is sparse.
+ */
+static int
+s5fs_cleanpages(vnode_t *vnode, off_t offset, void **pagebufs, int npages)
+{
+        blockdev_t *bd = VNODE_TO_S5FS(vnode)->s5f_bdev;
+        uint32_t run, i;
+        int done, block, ret = 0;
+
+        KASSERT(S5_BLOCK_SIZE == PAGE_SIZE);
+
+        for (done = 0; done < npages; done += run) {
+                block = s5_block_run(vnode, offset + done * S5_BLOCK_SIZE,
+                                     npages - done, &run);
+                if (0 > block)
+                        return block;
+                KASSERT(0 != block && "cleaning a sparse page");
+
+                if (NULL != bd->bd_ops->write_blockv) {
+                        ret = bd->bd_ops->write_blockv(bd, (char **)&pagebufs[done],
+                                                       block, run);
+                } else {
+                        for (i = 0; i < run && 0 == ret; i++)
+                                ret = bd->bd_ops->write_block(bd, pagebufs[done + i],
+                                                              block + i, 1);
+                }
+                if (0 > ret)
+                        return ret;
+        }
+        return 0;
+}
+
 /* Diagnostic/Utility: */
 
 /*
@@ -557,6 +643,11 @@ s5_check_super(s5_super_t *super)
                     super->s5s_version, S5_CURRENT_VERSION);
                 return -1;
         }
+        if (super->s5s_bitmap_blocks != S5_BITMAP_BLOCKS(super->s5s_num_blocks)
+            || super->s5s_bitmap_block <= S5_INODE_BLOCK(super->s5s_num_inodes - 1)
+            || super->s5s_bitmap_block + super->s5s_bitmap_blocks
+            >= super->s5s_num_blocks)
+                return -1;
         return 0;
 }
 
@@ -7,6 +7,7 @@
 
 #include "kernel.h"
 #include "util/debug.h"
+#include "util/bits.h"
 #include "mm/kmalloc.h"
 #include "globals.h"
 #include "proc/sched.h"
@@ -42,8 +43,360 @@
 
 
 static void s5_free_block(s5fs_t *fs, int block);
-static int s5_alloc_block(s5fs_t *);
+static int s5_alloc_block(s5fs_t *fs, uint32_t goal);
 
+/*
+ * The block to try to allocate for block blocknum of a file: the one
+ * after the file's previous block, so that files written sequentially
+ * are laid out contiguously. Returns 0 (no preference) if there is no
+ * previous block.
+ */
+static uint32_t
+s5_block_goal(vnode_t *vnode, uint32_t blocknum)
+{
+        int prev;
+
+        if (0 == blocknum)
+                return 0;
+        prev = s5_seek_to_block(vnode, (off_t)(blocknum - 1) * S5_BLOCK_SIZE, 0);
+        return (0 < prev) ? (uint32_t)prev + 1 : 0;
+}
+
+
+/* Like name_match, for a name in a directory entry on disk, which is
+ * only NUL-terminated if it is shorter than S5_NAME_LEN */
+#define s5_name_match(dname, name, namelen)                             \
+        (strnlen((dname), S5_NAME_LEN) == (namelen)                     \
+         && !strncmp((dname), (name), (namelen)))
+
+/* The block map cache entry for the indirect block of inode ino which
+ * maps file blocks from lblock on */
+#define s5_bmap_slot(fs, ino, lblock)                                   \
+        (&(fs)->s5f_bmap[((ino) * 0x9e3779b1U + (lblock))               \
+                         & (S5_BMAP_CACHE_SIZE - 1)])
+
+/*
+ * Drops every block map cache entry of an inode, whose blocks are
+ * about to be freed.
+ */
+static void
+s5_bmap_forget(s5fs_t *fs, uint32_t ino)
+{
+        int i;
+
+        for (i = 0; i < S5_BMAP_CACHE_SIZE; i++) {
+                if (fs->s5f_bmap[i].sb_ino == ino)
+                        fs->s5f_bmap[i].sb_pblock = 0;
+        }
+}
+
+/* The inode field pointing to the root of the tree of the given
+ * level of indirection, 1 to S5_INDIRECT_LEVELS */
+static uint32_t *
+s5_indirect_root(s5_inode_t *inode, int level)
+{
+        switch (level) {
+                case 1:
+                        return &inode->s5_indirect_block;
+                case 2:
+                        return &inode->s5_dindirect_block;
+                default:
+                        KASSERT(3 == level);
+                        return &inode->s5_tindirect_block;
+        }
+}
+
+/*
+ * A node of an extent tree, either the root in the inode (en_pf is
+ * NULL) or a block, which is pinned for as long as it is in use.
+ */
+typedef struct s5_extent_node {
+        pframe_t                *en_pf;
+        s5_extent_header_t      *en_hdr;
+        s5_extent_t             *en_ext;
+} s5_extent_node_t;
+
+static void
+s5_extent_root(s5_inode_t *inode, s5_extent_node_t *node)
+{
+        node->en_pf = NULL;
+        node->en_hdr = &inode->s5_extent_head;
+        node->en_ext = inode->s5_extents;
+}
+
+static int
+s5_extent_get(s5fs_t *fs, uint32_t blockno, s5_extent_node_t *node)
+{
+        int ret;
+
+        if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(fs), blockno, &node->en_pf)))
+                return ret;
+        pframe_pin(node->en_pf);
+        node->en_hdr = (s5_extent_header_t *)node->en_pf->pf_addr;
+        node->en_ext = (s5_extent_t *)(node->en_hdr + 1);
+        return 0;
+}
+
+static void
+s5_extent_put(s5_extent_node_t *node)
+{
+        if (NULL != node->en_pf)
+                pframe_unpin(node->en_pf);
+}
+
+static void
+s5_extent_dirty(s5fs_t *fs, s5_inode_t *inode, s5_extent_node_t *node)
+{
+        if (NULL == node->en_pf)
+                s5_dirty_inode(fs, inode);
+        else
+                pframe_dirty(node->en_pf);
+}
+
+/* Index of the last entry of a node starting at or before lblock, or
+ * -1 if they all start after it */
+static int
+s5_extent_search(s5_extent_node_t *node, uint32_t lblock)
+{
+        int lo = 0, hi = node->en_hdr->s5eh_count, mid;
+
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (node->en_ext[mid].s5e_lblock <= lblock)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo - 1;
+}
+
+/*
+ * Looks up block lblock of an extent-mapped file. Returns the disk
+ * block holding it and sets *run to the number of blocks from lblock to
+ * the end of its extent, or returns 0 if lblock is sparse and sets *run
+ * to the number of sparse blocks from lblock on. Returns -errno on
+ * error.
+ */
+static int
+s5_extent_lookup(s5fs_t *fs, s5_inode_t *inode, uint32_t lblock, uint32_t *run)
+{
+        s5_extent_node_t node, child;
+        s5_extent_t *e;
+        uint32_t end = S5_MAX_FILE_BLOCKS;
+        int i, ret;
+
+        s5_extent_root(inode, &node);
+        for (;;) {
+                i = s5_extent_search(&node, lblock);
+                if (i + 1 < node.en_hdr->s5eh_count)
+                        end = node.en_ext[i + 1].s5e_lblock;
+                if (0 > i) {
+                        ret = 0;
+                        *run = end - lblock;
+                        break;
+                }
+                e = &node.en_ext[i];
+                if (0 == node.en_hdr->s5eh_depth) {
+                        if (lblock - e->s5e_lblock < e->s5e_len) {
+                                ret = e->s5e_pblock + (lblock - e->s5e_lblock);
+                                *run = e->s5e_len - (lblock - e->s5e_lblock);
+                        } else {
+                                ret = 0;
+                                *run = end - lblock;
+                        }
+                        break;
+                }
+                if (0 > (ret = s5_extent_get(fs, e->s5e_pblock, &child)))
+                        break;
+                KASSERT(child.en_hdr->s5eh_depth + 1 == node.en_hdr->s5eh_depth);
+                s5_extent_put(&node);
+                node = child;
+        }
+        s5_extent_put(&node);
+        return ret;
+}
+
+/* Inserts e as entry i of node, which must have room for it */
+static void
+s5_extent_insert_at(s5_extent_node_t *node, int i, uint32_t lblock,
+                    uint32_t pblock, uint32_t len)
+{
+        int j;
+
+        for (j = node->en_hdr->s5eh_count; j > i; j--)
+                node->en_ext[j] = node->en_ext[j - 1];
+        node->en_ext[i].s5e_lblock = lblock;
+        node->en_ext[i].s5e_pblock = pblock;
+        node->en_ext[i].s5e_len = len;
+        node->en_hdr->s5eh_count++;
+}
+
+/*
+ * The block to try to allocate for a new extent node which will hold
+ * entries from entry i of node on: the first block they map, so that
+ * the search starts in the allocation group of the file's data rather
+ * than wherever the last allocation on the file system left off.
+ */
+#define s5_extent_goal(node, i)  ((node)->en_ext[(i)].s5e_pblock)
+
+/*
+ * Moves the entries of a full root into a new block, leaving the root
+ * with a single entry pointing to it, one level higher.
+ */
+static int
+s5_extent_grow(s5fs_t *fs, s5_inode_t *inode)
+{
+        s5_extent_node_t root, node;
+        int blockno, ret;
+
+        s5_extent_root(inode, &root);
+        if (S5_EXTENT_MAX_DEPTH == root.en_hdr->s5eh_depth)
+                return -EFBIG;
+        if (0 > (blockno = s5_alloc_block(fs, s5_extent_goal(&root, 0))))
+                return blockno;
+        if (0 > (ret = s5_extent_get(fs, blockno, &node))) {
+                s5_free_block(fs, blockno);
+                return ret;
+        }
+
+        *node.en_hdr = *root.en_hdr;
+        memcpy(node.en_ext, root.en_ext, root.en_hdr->s5eh_count * sizeof(s5_extent_t));
+        root.en_hdr->s5eh_depth++;
+        root.en_hdr->s5eh_count = 1;
+        root.en_ext[0].s5e_lblock = node.en_ext[0].s5e_lblock;
+        root.en_ext[0].s5e_pblock = blockno;
+        root.en_ext[0].s5e_len = 0;
+
+        pframe_dirty(node.en_pf);
+        s5_extent_put(&node);
+        s5_dirty_inode(fs, inode);
+        return 0;
+}
+
+/*
+ * Splits child, a full block which is entry i of parent, moving its
+ * upper half into a new block that becomes entry i + 1 of parent. On
+ * return child is whichever half covers lblock.
+ */
+static int
+s5_extent_split(s5fs_t *fs, s5_inode_t *inode, s5_extent_node_t *parent,
+                int i, s5_extent_node_t *child, uint32_t lblock)
+{
+        s5_extent_node_t sib;
+        int half = S5_BLOCK_NEXTENTS / 2;
+        int blockno, ret;
+
+        if (0 > (blockno = s5_alloc_block(fs, s5_extent_goal(child, half))))
+                return blockno;
+        if (0 > (ret = s5_extent_get(fs, blockno, &sib))) {
+                s5_free_block(fs, blockno);
+                return ret;
+        }
+
+        sib.en_hdr->s5eh_depth = child->en_hdr->s5eh_depth;
+        sib.en_hdr->s5eh_count = child->en_hdr->s5eh_count - half;
+        memcpy(sib.en_ext, &child->en_ext[half],
+               sib.en_hdr->s5eh_count * sizeof(s5_extent_t));
+        child->en_hdr->s5eh_count = half;
+        s5_extent_insert_at(parent, i + 1, sib.en_ext[0].s5e_lblock, blockno, 0);
+
+        pframe_dirty(sib.en_pf);
+        pframe_dirty(child->en_pf);
+        s5_extent_dirty(fs, inode, parent);
+
+        if (lblock >= sib.en_ext[0].s5e_lblock) {
+                s5_extent_put(child);
+                *child = sib;
+        } else {
+                s5_extent_put(&sib);
+        }
+        return 0;
+}
+
+/*
+ * Allocates a disk block for block lblock of an extent-mapped file,
+ * which must be sparse, and returns it. The block is allocated right
+ * after the preceding extent if possible, which then grows to include
+ * it; otherwise a new extent is inserted.
+ *
+ * Full nodes are split on the way down, so that the leaf always has
+ * room and no node has to be revisited afterwards.
+ */
+static int
+s5_extent_alloc(s5fs_t *fs, s5_inode_t *inode, uint32_t lblock)
+{
+        s5_extent_node_t node, child;
+        s5_extent_t *e = NULL;
+        uint32_t goal = 0;
+        int i, ret;
+
+        s5_extent_root(inode, &node);
+        if (S5_INODE_NEXTENTS == node.en_hdr->s5eh_count
+            && 0 > (ret = s5_extent_grow(fs, inode)))
+                return ret;
+
+        while (0 < node.en_hdr->s5eh_depth) {
+                if (0 > (i = s5_extent_search(&node, lblock))) {
+                        /* The new extent will be the first of the
+                         * subtree, so its bound goes down */
+                        i = 0;
+                        node.en_ext[0].s5e_lblock = lblock;
+                        s5_extent_dirty(fs, inode, &node);
+                }
+                if (0 > (ret = s5_extent_get(fs, node.en_ext[i].s5e_pblock, &child)))
+                        goto out;
+                if (S5_BLOCK_NEXTENTS == child.en_hdr->s5eh_count
+                    && 0 > (ret = s5_extent_split(fs, inode, &node, i, &child, lblock))) {
+                        s5_extent_put(&child);
+                        goto out;
+                }
+                s5_extent_put(&node);
+                node = child;
+        }
+
+        i = s5_extent_search(&node, lblock);
+        if (0 <= i) {
+                e = &node.en_ext[i];
+                KASSERT(lblock - e->s5e_lblock >= e->s5e_len);
+                goal = e->s5e_pblock + (lblock - e->s5e_lblock);
+        }
+        if (0 > (ret = s5_alloc_block(fs, goal)))
+                goto out;
+
+        if (0 <= i && lblock == e->s5e_lblock + e->s5e_len
+            && (uint32_t)ret == e->s5e_pblock + e->s5e_len)
+                e->s5e_len++;
+        else
+                s5_extent_insert_at(&node, i + 1, lblock, ret, 1);
+        s5_extent_dirty(fs, inode, &node);
+out:
+        s5_extent_put(&node);
+        return ret;
+}
+
+/* Frees every block of the extent tree under node */
+static void
+s5_extent_free(s5fs_t *fs, s5_extent_node_t *node)
+{
+        s5_extent_node_t child;
+        s5_extent_t *e;
+        uint32_t i, b;
+        int ret;
+
+        for (i = 0; i < node->en_hdr->s5eh_count; i++) {
+                e = &node->en_ext[i];
+                if (0 == node->en_hdr->s5eh_depth) {
+                        for (b = 0; b < e->s5e_len; b++)
+                                s5_free_block(fs, e->s5e_pblock + b);
+                        continue;
+                }
+                ret = s5_extent_get(fs, e->s5e_pblock, &child);
+                KASSERT(!ret && "because never fails for block_device vm_objects");
+                s5_extent_free(fs, &child);
+                s5_extent_put(&child);
+                s5_free_block(fs, e->s5e_pblock);
+        }
+}
 
 /*
  * Return the disk-block number for the given seek pointer (aka file
@@ -54,36 +407,210 @@ static int s5_alloc_block(s5fs_t *);
  * alloc is true, then allocate a new disk block (and make the inode
  * point to it) and return it.
  *
- * Be sure to handle indirect blocks!
+ * Blocks past the direct blocks are found through a tree of indirect
+ * blocks: S5_NIDIRECT_BLOCKS of them under the single indirect block,
+ * then S5_NIDIRECT_BLOCKS^2 under the double indirect block and the
+ * rest under the triple indirect block. Missing indirect blocks are
+ * allocated (and zeroed) on the way down when alloc is true.
  *
- * If there is an error, return -errno.
+ * The indirect blocks at the bottom of the tree, which hold the numbers
+ * of data blocks, are remembered in the filesystem's block map cache,
+ * so that access anywhere within the S5_NIDIRECT_BLOCKS blocks one of
+ * them maps goes straight to it rather than walking down from the inode
+ * again. Indirect blocks are only ever freed with their inode, so
+ * entries stay valid until s5_free_inode drops them.
+ *
+ * New blocks are allocated right after the file's previous block when
+ * that one is free, so sequential writes produce contiguous runs.
  *
- * You probably want to use pframe_get, pframe_pin, pframe_unpin, pframe_dirty.
+ * Inodes with S5_INODE_EXTENTS set are looked up in their extent tree
+ * instead.
+ *
+ * If there is an error, return -errno.
  */
 int
 s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_seek_to_block");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        uint32_t blocknum = S5_DATA_BLOCK(seekptr);
+        uint32_t index, first, span, run, *slot;
+        s5_bmap_entry_t *cached;
+        pframe_t *pf = NULL, *parent;
+        int depth, fresh, ret;
+
+        if (blocknum >= S5_MAX_FILE_BLOCKS)
+                return -EFBIG;
+
+        if (inode->s5_flags & S5_INODE_EXTENTS) {
+                if (0 != (ret = s5_extent_lookup(fs, inode, blocknum, &run)) || !alloc)
+                        return ret;
+                return s5_extent_alloc(fs, inode, blocknum);
+        }
+
+        if (blocknum < S5_NDIRECT_BLOCKS) {
+                slot = &inode->s5_direct_blocks[blocknum];
+                if (0 == *slot && alloc) {
+                        if (0 > (ret = s5_alloc_block(fs, s5_block_goal(vnode, blocknum))))
+                                return ret;
+                        *slot = ret;
+                        s5_dirty_inode(fs, inode);
+                }
+                return *slot;
+        }
+
+        /* Find the tree holding blocknum and its index within the tree;
+         * span ends up as the number of blocks under the tree's root.
+         * Every S5_NIDIRECT_BLOCKS blocks from the end of the direct
+         * blocks on share an indirect block at the bottom of a tree,
+         * which is cached under the first of them. */
+        index = blocknum - S5_NDIRECT_BLOCKS;
+        first = blocknum - index % S5_NIDIRECT_BLOCKS;
+        cached = s5_bmap_slot(fs, inode->s5_number, first);
+        if (0 != cached->sb_pblock && inode->s5_number == cached->sb_ino
+            && first == cached->sb_lblock) {
+                if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(fs), cached->sb_pblock, &pf)))
+                        return ret;
+                pframe_pin(pf);
+                depth = 0;
+                slot = (uint32_t *)pf->pf_addr + index % S5_NIDIRECT_BLOCKS;
+        } else {
+                span = S5_NIDIRECT_BLOCKS;
+                for (depth = 1; index >= span; depth++) {
+                        index -= span;
+                        span *= S5_NIDIRECT_BLOCKS;
+                }
+                slot = s5_indirect_root(inode, depth);
+        }
+
+        /* slot points at the block of the given depth, an indirect block
+         * if depth > 0 and the data block at 0 */
+        for (;; depth--) {
+                fresh = (0 == *slot);
+                if (fresh) {
+                        if (!alloc) {
+                                ret = 0;
+                                goto out;
+                        }
+                        if (0 > (ret = s5_alloc_block(fs, s5_block_goal(vnode, blocknum))))
+                                goto out;
+                        *slot = ret;
+                        if (NULL == pf)
+                                s5_dirty_inode(fs, inode);
+                        else
+                                pframe_dirty(pf);
+                }
+                if (0 == depth)
+                        break;
+
+                parent = pf;
+                if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(fs), *slot, &pf))) {
+                        if (fresh) {
+                                s5_free_block(fs, *slot);
+                                *slot = 0;
+                        }
+                        pf = parent;
+                        goto out;
+                }
+                pframe_pin(pf);
+                if (NULL != parent)
+                        pframe_unpin(parent);
+                if (fresh) {
+                        memset(pf->pf_addr, 0, S5_BLOCK_SIZE);
+                        pframe_dirty(pf);
+                }
+                if (1 == depth) {
+                        cached->sb_ino = inode->s5_number;
+                        cached->sb_lblock = first;
+                        cached->sb_pblock = pf->pf_pagenum;
+                }
+
+                span /= S5_NIDIRECT_BLOCKS;
+                slot = (uint32_t *)pf->pf_addr + (index / span) % S5_NIDIRECT_BLOCKS;
+        }
+
+        ret = *slot;
+out:
+        if (NULL != pf)
+                pframe_unpin(pf);
+        return ret;
+}
+
+/*
+ * Like s5_seek_to_block without allocating, but also sets *nblocks to
+ * the number of blocks from seekptr on, at most max, which are stored in
+ * consecutive disk blocks (or are all sparse, if 0 is returned). Used
+ * by s5fs_fillpages and s5fs_cleanpages to move a run of blocks with a
+ * single request.
+ *
+ * This is a single lookup for extent-mapped files; otherwise each block
+ * is looked up in turn.
+ */
+int
+s5_block_run(vnode_t *vnode, off_t seekptr, uint32_t max, uint32_t *nblocks)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        uint32_t blocknum = S5_DATA_BLOCK(seekptr);
+        uint32_t run;
+        int first, next;
+
+        KASSERT(0 < max);
+        if (blocknum >= S5_MAX_FILE_BLOCKS)
+                return -EFBIG;
+
+        if (inode->s5_flags & S5_INODE_EXTENTS) {
+                if (0 <= (first = s5_extent_lookup(fs, inode, blocknum, &run)))
+                        *nblocks = MIN(run, max);
+                return first;
+        }
+
+        if (0 > (first = s5_seek_to_block(vnode, seekptr, 0)))
+                return first;
+        for (run = 1; run < max; run++) {
+                next = s5_seek_to_block(vnode, (off_t)(blocknum + run) * S5_BLOCK_SIZE, 0);
+                if (0 > next || next != (0 == first ? 0 : first + (int)run))
+                        break;
+        }
+        *nblocks = run;
+        return first;
 }
 
 
 /*
- * Locks the mutex for the whole file system
+ * Locks the inode free list of the file system
+ */
+static void
+lock_s5_inodes(s5fs_t *fs)
+{
+        kmutex_lock(&fs->s5f_inode_mutex);
+}
+
+/*
+ * Unlocks the inode free list of the file system
+ */
+static void
+unlock_s5_inodes(s5fs_t *fs)
+{
+        kmutex_unlock(&fs->s5f_inode_mutex);
+}
+
+/*
+ * Locks the free block bitmap of the file system
  */
 static void
-lock_s5(s5fs_t *fs)
+lock_s5_blocks(s5fs_t *fs)
 {
-        kmutex_lock(&fs->s5f_mutex);
+        kmutex_lock(&fs->s5f_block_mutex);
 }
 
 /*
- * Unlocks the mutex for the whole file system
+ * Unlocks the free block bitmap of the file system
  */
 static void
-unlock_s5(s5fs_t *fs)
+unlock_s5_blocks(s5fs_t *fs)
 {
-        kmutex_unlock(&fs->s5f_mutex);
+        kmutex_unlock(&fs->s5f_block_mutex);
 }
 
 
@@ -142,27 +669,81 @@ s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
 }
 
 /*
- * Allocate a new disk-block off the block free list and return it. If
- * there are no free blocks, return -ENOSPC.
+ * Looks in block index of the free-block bitmap for a free block at or
+ * after bit first of that block, and marks it in use. Returns the block
+ * number, 0 if there is none, or -errno. Called with the file system
+ * locked.
+ */
+static int
+s5_bitmap_alloc(s5fs_t *fs, uint32_t index, uint32_t first)
+{
+        pframe_t *bp;
+        uint32_t *map, bits, word;
+        int ret;
+
+        if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(fs),
+                                  fs->s5f_super->s5s_bitmap_block + index, &bp)))
+                return ret;
+        map = (uint32_t *)bp->pf_addr;
+
+        for (word = first / 32; word < S5_BITS_PER_BLOCK / 32; word++) {
+                bits = map[word];
+                /* pretend the bits before first are in use */
+                if (word == first / 32)
+                        bits |= (1U << (first % 32)) - 1;
+                if (0xffffffff == bits)
+                        continue;
+
+                ret = bit_ffs(~bits);
+                map[word] |= 1U << ret;
+                pframe_dirty(bp);
+                return index * S5_BITS_PER_BLOCK + word * 32 + ret;
+        }
+        return 0;
+}
+
+/*
+ * Allocate a new disk-block and return it. If there are no free
+ * blocks, return -ENOSPC.
  *
  * This will not initialize the contents of an allocated block; these
  * contents are undefined.
  *
- * If the super block's s5s_nfree is 0, you need to refill 
- * s5s_free_blocks and reset s5s_nfree.  You need to read the contents 
- * of this page using the pframe system in order to obtain the next set of
- * free block numbers.
- *
- * Don't forget to dirty the appropriate blocks!
- *
- * You'll probably want to use lock_s5(), unlock_s5(), pframe_get(),
- * and s5_dirty_super()
+ * The block returned is goal if that is free, or else the first free
+ * block after goal in the same allocation group, or else the first free
+ * block in the groups which follow. Without a goal (0), the search
+ * starts just past the last block allocated.
  */
 static int
-s5_alloc_block(s5fs_t *fs)
+s5_alloc_block(s5fs_t *fs, uint32_t goal)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_alloc_block");
-        return -1;
+        s5_super_t *s = fs->s5f_super;
+        uint32_t ngroups = s->s5s_bitmap_blocks;
+        uint32_t group, i;
+        int ret;
+
+        lock_s5_blocks(fs);
+
+        if (goal < s->s5s_bitmap_block + ngroups || goal >= s->s5s_num_blocks)
+                goal = fs->s5f_alloc_rotor;
+        if (goal >= s->s5s_num_blocks)
+                goal = s->s5s_bitmap_block + ngroups;
+
+        /* The goal's group from the goal on, then all of every group,
+         * ending with the start of the goal's */
+        group = goal / S5_BITS_PER_BLOCK;
+        ret = s5_bitmap_alloc(fs, group, goal % S5_BITS_PER_BLOCK);
+        for (i = 1; 0 == ret && i <= ngroups; i++)
+                ret = s5_bitmap_alloc(fs, (group + i) % ngroups, 0);
+
+        if (0 == ret)
+                ret = -ENOSPC;
+        else if (0 < ret)
+                fs->s5f_alloc_rotor = ret + 1;
+
+        unlock_s5_blocks(fs);
+        dprintf("allocated block %d for goal %u\n", ret, goal);
+        return ret;
 }
 
 
@@ -172,41 +753,30 @@ s5_alloc_block(s5fs_t *fs)
  *
  * This function may potentially block.
  *
- * The caller is responsible for ensuring that the block being placed on
- * the free list is actually free and is not resident.
+ * The caller is responsible for ensuring that the block being freed is
+ * actually free and is not resident.
  */
 static void
 s5_free_block(s5fs_t *fs, int blockno)
 {
         s5_super_t *s = fs->s5f_super;
+        pframe_t *bp = NULL;
+        uint32_t bit = (uint32_t)blockno % S5_BITS_PER_BLOCK;
 
+        KASSERT((uint32_t)blockno >= s->s5s_bitmap_block + s->s5s_bitmap_blocks
+                && (uint32_t)blockno < s->s5s_num_blocks);
 
-        lock_s5(fs);
-
-        KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
-
-        if ((S5_NBLKS_PER_FNODE - 1) == s->s5s_nfree) {
-                /* get the pframe where we will store the free block nums */
-                pframe_t *prev_free_blocks = NULL;
-                KASSERT(fs->s5f_bdev);
-                pframe_get(&fs->s5f_bdev->bd_mmobj, blockno, &prev_free_blocks);
-                KASSERT(prev_free_blocks->pf_addr);
+        lock_s5_blocks(fs);
 
-                /* copy from the superblock to the new block on disk */
-                memcpy(prev_free_blocks->pf_addr, (void *)(s->s5s_free_blocks),
-                       S5_NBLKS_PER_FNODE * sizeof(int));
-                pframe_dirty(prev_free_blocks);
+        pframe_get(S5FS_TO_VMOBJ(fs),
+                   s->s5s_bitmap_block + (uint32_t)blockno / S5_BITS_PER_BLOCK, &bp);
+        KASSERT(bp && bp->pf_addr);
 
-                /* reset s->s5s_nfree and s->s5s_free_blocks */
-                s->s5s_nfree = 0;
-                s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1] = blockno;
-        } else {
-                s->s5s_free_blocks[s->s5s_nfree++] = blockno;
-        }
+        KASSERT(bit_check(bp->pf_addr, bit) && "freeing a free block");
+        bit_flip(bp->pf_addr, bit);
+        pframe_dirty(bp);
 
-        s5_dirty_super(fs);
-
-        unlock_s5(fs);
+        unlock_s5_blocks(fs);
 }
 
 /*
@@ -229,10 +799,10 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
                 || (S5_TYPE_BLK == type));
 
 
-        lock_s5(s5fs);
+        lock_s5_inodes(s5fs);
 
         if (s5fs->s5f_super->s5s_free_inode == (uint32_t) -1) {
-                unlock_s5(s5fs);
+                unlock_s5_inodes(s5fs);
                 return -ENOSPC;
         }
 
@@ -259,20 +829,50 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
         inode->s5_size = 0;
         inode->s5_type = type;
         inode->s5_linkcount = 0;
-        memset(inode->s5_direct_blocks, 0, S5_NDIRECT_BLOCKS * sizeof(int));
+        memset(&inode->s5_map, 0, sizeof(inode->s5_map));
+        inode->s5_flags = 0;
         if ((S5_TYPE_CHR == type) || (S5_TYPE_BLK == type))
                 inode->s5_indirect_block = devid;
-        else
-                inode->s5_indirect_block = 0;
+        else if (S5_TYPE_DATA == type)
+                inode->s5_flags = S5_INODE_EXTENTS;
 
         s5_dirty_inode(s5fs, inode);
 
-        unlock_s5(s5fs);
+        unlock_s5_inodes(s5fs);
 
         return ret;
 }
 
 
+/*
+ * Frees an indirect block of the given depth and every block below it.
+ */
+static void
+s5_free_indirect(s5fs_t *fs, uint32_t blockno, int depth)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), blockno, &ibp);
+        KASSERT(ibp && "because never fails for block_device vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                KASSERT(b[i] != blockno);
+                if (!b[i])
+                        continue;
+                if (depth > 1)
+                        s5_free_indirect(fs, b[i], depth - 1);
+                else
+                        s5_free_block(fs, b[i]);
+        }
+
+        pframe_unpin(ibp);
+        s5_free_block(fs, blockno);
+}
+
 /*
  * Free an inode by freeing its disk blocks and putting it back on the
  * inode free list.
@@ -296,6 +896,14 @@ s5_free_inode(vnode_t *vnode)
                 || (S5_TYPE_CHR == inode->s5_type)
                 || (S5_TYPE_BLK == inode->s5_type));
 
+        if (inode->s5_flags & S5_INODE_EXTENTS) {
+                s5_extent_node_t root;
+
+                s5_extent_root(inode, &root);
+                s5_extent_free(fs, &root);
+                goto freed;
+        }
+
         /* free any direct blocks */
         for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
                 if (inode->s5_direct_blocks[i]) {
@@ -307,60 +915,380 @@ s5_free_inode(vnode_t *vnode)
                 }
         }
 
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))
-            && inode->s5_indirect_block) {
-                pframe_t *ibp;
-                uint32_t *b;
-
-                pframe_get(S5FS_TO_VMOBJ(fs),
-                           (unsigned)inode->s5_indirect_block,
-                           &ibp);
-                KASSERT(ibp
-                        && "because never fails for block_device "
-                        "vm_objects");
-                pframe_pin(ibp);
-
-                b = (uint32_t *)(ibp->pf_addr);
-                for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-                        KASSERT(b[i] != inode->s5_indirect_block);
-                        if (b[i])
-                                s5_free_block(fs, b[i]);
-                }
-
-                pframe_unpin(ibp);
+        if ((S5_TYPE_DATA == inode->s5_type)
+            || (S5_TYPE_DIR == inode->s5_type)) {
+                int level;
+                uint32_t *root;
 
-                s5_free_block(fs, inode->s5_indirect_block);
+                s5_bmap_forget(fs, inode->s5_number);
+                for (level = 1; level <= S5_INDIRECT_LEVELS; level++) {
+                        root = s5_indirect_root(inode, level);
+                        if (*root)
+                                s5_free_indirect(fs, *root, level);
+                        *root = 0;
+                }
         }
 
-        inode->s5_indirect_block = 0;
+freed:
+        memset(&inode->s5_map, 0, sizeof(inode->s5_map));
+        inode->s5_flags = 0;
         inode->s5_type = S5_TYPE_FREE;
         s5_dirty_inode(fs, inode);
 
-        lock_s5(fs);
+        lock_s5_inodes(fs);
         inode->s5_next_free = fs->s5f_super->s5s_free_inode;
         fs->s5f_super->s5s_free_inode = inode->s5_number;
-        unlock_s5(fs);
+        unlock_s5_inodes(fs);
 
         s5_dirty_inode(fs, inode);
         s5_dirty_super(fs);
 }
 
+/* FNV-1a hash of a name, which orders the entries of hashed
+ * directories (fsmaker computes the same) */
+static uint32_t
+s5_name_hash(const char *name, size_t namelen)
+{
+        uint32_t hash = 2166136261U;
+        size_t i;
+
+        for (i = 0; i < namelen; i++) {
+                hash ^= (unsigned char)name[i];
+                hash *= 16777619U;
+        }
+        return hash;
+}
+
+/* Gets block blocknum of a directory and pins it */
+static int
+s5_dir_block(vnode_t *vnode, uint32_t blocknum, pframe_t **pf)
+{
+        int ret;
+
+        if (0 > (ret = pframe_get(&vnode->vn_mmobj, blocknum, pf)))
+                return ret;
+        pframe_pin(*pf);
+        return 0;
+}
+
+static void
+s5_dir_resize(vnode_t *vnode, uint32_t size)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+
+        inode->s5_size = size;
+        vnode->vn_len = size;
+        s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+}
+
+/* Index of the root entry of the leaf for names with the given hash */
+static int
+s5_dx_root_search(s5_dx_root_t *root, uint32_t hash)
+{
+        int lo = 0, hi = root->s5dr_count, mid;
+
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (root->s5dr_entries[mid].s5dx_hash <= hash)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        KASSERT(0 < lo && "the first index entry has hash 0");
+        return lo - 1;
+}
+
+/* Index of the first entry of a leaf whose hash is not below hash */
+static int
+s5_dx_leaf_search(s5_dx_leaf_t *leaf, uint32_t hash)
+{
+        int lo = 0, hi = leaf->s5dl_count, mid;
+
+        while (lo < hi) {
+                mid = (lo + hi) / 2;
+                if (leaf->s5dl_entries[mid].s5hd_hash < hash)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        return lo;
+}
+
+/* Where to split a full leaf, near the middle but between two different
+ * hashes so that equal ones stay in one leaf; 0 if there is no such
+ * place */
+static int
+s5_dx_split_point(s5_dx_leaf_t *leaf)
+{
+        s5_hdirent_t *e = leaf->s5dl_entries;
+        int count = leaf->s5dl_count, split;
+
+        for (split = count / 2; split < count; split++) {
+                if (e[split].s5hd_hash != e[split - 1].s5hd_hash)
+                        return split;
+        }
+        for (split = count / 2 - 1; split > 0; split--) {
+                if (e[split].s5hd_hash != e[split - 1].s5hd_hash)
+                        return split;
+        }
+        return 0;
+}
+
+/*
+ * Looks up a name in a hashed directory and returns its inode number,
+ * or -ENOENT. If leafp is not NULL the leaf holding the name is
+ * returned through it, pinned, and its index in the leaf through
+ * indexp.
+ */
+static int
+s5_dx_find(vnode_t *vnode, const char *name, size_t namelen,
+           pframe_t **leafp, int *indexp)
+{
+        uint32_t hash = s5_name_hash(name, namelen);
+        pframe_t *rootpf, *leafpf;
+        s5_dx_root_t *root;
+        s5_dx_leaf_t *leaf;
+        uint32_t blocknum;
+        int i, ret;
+
+        if (0 > (ret = s5_dir_block(vnode, 0, &rootpf)))
+                return ret;
+        root = (s5_dx_root_t *)rootpf->pf_addr;
+        blocknum = root->s5dr_entries[s5_dx_root_search(root, hash)].s5dx_block;
+        pframe_unpin(rootpf);
+
+        if (0 > (ret = s5_dir_block(vnode, blocknum, &leafpf)))
+                return ret;
+        leaf = (s5_dx_leaf_t *)leafpf->pf_addr;
+
+        ret = -ENOENT;
+        for (i = s5_dx_leaf_search(leaf, hash);
+             i < (int)leaf->s5dl_count && hash == leaf->s5dl_entries[i].s5hd_hash;
+             i++) {
+                if (s5_name_match(leaf->s5dl_entries[i].s5hd_name, name, namelen)) {
+                        ret = leaf->s5dl_entries[i].s5hd_inode;
+                        break;
+                }
+        }
+
+        if (0 <= ret && NULL != leafp) {
+                *leafp = leafpf;
+                *indexp = i;
+        } else {
+                pframe_unpin(leafpf);
+        }
+        return ret;
+}
+
+/*
+ * Adds a name to a hashed directory; it must not be there already. If
+ * its leaf is full, the leaf is split and the upper half moved to a new
+ * leaf at the end of the directory.
+ */
+static int
+s5_dx_add(vnode_t *vnode, const char *name, size_t namelen, uint32_t ino)
+{
+        uint32_t hash = s5_name_hash(name, namelen);
+        pframe_t *rootpf, *leafpf, *newpf;
+        s5_dx_root_t *root;
+        s5_dx_leaf_t *leaf, *newleaf;
+        s5_hdirent_t *d;
+        uint32_t newblock;
+        int i, j, split, ret;
+
+        if (0 > (ret = s5_dir_block(vnode, 0, &rootpf)))
+                return ret;
+        root = (s5_dx_root_t *)rootpf->pf_addr;
+        i = s5_dx_root_search(root, hash);
+        if (0 > (ret = s5_dir_block(vnode, root->s5dr_entries[i].s5dx_block, &leafpf)))
+                goto out_root;
+        leaf = (s5_dx_leaf_t *)leafpf->pf_addr;
+
+        if (S5_DX_LEAF_ENTRIES == leaf->s5dl_count) {
+                split = s5_dx_split_point(leaf);
+                if (0 == split || S5_DX_ROOT_ENTRIES == root->s5dr_count) {
+                        ret = -ENOSPC;
+                        goto out_leaf;
+                }
+
+                /* Dirtying the new leaf allocates its block, the only
+                 * step that can fail for lack of space */
+                newblock = root->s5dr_count + 1;
+                if (0 > (ret = s5_dir_block(vnode, newblock, &newpf)))
+                        goto out_leaf;
+                if (0 > (ret = pframe_dirty(newpf))) {
+                        pframe_unpin(newpf);
+                        goto out_leaf;
+                }
+
+                newleaf = (s5_dx_leaf_t *)newpf->pf_addr;
+                newleaf->s5dl_count = leaf->s5dl_count - split;
+                memcpy(newleaf->s5dl_entries, &leaf->s5dl_entries[split],
+                       newleaf->s5dl_count * sizeof(s5_hdirent_t));
+                leaf->s5dl_count = split;
+                pframe_dirty(leafpf);
+
+                for (j = root->s5dr_count; j > i + 1; j--)
+                        root->s5dr_entries[j] = root->s5dr_entries[j - 1];
+                root->s5dr_entries[i + 1].s5dx_hash = newleaf->s5dl_entries[0].s5hd_hash;
+                root->s5dr_entries[i + 1].s5dx_block = newblock;
+                root->s5dr_count++;
+                s5_dir_resize(vnode, (newblock + 1) * S5_BLOCK_SIZE);
+
+                if (hash >= newleaf->s5dl_entries[0].s5hd_hash) {
+                        pframe_unpin(leafpf);
+                        leafpf = newpf;
+                        leaf = newleaf;
+                } else {
+                        pframe_unpin(newpf);
+                }
+        }
+
+        i = s5_dx_leaf_search(leaf, hash);
+        for (j = leaf->s5dl_count; j > i; j--)
+                leaf->s5dl_entries[j] = leaf->s5dl_entries[j - 1];
+        d = &leaf->s5dl_entries[i];
+        d->s5hd_inode = ino;
+        d->s5hd_hash = hash;
+        memset(d->s5hd_name, 0, S5_NAME_LEN);
+        memcpy(d->s5hd_name, name, namelen);
+        leaf->s5dl_count++;
+        root->s5dr_dirents++;
+        pframe_dirty(leafpf);
+        pframe_dirty(rootpf);
+        ret = 0;
+
+out_leaf:
+        pframe_unpin(leafpf);
+out_root:
+        pframe_unpin(rootpf);
+        return ret;
+}
+
+/* Removes a name from a hashed directory, returning its inode number */
+static int
+s5_dx_remove(vnode_t *vnode, const char *name, size_t namelen)
+{
+        pframe_t *rootpf, *leafpf;
+        s5_dx_leaf_t *leaf;
+        int i, ino, ret;
+
+        if (0 > (ret = s5_dir_block(vnode, 0, &rootpf)))
+                return ret;
+        if (0 > (ino = s5_dx_find(vnode, name, namelen, &leafpf, &i)))
+                goto out;
+
+        leaf = (s5_dx_leaf_t *)leafpf->pf_addr;
+        for (; i + 1 < (int)leaf->s5dl_count; i++)
+                leaf->s5dl_entries[i] = leaf->s5dl_entries[i + 1];
+        leaf->s5dl_count--;
+        pframe_dirty(leafpf);
+        pframe_unpin(leafpf);
+
+        ((s5_dx_root_t *)rootpf->pf_addr)->s5dr_dirents--;
+        pframe_dirty(rootpf);
+out:
+        pframe_unpin(rootpf);
+        return ino;
+}
+
+/*
+ * Turns a linear directory whose first block is full into a hashed
+ * one. The blocks the hashed directory will need are allocated first,
+ * so running out of space leaves the directory as it was. If the names
+ * cannot be split between two leaves (which takes most of them having
+ * the same hash) the directory stays linear.
+ */
+static int
+s5_dx_convert(vnode_t *vnode)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *pfs[3];
+        s5_dirent_t *old;
+        s5_dx_root_t *root;
+        uint32_t i;
+        int n, ret = 0;
+
+        KASSERT(S5_BLOCK_SIZE == inode->s5_size);
+        KASSERT(!(inode->s5_flags & S5_INODE_HASHED));
+
+        if (NULL == (old = (s5_dirent_t *)page_alloc()))
+                return -ENOMEM;
+        for (n = 0; n < 3; n++) {
+                if (0 > (ret = s5_dir_block(vnode, n, &pfs[n])))
+                        goto out;
+                if (0 > (ret = pframe_dirty(pfs[n]))) {
+                        pframe_unpin(pfs[n]);
+                        goto out;
+                }
+        }
+
+        memcpy(old, pfs[0]->pf_addr, S5_BLOCK_SIZE);
+        root = (s5_dx_root_t *)pfs[0]->pf_addr;
+        memset(root, 0, S5_BLOCK_SIZE);
+        root->s5dr_count = 1;
+        root->s5dr_entries[0].s5dx_hash = 0;
+        root->s5dr_entries[0].s5dx_block = 1;
+        ((s5_dx_leaf_t *)pfs[1]->pf_addr)->s5dl_count = 0;
+        inode->s5_flags |= S5_INODE_HASHED;
+        s5_dir_resize(vnode, 2 * S5_BLOCK_SIZE);
+
+        for (i = 0; i < S5_DIRENTS_PER_BLOCK; i++) {
+                if (0 > s5_dx_add(vnode, old[i].s5d_name,
+                                  strnlen(old[i].s5d_name, S5_NAME_LEN), old[i].s5d_inode)) {
+                        dprintf("directory %d stays linear\n", inode->s5_number);
+                        memcpy(pfs[0]->pf_addr, old, S5_BLOCK_SIZE);
+                        inode->s5_flags &= ~S5_INODE_HASHED;
+                        s5_dir_resize(vnode, S5_BLOCK_SIZE);
+                        break;
+                }
+        }
+
+out:
+        while (n-- > 0)
+                pframe_unpin(pfs[n]);
+        page_free(old);
+        return ret;
+}
+
+/*
+ * Looks up a name in a linear directory, returning its inode number
+ * and the offset of its entry through offp.
+ */
+static int
+s5_linear_find(vnode_t *vnode, const char *name, size_t namelen, off_t *offp)
+{
+        s5_dirent_t d;
+        off_t off;
+        int ret;
+
+        for (off = 0; off < vnode->vn_len; off += sizeof(s5_dirent_t)) {
+                if (0 > (ret = s5_read_file(vnode, off, (char *)&d, sizeof(d))))
+                        return ret;
+                if (s5_name_match(d.s5d_name, name, namelen)) {
+                        *offp = off;
+                        return d.s5d_inode;
+                }
+        }
+        return -ENOENT;
+}
+
 /*
  * Locate the directory entry in the given inode with the given name,
  * and return its inode number. If there is no entry with the given
  * name, return -ENOENT.
  *
- * You'll probably want to use s5_read_file and name_match
- *
- * You can either read one dirent at a time or optimize and read more.
- * Either is fine.
+ * Linear directories are scanned an entry at a time; hashed ones only
+ * look at the leaf the name's hash leads to.
  */
 int
 s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_find_dirent");
-        return -1;
+        off_t off;
+
+        if (VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_HASHED)
+                return s5_dx_find(vnode, name, namelen, NULL, NULL);
+        return s5_linear_find(vnode, name, namelen, &off);
 }
 
 /*
@@ -369,8 +1297,9 @@ s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
  * -ENOENT.
  *
  * In order to ensure that the directory entries are contiguous in the
- * directory file, you will need to move the last directory entry into
- * the remove dirent's place.
+ * directory file, the last directory entry of a linear directory is
+ * moved into the removed dirent's place. In a hashed directory the
+ * entries after it in its leaf move down instead.
  *
  * When this function returns, the inode refcount on the removed file
  * should be decremented.
@@ -386,8 +1315,32 @@ s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
 int
 s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_remove_dirent");
-        return -1;
+        s5_dirent_t last;
+        vnode_t *child;
+        off_t off, lastoff;
+        int ino, ret;
+
+        if (VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_HASHED) {
+                if (0 > (ino = s5_dx_remove(vnode, name, namelen)))
+                        return ino;
+        } else {
+                if (0 > (ino = s5_linear_find(vnode, name, namelen, &off)))
+                        return ino;
+                lastoff = vnode->vn_len - sizeof(s5_dirent_t);
+                if (off != lastoff) {
+                        if (0 > (ret = s5_read_file(vnode, lastoff, (char *)&last, sizeof(last))))
+                                return ret;
+                        if (0 > (ret = s5_write_file(vnode, off, (char *)&last, sizeof(last))))
+                                return ret;
+                }
+                s5_dir_resize(vnode, lastoff);
+        }
+
+        child = vget(vnode->vn_fs, ino);
+        VNODE_TO_S5INODE(child)->s5_linkcount--;
+        s5_dirty_inode(VNODE_TO_S5FS(vnode), VNODE_TO_S5INODE(child));
+        vput(child);
+        return 0;
 }
 
 /*
@@ -399,13 +1352,109 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
  *
  * Remember to incrament the ref counts appropriately
  *
- * You probably want to use s5_find_dirent(), s5_write_file(), and s5_dirty_inode().
+ * A linear directory whose first block is full is turned into a hashed
+ * one before the entry is added.
  */
 int
 s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_link");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(parent);
+        s5_inode_t *cinode = VNODE_TO_S5INODE(child);
+        s5_dirent_t d;
+        int ret;
+
+        if (namelen >= S5_NAME_LEN)
+                return -ENAMETOOLONG;
+        if (-ENOENT != (ret = s5_find_dirent(parent, name, namelen)))
+                return (0 <= ret) ? -EEXIST : ret;
+
+        if (!(inode->s5_flags & S5_INODE_HASHED) && S5_BLOCK_SIZE == inode->s5_size
+            && 0 > (ret = s5_dx_convert(parent)))
+                return ret;
+
+        if (inode->s5_flags & S5_INODE_HASHED) {
+                if (0 > (ret = s5_dx_add(parent, name, namelen, cinode->s5_number)))
+                        return ret;
+        } else {
+                memset(&d, 0, sizeof(d));
+                d.s5d_inode = cinode->s5_number;
+                memcpy(d.s5d_name, name, namelen);
+                if (0 > (ret = s5_write_file(parent, parent->vn_len, (char *)&d, sizeof(d))))
+                        return ret;
+                if (sizeof(d) != (size_t)ret)
+                        return -ENOSPC;
+        }
+
+        cinode->s5_linkcount++;
+        s5_dirty_inode(VNODE_TO_S5FS(child), cinode);
+        return 0;
+}
+
+/*
+ * Reads the first directory entry at or after the given offset in a
+ * directory into d. Returns the number of bytes from offset to the end
+ * of that entry, which is how far the caller should advance, or 0 at the
+ * end of the directory, or -errno.
+ *
+ * Offsets in a hashed directory are those of the entries in its leaves.
+ * As in a linear directory, removing entries moves the ones after them
+ * (within their leaf), so offsets are only stable while the directory
+ * does not change.
+ */
+int
+s5_read_dirent(vnode_t *vnode, off_t offset, s5_dirent_t *d)
+{
+        pframe_t *pf;
+        s5_dx_leaf_t *leaf;
+        uint32_t blocknum, i = 0;
+        off_t next;
+        int ret;
+
+        if (!(VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_HASHED))
+                return s5_read_file(vnode, offset, (char *)d, sizeof(*d));
+
+        blocknum = S5_DATA_BLOCK(offset);
+        if (0 == blocknum)
+                blocknum = 1;
+        else if (S5_DATA_OFFSET(offset) > (off_t)sizeof(uint32_t))
+                i = (S5_DATA_OFFSET(offset) - sizeof(uint32_t) + sizeof(s5_hdirent_t) - 1)
+                    / sizeof(s5_hdirent_t);
+
+        for (; (off_t)blocknum * S5_BLOCK_SIZE < vnode->vn_len; blocknum++, i = 0) {
+                if (0 > (ret = s5_dir_block(vnode, blocknum, &pf)))
+                        return ret;
+                leaf = (s5_dx_leaf_t *)pf->pf_addr;
+                if (i < leaf->s5dl_count) {
+                        d->s5d_inode = leaf->s5dl_entries[i].s5hd_inode;
+                        memcpy(d->s5d_name, leaf->s5dl_entries[i].s5hd_name, S5_NAME_LEN);
+                        pframe_unpin(pf);
+                        next = (off_t)blocknum * S5_BLOCK_SIZE + sizeof(uint32_t)
+                               + (i + 1) * sizeof(s5_hdirent_t);
+                        return next - offset;
+                }
+                pframe_unpin(pf);
+        }
+        return 0;
+}
+
+/*
+ * Returns the number of entries in a directory, "." and ".." included,
+ * or -errno.
+ */
+int
+s5_dir_entries(vnode_t *vnode)
+{
+        pframe_t *pf;
+        int ret;
+
+        if (!(VNODE_TO_S5INODE(vnode)->s5_flags & S5_INODE_HASHED))
+                return vnode->vn_len / sizeof(s5_dirent_t);
+
+        if (0 > (ret = s5_dir_block(vnode, 0, &pf)))
+                return ret;
+        ret = ((s5_dx_root_t *)pf->pf_addr)->s5dr_dirents;
+        pframe_unpin(pf);
+        return ret;
 }
 
 /*
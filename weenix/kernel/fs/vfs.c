@@ -16,6 +16,7 @@
 #include "fs/s5fs/s5fs.h"
 #endif
 #include "fs/vfs.h"
+#include "fs/dcache.h"
 #include "fs/file.h"
 #include "fs/vnode.h"
 #include "fs/vfs_syscall.h"
@@ -69,6 +70,11 @@ vfs_mount(struct vnode *mtpt, fs_t *fs)
  * to keep track of reference counts. You should also kfree the fs struct at
  * the end of this method.
  *
+ * The names the dcache holds for the fs and the vnodes kept in core after
+ * their last vput() are dropped on the way in, since they refer to the fs
+ * by its fs_t, which may be reused once it is freed. Both are only
+ * caches, so this is safe even if the unmount then fails.
+ *
  * Remember proper error handling. You might want to make sure that you do not
  * try to call this function on the root file system (this function is not meant
  * to unmount the root file system).
@@ -76,6 +82,9 @@ vfs_mount(struct vnode *mtpt, fs_t *fs)
 int
 vfs_umount(fs_t *fs)
 {
+        dcache_purge_fs(fs);
+        vnode_uncache(fs);
+
         NOT_YET_IMPLEMENTED("MOUNTING: vfs_umount");
         return -EINVAL;
 }
@@ -166,6 +175,9 @@ vfs_shutdown()
                       "filesystem!!! This shouldn't happen!!\n");
         }
 
+        dcache_purge_fs(fs);
+        vnode_uncache(fs);
+
         if (vn->vn_fs->fs_op->umount) {
                 ret = vn->vn_fs->fs_op->umount(fs);
         } else {
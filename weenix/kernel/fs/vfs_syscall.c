@@ -10,6 +10,7 @@
 #include "errno.h"
 #include "globals.h"
 #include "fs/vfs.h"
+#include "fs/dcache.h"
 #include "fs/file.h"
 #include "fs/vnode.h"
 #include "fs/vfs_syscall.h"
@@ -17,10 +18,12 @@
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
 #include "mm/kmalloc.h"
+#include "mm/pframe.h"
 #include "util/string.h"
 #include "util/printf.h"
 #include "fs/stat.h"
 #include "util/debug.h"
+#include "api/syscall.h"
  
 /* To read a file:
  *      o fget(fd)
@@ -41,45 +44,16 @@
 int
 do_read(int fd, void *buf, size_t nbytes)
 {
-        if(fd < 0 || fd > NFILES)
-            return -EBADF;
-        dbg(DBG_VFS,"VFS: Enter do_read()\n");
-        file_t* file=fget(fd);
-        if(file==NULL)
-        {
-                dbg(DBG_VFS,"VFS: Leave do_read(), fd is not a valid file descriptor, throw EBADF\n");
-                return -EBADF;
-        }
-        if(!(file->f_mode&FMODE_READ))
-        {
-                fput(file);
-                dbg(DBG_VFS,"VFS: Leave do_read(), fd is not open for reading, throw EBADF\n");
-                return -EBADF;
-        }
-        if(S_ISDIR(file->f_vnode->vn_mode)||file->f_vnode->vn_ops->read==NULL)
-        {
-                fput(file);
-                dbg(DBG_VFS,"VFS: Leave do_read(), fd refers to a directory, throw EISDIR.\n");
-                return -EISDIR;
-        }
-        if(nbytes==0)
-        {
-            fput(file);
-            return 0;
-        }
-        unsigned int bytes=file->f_vnode->vn_ops->read(file->f_vnode,file->f_pos,buf,nbytes);
-        if(bytes==nbytes)
-        {
-            do_lseek(fd,bytes,SEEK_CUR); 
-        }
-        else
-        {
-            do_lseek(fd,0,SEEK_END);
-        }
-        fput(file);
-        dbg(DBG_VFS,"VFS: Leave do_read(), success, return %d.\n",bytes);
+        struct iovec iov;
+        int bytes;
+
+        dbg(DBG_VFS,"VFS: Enter do_read(), fd=%d\n", fd);
+        iov.iov_base = buf;
+        iov.iov_len = nbytes;
+        bytes = do_readv(fd, &iov, 1, -1);
+        dbg(DBG_VFS,"VFS: Leave do_read(), return %d\n", bytes);
         return bytes;
-}  
+}
 
 /* Very similar to do_read.  Check f_mode to be sure the file is writable.  If
  * f_mode & FMODE_APPEND, do_lseek() to the end of the file, call the write
@@ -92,51 +66,163 @@ do_read(int fd, void *buf, size_t nbytes)
 int
 do_write(int fd, const void *buf, size_t nbytes)
 {
-        if(fd < 0 || fd > NFILES)
-            return -EBADF;
-        dbg_print("VFS: Enter do_write(), fd=%d\n", fd);
-        file_t* file=fget(fd);
-        if(file==NULL)
-        {
-                dbg(DBG_VFS,"VFS: Leave do_write(), file=NULL\n");
+        struct iovec iov;
+        int bytes;
+
+        dbg(DBG_VFS,"VFS: Enter do_write(), fd=%d\n", fd);
+        iov.iov_base = (void *)buf;
+        iov.iov_len = nbytes;
+        bytes = do_writev(fd, &iov, 1, -1);
+        dbg(DBG_VFS,"VFS: Leave do_write(), return %d\n", bytes);
+        return bytes;
+}
+
+/* Vectored reads and writes: the buffers of iov are filled from, or
+ * written to, consecutive bytes of the file, in order, with a single
+ * fget() and a single hold of the file's data lock. If off is -1 the
+ * transfer starts at f_pos (the end of the file, for FMODE_APPEND
+ * writes) and f_pos is moved past it; otherwise it starts at off and
+ * f_pos is left alone, which gives pread() and pwrite(). A transfer to
+ * a buffer which comes up short ends the whole call. The readv() and
+ * writev() system calls stage the user's buffers through a bounded
+ * number of bounce pages, so only a request which fits them is one call
+ * here (see sys_rw_vec()).
+ *
+ * Return the number of bytes transferred, or -errno if nothing was.
+ *
+ * Error cases, on top of those of do_read and do_write:
+ *      o EINVAL
+ *        iovcnt is not positive, or off is negative and not -1.
+ */
+int
+do_readv(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+        file_t *file;
+        vnode_t *vn;
+        size_t nbytes = 0;
+        off_t pos;
+        int i, ret = 0, total = 0;
+
+        dbg(DBG_VFS, "VFS: Enter do_readv(), fd=%d, %d buffers, off=%d\n", fd, iovcnt, off);
+        if (iovcnt <= 0 || off < -1)
+                return -EINVAL;
+        if (NULL == (file = fget(fd)))
+                return -EBADF;
+        vn = file->f_vnode;
+        if (!(file->f_mode & FMODE_READ)) {
+                fput(file);
                 return -EBADF;
         }
+        if (S_ISDIR(vn->vn_mode) || NULL == vn->vn_ops->read) {
+                fput(file);
+                return -EISDIR;
+        }
 
-        if(!(file->f_mode&FMODE_WRITE)&&!(file->f_mode&FMODE_APPEND))
-        {
+        for (i = 0; i < iovcnt; i++)
+                nbytes += iov[i].iov_len;
+        if (0 == nbytes) {
+                fput(file);
+                return 0;
+        }
+
+        pos = (-1 == off) ? file->f_pos : off;
+        /* Files whose pages are cached get the pages after these read in
+         * while we copy these out, if the reads look sequential */
+        if (-1 == off && S_ISREG(vn->vn_mode) && NULL != vn->vn_ops->fillpage) {
+                readahead_access(&file->f_ra, &vn->vn_mmobj, ADDR_TO_PN(pos),
+                                 ADDR_TO_PN(PAGE_ALIGN_UP(pos + nbytes)) - ADDR_TO_PN(pos),
+                                 ADDR_TO_PN(PAGE_ALIGN_UP(vn->vn_len)));
+        }
+
+        /* Readers of a regular file share its data with each other but
+         * not with writers; devices do their own locking */
+        if (S_ISREG(vn->vn_mode))
+                krwlock_read_lock(&vn->vn_rwlock);
+        for (i = 0; i < iovcnt; i++) {
+                if (0 == iov[i].iov_len)
+                        continue;
+                ret = vn->vn_ops->read(vn, pos + total, iov[i].iov_base, iov[i].iov_len);
+                if (ret <= 0)
+                        break;
+                total += ret;
+                if ((size_t)ret < iov[i].iov_len)
+                        break;
+        }
+        if (S_ISREG(vn->vn_mode))
+                krwlock_read_unlock(&vn->vn_rwlock);
+
+        if (-1 == off)
+                file->f_pos = pos + total;
+        fput(file);
+        dbg(DBG_VFS, "VFS: Leave do_readv(), %d bytes at %d\n", total, pos);
+        return (0 == total && ret < 0) ? ret : total;
+}
+
+int
+do_writev(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+        file_t *file;
+        vnode_t *vn;
+        size_t nbytes = 0;
+        off_t pos;
+        int i, ret = 0, total = 0;
+
+        dbg(DBG_VFS, "VFS: Enter do_writev(), fd=%d, %d buffers, off=%d\n", fd, iovcnt, off);
+        if (iovcnt <= 0 || off < -1)
+                return -EINVAL;
+        if (NULL == (file = fget(fd)))
+                return -EBADF;
+        vn = file->f_vnode;
+        if (!(file->f_mode & (FMODE_WRITE | FMODE_APPEND))) {
                 fput(file);
-                dbg(DBG_VFS,"VFS: Leave do_write(), is not open for writing, throw EBADF\n");
                 return -EBADF;
         }
-        if(S_ISDIR(file->f_vnode->vn_mode)||file->f_vnode->vn_ops->write==NULL)
-        {
+        if (S_ISDIR(vn->vn_mode) || NULL == vn->vn_ops->write) {
                 fput(file);
-                dbg(DBG_VFS,"VFS: Leave do_write(), file is a directory, throw EISDIR \n");
                 return -EISDIR;
         }
 
-        int bytes;
-        if(file->f_mode&FMODE_APPEND)
-        {
-                do_lseek(fd,0,SEEK_END);
-                KASSERT((S_ISCHR(file->f_vnode->vn_mode)) ||
-                        (S_ISBLK(file->f_vnode->vn_mode)) ||
-                        ((S_ISREG(file->f_vnode->vn_mode)) && (file->f_pos <= file->f_vnode->vn_len)));
-                bytes=file->f_vnode->vn_ops->write(file->f_vnode,file->f_pos,buf,nbytes);
-                do_lseek(fd,0,SEEK_END);
-                dbg(DBG_VFS,"VFS: Leave do_write(), success, return %d\n",bytes);
-        }
-        else if(file->f_mode&FMODE_WRITE)
-        {
-                bytes=file->f_vnode->vn_ops->write(file->f_vnode,file->f_pos,buf,nbytes);  
-                do_lseek(fd,bytes,SEEK_CUR);   
-                KASSERT((S_ISCHR(file->f_vnode->vn_mode)) ||
-                        (S_ISBLK(file->f_vnode->vn_mode)) ||
-                        ((S_ISREG(file->f_vnode->vn_mode)) && (file->f_pos <= file->f_vnode->vn_len)));
-                dbg(DBG_VFS,"VFS: Leave do_write(), success, return %d\n",bytes); 
+        for (i = 0; i < iovcnt; i++)
+                nbytes += iov[i].iov_len;
+        if (0 == nbytes) {
+                fput(file);
+                return 0;
         }
+
+        /* A writer of a regular file has its data to itself, from finding
+         * the end of the file to append at to the end of the write */
+        if (S_ISREG(vn->vn_mode))
+                krwlock_write_lock(&vn->vn_rwlock);
+        if (-1 != off)
+                pos = off;
+        else if (file->f_mode & FMODE_APPEND)
+                pos = vn->vn_len;
+        else
+                pos = file->f_pos;
+        for (i = 0; i < iovcnt; i++) {
+                if (0 == iov[i].iov_len)
+                        continue;
+                ret = vn->vn_ops->write(vn, pos + total, iov[i].iov_base, iov[i].iov_len);
+                if (ret <= 0)
+                        break;
+                total += ret;
+                if ((size_t)ret < iov[i].iov_len)
+                        break;
+        }
+        KASSERT((S_ISCHR(vn->vn_mode)) ||
+                (S_ISBLK(vn->vn_mode)) ||
+                ((S_ISREG(vn->vn_mode)) && (0 == total || pos + total <= vn->vn_len)));
+        if (S_ISREG(vn->vn_mode))
+                krwlock_write_unlock(&vn->vn_rwlock);
+
+        if (-1 == off)
+                file->f_pos = pos + total;
+        /* if this write left too many dirty pages, help write them back */
+        if (total > 0)
+                pframe_balance_dirty(&vn->vn_mmobj);
         fput(file);
-        return bytes;
+        dbg(DBG_VFS, "VFS: Leave do_writev(), %d bytes at %d\n", total, pos);
+        return (0 == total && ret < 0) ? ret : total;
 }
 
 /*
@@ -327,6 +413,7 @@ do_mknod(const char *path, int mode, unsigned devid)
                 {
                         KASSERT(NULL != dir->vn_ops->mknod);
                         int ret = dir->vn_ops->mknod(dir, name, namelen, mode, (devid_t)devid);
+                        dcache_purge(dir, name, namelen);
                         vput(dir);
                         dbg(DBG_VFS,"VFS: Leave do_mknod(), error cannot find name, throw ENOENT\n");
                         return ret;
@@ -387,6 +474,7 @@ do_mkdir(const char *path)
         KASSERT(NULL != dir_vnode->vn_ops->mkdir);
         dbg(DBG_VFS,"VFS:In do_mkdir(), before ramfs_mkdir path=%s\n", path);
         err = dir_vnode -> vn_ops -> mkdir(dir_vnode, name, namelen);
+        dcache_purge(dir_vnode, name, namelen);
         vput(dir_vnode);
         dbg(DBG_VFS,"VFS: Leave do_mkdir(), err=%d\n", err);
         return err;
@@ -418,14 +506,6 @@ do_rmdir(const char *path)
         const char *name;
         vnode_t *dir_vnode;
         int err;
-        unsigned len = 0;
-        /* Check whether path has ".", ".." as its final component. */
-        while(path[len++] != '\0');
-        len -= 2;
-        if(name_match(".", path, len+1))
-            return -EINVAL;
-        if(name_match("..", path, len+1))
-            return -ENOTEMPTY;
 
         /* Use dir_namev() to find the vnode of the directory containing the dir to be removed. */
         /* Err includeing, ENOENT, ENOTDIR, ENAMETOOLONG */
@@ -436,25 +516,38 @@ do_rmdir(const char *path)
                 return err;
         }
 
-        if(path[len] == '.') {
-                if(path[--len] == '/') {
-                        vput(dir_vnode);
-                        return -EINVAL;
-                    }
-                else if(path[len] == '.')
-                        if(path[--len] == '/') {
-                                vput(dir_vnode);
-                                return -ENOTEMPTY;
-                            }
+        /* Check whether path has ".", ".." as its final component; dir_namev()
+         * has already dropped any trailing slashes. */
+        if(name_match(".", name, namelen)) {
+                vput(dir_vnode);
+                dbg(DBG_VFS,"VFS: Leave do_rmdir(), throw EINVAL\n");
+                return -EINVAL;
+        }
+        if(name_match("..", name, namelen)) {
+                vput(dir_vnode);
+                dbg(DBG_VFS,"VFS: Leave do_rmdir(), throw ENOTEMPTY\n");
+                return -ENOTEMPTY;
         }
         if(dir_vnode -> vn_ops -> rmdir == NULL) {
             vput(dir_vnode);
             dbg(DBG_VFS,"VFS: Leave do_rmdir(), throw ENOTDIR\n");
             return -ENOTDIR;
         }
+        /* Remember which dir goes, so that the names cached in it can go too */
+        vnode_t *victim;
+        ino_t victim_vno = 0;
+        int found = 0;
+        if(lookup(dir_vnode, name, namelen, &victim) == 0) {
+                victim_vno = victim->vn_vno;
+                found = (victim->vn_fs == dir_vnode->vn_fs);
+                vput(victim);
+        }
         /* Call the containing dir's rmdir v_op. */
         KASSERT(NULL != dir_vnode->vn_ops->rmdir);
         err = dir_vnode -> vn_ops -> rmdir(dir_vnode, name, namelen);
+        dcache_purge(dir_vnode, name, namelen);
+        if(found)
+                dcache_purge_dir(dir_vnode->vn_fs, victim_vno);
         vput(dir_vnode);
         /* Need vput()? */
         dbg(DBG_VFS,"VFS: Leave do_rmdir()\n");
@@ -513,6 +606,7 @@ do_unlink(const char *path)
         /* reomve the result vnode from the directory*/
         KASSERT(NULL != dir->vn_ops->unlink);
         int ret = dir->vn_ops->unlink(dir, name, namelen);
+        dcache_purge(dir, name, namelen);
         vput(result);
         vput(dir);
         dbg(DBG_VFS,"VFS: Leave do_unlink(), sucess\n");
@@ -585,6 +679,7 @@ do_link(const char *from, const char *to)
         }
         /* call the destination dir's (to) link vn_ops; 'from_vnode' refcount++ in link()*/
         int ret = to_dir->vn_ops->link(from_vnode, to_dir, name, namelen);
+        dcache_purge(to_dir, name, namelen);
 
         /* vput the vnodes returned from open_namev and dir_namev */
         vput(from_vnode);
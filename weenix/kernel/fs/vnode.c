@@ -6,6 +6,7 @@
  */
 
 #include "kernel.h"
+#include "config.h"
 #include "util/init.h"
 #include "util/string.h"
 #include "util/printf.h"
@@ -23,6 +24,17 @@ static slab_allocator_t *vnode_allocator;
 
 static list_t vnode_inuse_list;
 
+/* vget() finds vnodes by (fs, vno) on these chains */
+static list_t vnode_hash[VNODE_HASH_BUCKETS];
+
+/* Unreferenced vnodes still linked in their fs, most recently used first */
+static list_t vnode_cache;
+static int vnode_ncached = 0;
+
+#define vnode_chain(fs, vno)                                            \
+        (&vnode_hash[(((uint32_t)(fs) >> 4) ^ ((vno) * 0x9e3779b1U))    \
+                     & (VNODE_HASH_BUCKETS - 1)])
+
 /* Related to vnodes representing special files: */
 static void init_special_vnode(vnode_t *vn);
 static int special_file_read(vnode_t *file, off_t offset, void *buf, size_t count);
@@ -33,21 +45,26 @@ static int special_file_fillpage(vnode_t *file, off_t offset, void *pagebuf);
 static int special_file_dirtypage(vnode_t *file, off_t offset);
 static int special_file_cleanpage(vnode_t *file, off_t offset, void *pagebuf);
 /* mmobj_t entry points: */
+static void vnode_free(vnode_t *vn);
 static void vo_vref(mmobj_t *o);
 static void vo_vput(mmobj_t *o);
 
 static int  vlookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
 static int  vreadpage(mmobj_t *o, pframe_t *pf);
+static int  vreadpages(mmobj_t *o, pframe_t **pf, int npages);
 static int  vdirtypage(mmobj_t *o, pframe_t *pf);
 static int  vcleanpage(mmobj_t *o, pframe_t *pf);
+static int  vcleanpages(mmobj_t *o, pframe_t **pf, int npages);
 
 static mmobj_ops_t vnode_mmobj_ops = {
         .ref = vo_vref,
         .put = vo_vput,
         .lookuppage = vlookuppage,
         .fillpage = vreadpage,
+        .fillpages = vreadpages,
         .dirtypage = vdirtypage,
-        .cleanpage = vcleanpage
+        .cleanpage = vcleanpage,
+        .cleanpages = vcleanpages
 };
 
 /* vnode operations tables for special files: */
@@ -93,8 +110,14 @@ static vnode_ops_t blockdev_spec_vops = {
 static __attribute__((unused)) void
 vnode_init(void)
 {
+        int i;
+
         list_init(&vnode_inuse_list);
-        vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
+        for (i = 0; i < VNODE_HASH_BUCKETS; ++i)
+                list_init(&vnode_hash[i]);
+        list_init(&vnode_cache);
+        vnode_allocator = slab_allocator_create_aligned("vnode", sizeof(vnode_t),
+                                                        SLAB_CACHE_LINE_SIZE);
 }
 init_func(vnode_init);
 
@@ -115,12 +138,13 @@ vnode_t *
 vget(struct fs *fs, ino_t vno)
 {
         vnode_t *vn = NULL;
+        list_t *chain = vnode_chain(fs, vno);
 
         KASSERT(fs);
 
         /* look for inuse vnode */
 find:
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+        list_iterate_begin(chain, vn, vnode_t, vn_hash_link) {
                 if ((vn->vn_fs == fs) && (vn->vn_vno == vno)) {
                         /* found it... */
                         if (VN_BUSY & vn->vn_flags) {
@@ -135,6 +159,15 @@ find:
                                 goto find;
                         }
 
+                        if (0 == vn->vn_refcount) {
+                                /* back from the cache, no need to read
+                                 * it in */
+                                list_remove(&vn->vn_lru_link);
+                                vnode_ncached--;
+                                vn->vn_refcount = 1;
+                                return vn;
+                        }
+
 #ifndef __MOUNTING__
                         /* If we are implementing mountpoint support
                            then we should get the mounted vnode,
@@ -154,6 +187,14 @@ find:
         /*   alloc a new vnode: */
         vn = slab_obj_alloc(vnode_allocator);
         if (!vn) {
+                if (!list_empty(&vnode_cache)) {
+                        /* make room by giving up a cached vnode */
+                        vn = list_tail(&vnode_cache, vnode_t, vn_lru_link);
+                        list_remove(&vn->vn_lru_link);
+                        vnode_ncached--;
+                        vnode_free(vn);
+                        goto find;
+                }
                 dbg(DBG_VNREF, "vget: kmem has been exhausted. "
                     "will then re-attempt to vget vnode later %d of fs %p\n", vno, fs);
                 sched_make_runnable(curthr);
@@ -165,7 +206,7 @@ find:
         /*     members that can be initialized here: */
         vn->vn_fs = fs;
         vn->vn_vno = vno;
-        kmutex_init(&vn->vn_mutex);
+        krwlock_init(&vn->vn_rwlock);
         mmobj_init(&vn->vn_mmobj, &vnode_mmobj_ops);
         sched_queue_init(&vn->vn_waitq);
 
@@ -185,6 +226,7 @@ find:
          */
         vn->vn_flags |= VN_BUSY;
         list_insert_head(&vnode_inuse_list, &vn->vn_link);
+        list_insert_head(chain, &vn->vn_hash_link);
 
         KASSERT(vn->vn_fs->fs_op && vn->vn_fs->fs_op->read_vnode);
         /*       this is where we might block (depending on the underlying
@@ -243,25 +285,19 @@ vput(struct vnode *vn)
 
         if ((vn->vn_nrespages == (vn->vn_refcount - 1))
             && !vn->vn_fs->fs_op->query_vnode(vn)) {
-                pframe_t *vp;
                 /* vn is becoming passively-referenced, and the linkcount
                  * is zero, so there is no way for it to become
                  * actively-referenced ever again, and thus there is no
                  * point in keeping it or any cached pages of it around.
                  */
-                list_iterate_begin(&vn->vn_mmobj.mmo_respages, vp, pframe_t,
-                                   pf_olink) {
-                        /*  (dbounov):
-                         * Wait for the page to become not busy.
-                         * At this point the only people who can be accessing the
-                         * page are pframe_sync and the pageoutd (the shadowd does
-                         * not touch non-anonymous objects). Both of them should
-                         * definately free the page, if they have it busy.
-                         */
-                        while (pframe_is_busy(vp))
-                                sched_sleep_on(&(vp->pf_waitq));
-                        pframe_free(vp);
-                } list_iterate_end();
+                /*  (dbounov):
+                 * pframe_free_range waits for each page to become not busy.
+                 * At this point the only people who can be accessing the
+                 * page are pframe_sync and the pageoutd (the shadowd does
+                 * not touch non-anonymous objects). Both of them should
+                 * definately free the page, if they have it busy.
+                 */
+                pframe_free_range(&vn->vn_mmobj, 0, PFRAME_MAX_PAGENUM);
 
                 /* at this point, no matter what: */
                 KASSERT(0 == vn->vn_nrespages);
@@ -282,7 +318,33 @@ vput(struct vnode *vn)
         KASSERT(vn->vn_mount == vn);
 #endif
 
-        /* no res pages and no more active references; free the vnode */
+        /* no res pages and no more active references */
+        KASSERT(0 == vn->vn_refcount);
+        KASSERT(0 == vn->vn_nrespages);
+
+        /* keep it around while it can still be looked up, except for the
+         * root, which only goes away when its fs is unmounted */
+        if ((vn != vn->vn_fs->fs_root) && vn->vn_fs->fs_op->query_vnode(vn)) {
+                list_insert_head(&vnode_cache, &vn->vn_lru_link);
+                if (++vnode_ncached > VNODE_CACHE_MAX) {
+                        vn = list_tail(&vnode_cache, vnode_t, vn_lru_link);
+                        list_remove(&vn->vn_lru_link);
+                        vnode_ncached--;
+                        vnode_free(vn);
+                }
+                return;
+        }
+
+        vnode_free(vn);
+}
+
+/*
+ * Calls delete_vnode on an unreferenced vnode which is on no cache, and
+ * frees it.
+ */
+static void
+vnode_free(vnode_t *vn)
+{
         KASSERT(0 == vn->vn_refcount);
         KASSERT(0 == vn->vn_nrespages);
 
@@ -305,10 +367,26 @@ vput(struct vnode *vn)
         sched_broadcast_on(&vn->vn_waitq);
 
         list_remove(&vn->vn_link); /* remove from vn_inuse_list */
+        list_remove(&vn->vn_hash_link);
+        dbg(DBG_DISK,"VFS: Leave vput(), removed! vno=%d\n", vn->vn_vno);
         slab_obj_free(vnode_allocator, vn);
-        dbg(DBG_DISK,"VFS: Leave vput(), removed! vno=%d, vn_refcount=%d\n", vn->vn_vno, vn->vn_refcount);
-        /*dbg(DBG_VFS,"##########VFS:List all vnode after(removed) vput");
-        vnode_print(vn->vn_fs);*/
+}
+
+void
+vnode_uncache(fs_t *fs)
+{
+        vnode_t *vn;
+
+again:
+        list_iterate_begin(&vnode_cache, vn, vnode_t, vn_lru_link) {
+                if (vn->vn_fs == fs) {
+                        list_remove(&vn->vn_lru_link);
+                        vnode_ncached--;
+                        /* This may block, and the cache change under us */
+                        vnode_free(vn);
+                        goto again;
+                }
+        } list_iterate_end();
 }
 
 int
@@ -370,37 +448,40 @@ void
 vnode_flush_all(struct fs *fs)
 {
         vnode_t *v;
-        pframe_t *p;
         int err;
 
 clean:
         list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-                list_iterate_begin(&v->vn_mmobj.mmo_respages,
-                                   p, pframe_t, pf_olink) {
-                        if (pframe_is_dirty(p)) {
-                                if (0 > (err = pframe_clean(p))) {
-                                        dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean page %d of "
-                                            "vnode %ld of fs %p of type %s\n", p->pf_pagenum,
-                                            (long)v->vn_vno, v->vn_fs, v->vn_fs->fs_type);
-                                }
-                                KASSERT((!err)
-                                        && "as things presently stand, "
-                                        "this shouldn't happen");
-                                /* This may have blocked. */
-                                goto clean;
-                        }
-                } list_iterate_end();
+                /* Cleans the vnode's dirty pages in file order */
+                if (0 > (err = pframe_clean_range(&v->vn_mmobj, 0, PFRAME_MAX_PAGENUM))) {
+                        dbg(DBG_VFS, "vnode_flush_all: WARNING: failed to clean pages of "
+                            "vnode %ld of fs %p of type %s\n",
+                            (long)v->vn_vno, v->vn_fs, v->vn_fs->fs_type);
+                }
+                KASSERT((0 <= err)
+                        && "as things presently stand, "
+                        "this shouldn't happen");
+                /* This may have blocked. */
+                if (0 < err)
+                        goto clean;
         } list_iterate_end();
 
         /* all pages of all vnodes belonging to this fs have been cleaned.
          * Now, uncache all of them: */
+uncache:
         list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
-                list_iterate_begin(&v->vn_mmobj.mmo_respages,
-                                   p, pframe_t, pf_olink) {
-                        KASSERT(!pframe_is_dirty(p));
-                        pframe_free(p);
-                } list_iterate_end();
+                if (0 < v->vn_nrespages) {
+                        pframe_free_range(&v->vn_mmobj, 0, PFRAME_MAX_PAGENUM);
+                        /* Dropping the references of the pages may have
+                         * freed vnodes, this one or others evicted from
+                         * the cache to make room for it. */
+                        goto uncache;
+                }
         } list_iterate_end();
+
+        /* which leaves those which were only referenced by their pages
+         * unreferenced */
+        vnode_uncache(fs);
 }
 
 
@@ -598,6 +679,30 @@ vreadpage(mmobj_t *o, pframe_t *pf)
         return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
 }
 
+static int
+vreadpages(mmobj_t *o, pframe_t **pf, int npages)
+{
+        void *bufs[PFRAME_CLUSTER_MAX];
+        int i, ret;
+
+        KASSERT(NULL != pf);
+        KASSERT(NULL != o);
+        KASSERT(npages <= PFRAME_CLUSTER_MAX);
+
+        vnode_t *v = mmobj_to_vnode(o);
+        if (NULL == v->vn_ops->fillpages) {
+                for (i = 0; i < npages; i++) {
+                        if (0 > (ret = vreadpage(o, pf[i])))
+                                return ret;
+                }
+                return 0;
+        }
+
+        for (i = 0; i < npages; i++)
+                bufs[i] = pf[i]->pf_addr;
+        return v->vn_ops->fillpages(v, (int)PN_TO_ADDR(pf[0]->pf_pagenum), bufs, npages);
+}
+
 static int
 vdirtypage(mmobj_t *o, pframe_t *pf)
 {
@@ -621,3 +726,27 @@ vcleanpage(mmobj_t *o, pframe_t *pf)
         vnode_t *v = mmobj_to_vnode(o);
         return v->vn_ops->cleanpage(v, (int) PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
 }
+
+static int
+vcleanpages(mmobj_t *o, pframe_t **pf, int npages)
+{
+        void *bufs[PFRAME_CLUSTER_MAX];
+        int i, ret;
+
+        KASSERT(NULL != pf);
+        KASSERT(NULL != o);
+        KASSERT(npages <= PFRAME_CLUSTER_MAX);
+
+        vnode_t *v = mmobj_to_vnode(o);
+        if (NULL == v->vn_ops->cleanpages) {
+                for (i = 0; i < npages; i++) {
+                        if (0 > (ret = vcleanpage(o, pf[i])))
+                                return ret;
+                }
+                return 0;
+        }
+
+        for (i = 0; i < npages; i++)
+                bufs[i] = pf[i]->pf_addr;
+        return v->vn_ops->cleanpages(v, (int)PN_TO_ADDR(pf[0]->pf_pagenum), bufs, npages);
+}
@@ -56,6 +56,10 @@
 #define SYS_mount               45
 #define SYS_umount              46
 #define SYS_stat                47
+#define SYS_readv               48
+#define SYS_writev              49
+#define SYS_pread               50
+#define SYS_pwrite              51
 
 /*
  * ... what does the scouter say about his syscall?
@@ -116,6 +120,29 @@ typedef struct write_args {
         size_t  nbytes;
 } write_args_t;
 
+/* Most buffers a readv or writev takes */
+#define IOV_MAX 16
+
+struct iovec {
+        void   *iov_base;
+        size_t  iov_len;
+};
+
+/* Arguments of readv and writev */
+typedef struct rwv_args {
+        int           fd;
+        struct iovec *iov;
+        int           iovcnt;
+} rwv_args_t;
+
+/* Arguments of pread and pwrite */
+typedef struct prw_args {
+        int     fd;
+        void   *buf;
+        size_t  nbytes;
+        off_t   offset;
+} prw_args_t;
+
 typedef struct mkdir_args {
         argstr_t path;
         int      mode;
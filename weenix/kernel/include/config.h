@@ -25,10 +25,15 @@
 #define KMEM_FRAC(x)               (((x)>>2)+((x)>>3)) /* 37.5%-ish */
 
 /*     pframe/mmobj-system-related: */
-#define PF_HASH_SIZE                  17 /* Number of buckets in pn/mmobj->pframe hash */
-/*         Pageout-related: */
-#define PAGEOUTD_FREE_TARGET_SHIFT     5 /* 3.125% */
-#define PAGEOUTD_FREE_MIN_SHIFT        4 /* 6.25% */
+#define PF_HASH_MIN_ORDER              5 /* pn/mmobj->pframe hash starts with 2^order buckets */
+#define PF_HASH_MAX_ORDER             14 /* and grows up to 2^order buckets */
+#define PF_HASH_LOAD                   2 /* grow when there are more pages than this per bucket */
+/*         Pageout-related (fractions of the page frames free at boot): */
+#define PAGEOUTD_FREE_MIN_SHIFT        7 /* 0.78%: only pageoutd allocates below this */
+#define PAGEOUTD_FREE_LOW_SHIFT        5 /* 3.125%: pageoutd is woken below this */
+#define PAGEOUTD_FREE_HIGH_SHIFT       4 /* 6.25%: and reclaims until this many are free */
+#define PAGEOUTD_DIRTY_BG_SHIFT        3 /* 12.5%: background writeback above this many dirty */
+#define PAGEOUTD_DIRTY_LIMIT_SHIFT     2 /* 25%: writers wait for writeback above this */
 
 
 /*
@@ -39,8 +44,14 @@
 #define MAX_FILES               1024    /* max number of files */
 #define MAX_VFS                 8       /* max # of vfses */
 #define MAX_VNODES              1024    /* max number of in-core vnodes */
+#define VNODE_HASH_BUCKETS      256     /* vget() hash chains, a power of 2 */
+#define VNODE_CACHE_MAX         64      /* unreferenced vnodes kept in core */
 #define NAME_LEN                28      /* maximum directory entry length */
 #define NFILES                  32      /* maximum number of open files */
+#define READAHEAD_MIN_PAGES     4       /* first readahead window of a file */
+#define READAHEAD_MAX_PAGES     32      /* windows double up to this size */
+#define DCACHE_ENTRIES          512     /* cached directory name lookups */
+#define DCACHE_BUCKETS          256     /* dcache hash chains, a power of 2 */
 
 /* Note: if rootfs is ramfs, this is completely ignored */
 #define VFS_ROOTFS_DEV  "disk0" /* device containing root filesystem */
@@ -15,7 +15,55 @@
 
 #define BLOCK_SIZE PAGE_SIZE
 
+/* Most blocks the request queue will hand a driver at once */
+#define BLOCKDEV_MAX_BLOCKS 128
+
+/* Service times are binned by powers of two cycles, the first bucket
+ * holding everything below 2^BLOCKDEV_HIST_MIN_SHIFT and the last
+ * everything above */
+#define BLOCKDEV_HIST_BUCKETS   16
+#define BLOCKDEV_HIST_MIN_SHIFT 14
+
 struct blockdev_ops;
+struct blockdev_req;
+
+/*
+ * I/O counters of a block device, reported by blockdev_info().
+ */
+typedef struct blockdev_stats {
+        uint32_t        bs_fills;       /* pages read for the page cache */
+        uint32_t        bs_cleans;      /* pages written for the page cache */
+        uint32_t        bs_reads;       /* read requests completed */
+        uint32_t        bs_writes;      /* write requests completed */
+        uint32_t        bs_read_blocks;
+        uint32_t        bs_write_blocks;
+        uint32_t        bs_errors;      /* requests which failed */
+        uint32_t        bs_transfers;   /* transfers started on the device */
+        uint32_t        bs_merged;      /* requests merged into another's transfer */
+        uint32_t        bs_queued;      /* requests waiting for the device now */
+        uint32_t        bs_max_queued;
+        uint64_t        bs_busy_cycles; /* total service time of all transfers */
+        uint32_t        bs_hist[BLOCKDEV_HIST_BUCKETS];
+} blockdev_stats_t;
+
+typedef void (*blockdev_done_t)(struct blockdev_req *req);
+
+/*
+ * A read or write of consecutive blocks, queued on a block device by
+ * blockdev_submit(). br_done is called once the transfer is over,
+ * from the device's interrupt handler, with br_status set to 0 or
+ * -errno; it must not block.
+ */
+typedef struct blockdev_req {
+        blocknum_t          br_block;   /* first block */
+        size_t              br_count;   /* number of blocks */
+        char              **br_bufs;    /* one page-aligned buffer per block */
+        int                 br_write;
+        int                 br_status;
+        blockdev_done_t     br_done;
+        void               *br_arg;     /* for br_done */
+        list_link_t         br_link;    /* on bd_queue or bd_active */
+} blockdev_req_t;
 
 /*
  * Represents a Weenix block device.
@@ -26,9 +74,27 @@ typedef struct blockdev {
 
         struct blockdev_ops  *bd_ops;
 
+        /* Most blocks start_request can transfer at once, at most
+         * BLOCKDEV_MAX_BLOCKS */
+        size_t bd_max_blocks;
+
         /* Fields that should be ignored by drivers: */
         struct mmobj bd_mmobj;
 
+        /* Requests waiting for the device, in C-LOOK order: ascending
+         * from bd_head, then ascending from the lowest block */
+        list_t bd_queue;
+        blocknum_t bd_head;
+
+        /* Requests merged into the transfer the device is working on,
+         * and the buffers of that transfer */
+        list_t bd_active;
+        char *bd_bufs[BLOCKDEV_MAX_BLOCKS];
+
+        /* When the current transfer was started, in cycles */
+        uint64_t bd_start;
+        blockdev_stats_t bd_stats;
+
         /* Link on the list of block-oriented devices */
         list_link_t bd_link;
 } blockdev_t;
@@ -59,6 +125,55 @@ typedef struct blockdev_ops {
          */
         int (*write_block)(blockdev_t *bdev, const char *buf,
                            blocknum_t loc, size_t count);
+
+        /**
+         * Reads consecutive blocks from the block device into separate
+         * buffers, as a single operation if the device can. Optional;
+         * may be NULL. This call will block.
+         *
+         * @param bdev the block device
+         * @param bufs the memory into which to read each block (each
+         *      must be page-aligned)
+         * @param loc the number of the block to start reading from
+         * @param count the number of blocks to read
+         * @return 0 on success, -errno on failure
+         */
+        int (*read_blockv)(blockdev_t *bdev, char **bufs,
+                           blocknum_t loc, size_t count);
+
+        /**
+         * Writes consecutive blocks to the block device from separate
+         * buffers, as a single operation if the device can. Optional;
+         * may be NULL. This call will block.
+         *
+         * @param bdev the block device
+         * @param bufs the memory from which to write each block (each
+         *      must be page-aligned)
+         * @param loc the number of the block to start writing at
+         * @param count the number of blocks to write
+         * @return 0 on success, -errno on failure
+         */
+        int (*write_blockv)(blockdev_t *bdev, char **bufs,
+                            blocknum_t loc, size_t count);
+
+        /**
+         * Starts a transfer of consecutive blocks and returns without
+         * waiting for it. Called with block device interrupts masked,
+         * possibly from an interrupt handler. When the transfer is
+         * over the driver's interrupt handler must call
+         * blockdev_complete(). Optional; blockdev_submit() may only
+         * be used on devices which provide it.
+         *
+         * @param bdev the block device
+         * @param bufs the buffers to transfer, one per block (each
+         *      must be page-aligned)
+         * @param loc the number of the first block
+         * @param count the number of blocks, at most bd_max_blocks
+         * @param write true if writing, false if reading
+         * @return 0 if the transfer was started, -errno otherwise
+         */
+        int (*start_request)(blockdev_t *bdev, char **bufs,
+                             blocknum_t loc, size_t count, int write);
 } blockdev_ops_t;
 
 /**
@@ -82,6 +197,50 @@ int blockdev_register(blockdev_t *dev);
  */
 blockdev_t *blockdev_lookup(devid_t id);
 
+/**
+ * Debugging information about every block device's I/O counters, in
+ * the format of the other *_info functions.
+ */
+size_t blockdev_info(const void *arg, char *buf, size_t osize);
+
+/**
+ * Queues a request on a block device and returns without waiting for
+ * it. Requests for adjacent blocks in the same direction are merged
+ * into one transfer. req must stay valid until req->br_done is called,
+ * which may happen before this returns if the request fails.
+ *
+ * @param bd the block device, whose driver provides start_request
+ * @param req the request, with all fields but br_status and br_link
+ *      filled in and br_count at most bd->bd_max_blocks
+ */
+void blockdev_submit(blockdev_t *bd, blockdev_req_t *req);
+
+/**
+ * Called by drivers, from the interrupt handler, when the transfer
+ * started by start_request is over. Completes every request merged
+ * into it and starts the next transfer. Does nothing if no transfer
+ * is in progress, e.g. on a spurious interrupt.
+ *
+ * @param bd the block device
+ * @param status 0 or -errno
+ */
+void blockdev_complete(blockdev_t *bd, int status);
+
+/**
+ * Transfers blocks through the request queue and blocks until they are
+ * done. Drivers use this to implement read_block and the others on top
+ * of start_request.
+ *
+ * @param bd the block device
+ * @param bufs one page-aligned buffer per block
+ * @param loc the number of the first block
+ * @param count the number of blocks, which may be any number
+ * @param write true if writing, false if reading
+ * @return 0 on success, -errno on failure
+ */
+int blockdev_transfer(blockdev_t *bd, char **bufs, blocknum_t loc,
+                      size_t count, int write);
+
 /**
  * Cleans and frees all resident pages belonging to a given block
  * device.
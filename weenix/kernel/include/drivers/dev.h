@@ -19,6 +19,7 @@
  *     - char major 1:         Memory devices (mem)
  *         - minor 0:          /dev/null       The null device
  *         - minor 1:          /dev/zero       The zero device
+ *         - minor 2:          /dev/iostat     Block device I/O counters
  *
  *     - char major 2:         TTY devices (tty)
  *         - minor 0:          /dev/tty0       First TTY device
@@ -41,9 +42,11 @@
 #define NULL_DEVID              (MKDEVID(0, 0))
 #define MEM_NULL_DEVID          (MKDEVID(1, 0))
 #define MEM_ZERO_DEVID          (MKDEVID(1, 1))
+#define MEM_IOSTAT_DEVID        (MKDEVID(1, 2))
 
 #define DISK_MAJOR 1
 
 #define MEM_MAJOR       1
 #define MEM_NULL_MINOR  0
 #define MEM_ZERO_MINOR  1
+#define MEM_IOSTAT_MINOR 2
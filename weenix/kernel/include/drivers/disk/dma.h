@@ -1,5 +1,15 @@
 #pragma once
 
+#include "types.h"
+
+#include "mm/page.h"
+
+/* Most entries in a channel's physical region descriptor table, and so
+ * most bytes in one transfer: 512KiB in separate pages, which an LBA48
+ * command can move in one go */
+#define DMA_MAX_PRDS    128
+#define DMA_MAX_BYTES   ((int)(DMA_MAX_PRDS * PAGE_SIZE))
+
 /**
  * Initializes the DMA subsystem.
  */
@@ -24,12 +34,25 @@ void dma_reset(uint8_t channel);
  * Initialize DMA for an operation
  *
  * @param channel the channel on which to perform the operation
- * @param start the beginning of the buffer in memory
- * @param count the number of bytes to read/write
+ * @param start the beginning of the buffer in memory, which must be
+ *        page-aligned but need not be physically contiguous
+ * @param count the number of bytes to read/write, at most DMA_MAX_BYTES
  * @param write true if writing, false if reading
  */
 void dma_load(uint8_t channel, void *start, int count, int write);
 
+/**
+ * Initialize DMA for an operation which scatters to or gathers from
+ * several buffers, in order, as a single transfer
+ *
+ * @param channel the channel on which to perform the operation
+ * @param bufs the buffers, each of which must be page-aligned
+ * @param nbufs the number of buffers
+ * @param bufsize the number of bytes to read/write for each buffer
+ * @param write true if writing, false if reading
+ */
+void dma_load_sg(uint8_t channel, char **bufs, int nbufs, int bufsize, int write);
+
 /**
  * Cancel the current DMA operation.
  *
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "types.h"
+
+struct fs;
+struct vnode;
+
+/*
+ * The directory name lookup cache remembers what lookup() found for a
+ * (directory, name) pair: the vnode number of the entry, or that there
+ * is no such entry. Entries are keyed on the file system and vnode
+ * number of the directory rather than on the vnode itself, since vnodes
+ * are freed and reused while the cache still holds their names.
+ *
+ * Anything which adds or removes a name from a directory must purge that
+ * name. As lookups can block in the file system while a purge goes on,
+ * a lookup which missed only enters its result if nothing was purged in
+ * the meantime; see dcache_stamp().
+ */
+
+/*
+ * Looks up name in dir.
+ *
+ * @return 1 if the name is cached, with *result set to the entry with
+ * its refcount incremented, or to NULL if the name is known not to
+ * exist; 0 if the name is not cached
+ */
+int dcache_lookup(struct vnode *dir, const char *name, size_t len,
+                  struct vnode **result);
+
+/*
+ * Returns a stamp to take before asking the file system for a name and
+ * to pass to dcache_enter() afterwards.
+ */
+uint32_t dcache_stamp(void);
+
+/*
+ * Caches the result of looking up name in dir, which is the entry, or
+ * NULL if there is none. Does nothing if anything has been purged since
+ * stamp was taken, or if the entry is on another file system (that is,
+ * it is a mount point).
+ */
+void dcache_enter(struct vnode *dir, const char *name, size_t len,
+                  struct vnode *result, uint32_t stamp);
+
+/*
+ * Forgets name in dir. Must be called once anything which adds or
+ * removes the name is over, whether or not it succeeded.
+ */
+void dcache_purge(struct vnode *dir, const char *name, size_t len);
+
+/*
+ * Forgets every name in directory vno of fs, which is being removed.
+ */
+void dcache_purge_dir(struct fs *fs, ino_t vno);
+
+/*
+ * Forgets every name on fs, which is being unmounted.
+ */
+void dcache_purge_fs(struct fs *fs);
+
+/*
+ * Debugging information about the hit rate of the cache, in the format
+ * of the other *_info functions.
+ */
+size_t dcache_info(const void *arg, char *buf, size_t osize);
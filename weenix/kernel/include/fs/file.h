@@ -2,6 +2,8 @@
 
 #include "types.h"
 
+#include "fs/readahead.h"
+
 #define FMODE_READ    1
 #define FMODE_WRITE   2
 #define FMODE_APPEND  4
@@ -34,6 +36,12 @@ typedef struct file {
          * The vnode which corresponds to this file.
          */
         struct vnode            *f_vnode;
+
+        /*
+         * Readahead state for reads through this file (see
+         * fs/readahead.h). Starts out zeroed.
+         */
+        readahead_t             f_ra;
 } file_t;
 
 /*
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+
+/*
+ * Per-open-file readahead state. All zeroes is the initial state, in
+ * which a read starting at the beginning of the file counts as
+ * sequential.
+ */
+typedef struct readahead {
+        uint32_t        ra_next;    /* page a sequential reader reads next */
+        uint32_t        ra_start;   /* first page of the last window issued */
+        uint32_t        ra_size;    /* its size in pages, 0 if there is none */
+} readahead_t;
+
+/*
+ * Records that pages [pagenum, pagenum + npages) of o are about to be read
+ * through the given readahead state. If the reads so far have been
+ * sequential, this keeps a window of pages ahead of the reader being read
+ * in by the readahead daemon: the first window is READAHEAD_MIN_PAGES
+ * long, and each time the reader enters the last window issued, the next
+ * one is issued, twice as long up to READAHEAD_MAX_PAGES. A read which is
+ * not sequential closes the window. Pages at or past endpage are never
+ * read ahead.
+ *
+ * This does not block. The caller must hold a reference to o.
+ */
+void readahead_access(readahead_t *ra, struct mmobj *o, uint32_t pagenum,
+                      uint32_t npages, uint32_t endpage);
+
+/*
+ * Waits for the readahead daemon to finish the requests it has been given
+ * and stops it. Must be called from the idle process before the file
+ * systems are unmounted.
+ */
+void readahead_shutdown(void);
@@ -21,10 +21,13 @@
 #define S5_IS_SUPER(blkno)      ( (blkno) == S5_SUPER_BLOCK )
 #define S5_NBLKS_PER_FNODE      30
 #define S5_BLOCK_SIZE           4096
-#define S5_NDIRECT_BLOCKS       28
+#define S5_NDIRECT_BLOCKS       26
 #define S5_INODES_PER_BLOCK     (S5_BLOCK_SIZE /  sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK    (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
-#define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + (S5_BLOCK_SIZE / sizeof(uint32_t)))
+#define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + S5_NIDIRECT_BLOCKS      \
+                                 + S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS \
+                                 + S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS \
+                                 * S5_NIDIRECT_BLOCKS)
 #define S5_NAME_LEN             28
 
 #define S5_TYPE_FREE            0x0
@@ -33,12 +36,45 @@
 #define S5_TYPE_CHR             0x4
 #define S5_TYPE_BLK             0x8
 
+/* Inode flags */
+#define S5_INODE_EXTENTS        0x1     /* blocks mapped by an extent tree */
+#define S5_INODE_HASHED         0x2     /* directory with a hash index */
+
 #define S5_MAGIC                071177
-#define S5_CURRENT_VERSION      3
+#define S5_CURRENT_VERSION      5
+
+/* Blocks covered by one block of the free-block bitmap. Each such run
+ * of blocks is an allocation group. */
+#define S5_BITS_PER_BLOCK       (S5_BLOCK_SIZE * 8)
+
+/* Number of bitmap blocks for a disk of the given number of blocks */
+#define S5_BITMAP_BLOCKS(nblocks) \
+        (((nblocks) + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK)
 
 /* Number of blocks stored in the indirect block */
 #define S5_NIDIRECT_BLOCKS      (S5_BLOCK_SIZE / sizeof(uint32_t))
 
+/* Levels of indirection below an inode: single, double and triple */
+#define S5_INDIRECT_LEVELS      3
+
+/* Extents held by the root of an extent tree, in the inode, and by
+ * the other nodes of the tree, each a block */
+#define S5_INODE_NEXTENTS       ((sizeof(uint32_t) * (S5_NDIRECT_BLOCKS + S5_INDIRECT_LEVELS) \
+                                  - sizeof(s5_extent_header_t)) / sizeof(s5_extent_t))
+#define S5_BLOCK_NEXTENTS       ((S5_BLOCK_SIZE - sizeof(s5_extent_header_t)) \
+                                 / sizeof(s5_extent_t))
+
+/* Entries in the blocks of a hashed directory */
+#define S5_DX_ROOT_ENTRIES      ((S5_BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(s5_dx_entry_t))
+#define S5_DX_LEAF_ENTRIES      ((S5_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(s5_hdirent_t))
+
+/* Most levels of an extent tree below its root */
+#define S5_EXTENT_MAX_DEPTH     3
+
+/* Entries in the per-filesystem cache of the indirect blocks which map
+ * file blocks to disk blocks; a power of two */
+#define S5_BMAP_CACHE_SIZE      512
+
 /* Given a file offset, returns the block number that it is in */
 #define S5_DATA_BLOCK(seekptr)  ((seekptr) / S5_BLOCK_SIZE)
 
@@ -57,13 +93,36 @@
 /* Given an FS struct, get the S5FS (private data) struct. */
 #define FS_TO_S5FS(fs)  ( (s5fs_t *)((fs)->fs_i))
 
-/* each node of the free block list looks like this: */
 /*
-typedef struct s5_fbl_node {
-        int free_blocks[S5_NBLKS_PER_FNODE-1];
-        int more;
-} s5_fbl_node_t;
-*/
+ * Free blocks are tracked by a bitmap with a bit set for each block in
+ * use, stored in s5s_bitmap_blocks blocks right after the inodes. Bit n
+ * of the bitmap is bit (n % 32) of its (n / 32)th little-endian 32-bit
+ * word. Bits past the end of the disk are set.
+ *
+ * Versions before 4 kept a chain of free block lists instead, starting
+ * in the superblock; those fields are now unused and zero.
+ *
+ * Since version 5 an inode has 26 direct blocks followed by a single,
+ * a double and a triple indirect block, rather than 28 direct blocks
+ * and a single indirect block. Each indirect block holds
+ * S5_NIDIRECT_BLOCKS pointers to the blocks of the level below.
+ *
+ * Inodes with S5_INODE_EXTENTS set (data files created by the kernel
+ * since version 5) map their blocks with an extent tree instead, whose
+ * root takes the place of the block pointers in the inode. Each node of
+ * the tree is an s5_extent_header_t followed by its entries, sorted by
+ * s5e_lblock. The entries of leaves (depth 0) are extents; those of the
+ * other nodes point to the child node holding the extents from
+ * s5e_lblock up to the next entry's s5e_lblock.
+ *
+ * A directory is an array of s5_dirent_t until it outgrows its first
+ * block. It then becomes a hashed directory (S5_INODE_HASHED): block 0
+ * is an s5_dx_root_t, indexing the leaf blocks after it by the hash of
+ * the names they hold. Each leaf is an s5_dx_leaf_t holding the names
+ * whose hash falls between its index entry's and the next one's, as
+ * s5_hdirent_t sorted by hash. A full leaf is split in two, so the
+ * directory grows by one leaf at a time; leaves are never merged.
+ */
 
 /* Note that all on-disk types need to have hard-coded sizes (to ensure
  * inter-machine compatibility of s5 disks) */
@@ -72,16 +131,32 @@ typedef struct s5_fbl_node {
 typedef struct s5_super {
         uint32_t s5s_magic;              /* the magic number */
         uint32_t s5s_free_inode;         /* the free inode pointer */
-        uint32_t s5s_nfree;              /* number of blocks currently in
-                                          * s5s_free_blocks */
-        /** First "node" of free block list */
-        uint32_t s5s_free_blocks[S5_NBLKS_PER_FNODE];
+        uint32_t s5s_nfree;              /* unused */
+        uint32_t s5s_free_blocks[S5_NBLKS_PER_FNODE]; /* unused */
 
         uint32_t s5s_root_inode;         /* root inode */
         uint32_t s5s_num_inodes;         /* number of inodes */
         uint32_t s5s_version;            /* version of this disk format */
+        uint32_t s5s_num_blocks;         /* number of blocks on the disk */
+        uint32_t s5s_bitmap_block;       /* first block of the bitmap */
+        uint32_t s5s_bitmap_blocks;      /* number of bitmap blocks */
 } s5_super_t;
 
+/* A run of s5e_len blocks of a file starting at block s5e_lblock,
+ * stored in consecutive disk blocks starting at s5e_pblock. In interior
+ * nodes of an extent tree s5e_pblock is the child node and s5e_len 0. */
+typedef struct s5_extent {
+        uint32_t s5e_lblock;
+        uint32_t s5e_pblock;
+        uint32_t s5e_len;
+} s5_extent_t;
+
+/* The start of every node of an extent tree */
+typedef struct s5_extent_header {
+        uint16_t s5eh_depth;             /* levels below this node */
+        uint16_t s5eh_count;             /* entries in use */
+} s5_extent_header_t;
+
 /* The contents of an inode, as stored on disk. */
 typedef struct s5_inode {
         union {
@@ -91,10 +166,27 @@ typedef struct s5_inode {
 #define        s5_next_free s5_un.s5_next_free
 #define        s5_size      s5_un.s5_size
         uint32_t   s5_number;              /* this inode's number */
-        uint16_t   s5_type;         /* one of S5_TYPE_{FREE,DATA,DIR} */
+        uint8_t    s5_type;         /* one of S5_TYPE_{FREE,DATA,DIR} */
+        uint8_t    s5_flags;        /* S5_INODE_* */
         int16_t    s5_linkcount;    /* link count of this inode */
-        uint32_t   s5_direct_blocks[S5_NDIRECT_BLOCKS];
-        uint32_t   s5_indirect_block;
+        union {
+                struct {
+                        uint32_t s5_direct_blocks[S5_NDIRECT_BLOCKS];
+                        uint32_t s5_indirect_block;  /* devid of device files */
+                        uint32_t s5_dindirect_block;
+                        uint32_t s5_tindirect_block;
+                } s5_blocks;
+                struct {
+                        s5_extent_header_t s5_extent_head;
+                        s5_extent_t        s5_extents[S5_INODE_NEXTENTS];
+                } s5_tree;
+        } s5_map;
+#define        s5_direct_blocks   s5_map.s5_blocks.s5_direct_blocks
+#define        s5_indirect_block  s5_map.s5_blocks.s5_indirect_block
+#define        s5_dindirect_block s5_map.s5_blocks.s5_dindirect_block
+#define        s5_tindirect_block s5_map.s5_blocks.s5_tindirect_block
+#define        s5_extent_head     s5_map.s5_tree.s5_extent_head
+#define        s5_extents         s5_map.s5_tree.s5_extents
 } s5_inode_t;
 
 /* The contents of a directory entry, as stored on disk. */
@@ -103,13 +195,55 @@ typedef struct s5_dirent {
         char       s5d_name[S5_NAME_LEN];
 } s5_dirent_t;
 
+/* The entry for a name in a leaf of a hashed directory */
+typedef struct s5_hdirent {
+        uint32_t   s5hd_inode;
+        uint32_t   s5hd_hash;
+        char       s5hd_name[S5_NAME_LEN];
+} s5_hdirent_t;
+
+typedef struct s5_dx_leaf {
+        uint32_t     s5dl_count;
+        s5_hdirent_t s5dl_entries[S5_DX_LEAF_ENTRIES];
+} s5_dx_leaf_t;
+
+/* An index entry: names with hashes from s5dx_hash on are in leaf
+ * s5dx_block (a block of the directory file) */
+typedef struct s5_dx_entry {
+        uint32_t   s5dx_hash;
+        uint32_t   s5dx_block;
+} s5_dx_entry_t;
+
+/* Block 0 of a hashed directory; the first entry's hash is 0 */
+typedef struct s5_dx_root {
+        uint32_t      s5dr_count;        /* index entries (and leaves) */
+        uint32_t      s5dr_dirents;      /* names in the directory */
+        s5_dx_entry_t s5dr_entries[S5_DX_ROOT_ENTRIES];
+} s5_dx_root_t;
+
 #ifndef __FSMAKER__
+/* A cached indirect block at the bottom of a file's tree, which holds
+ * the disk blocks of S5_NIDIRECT_BLOCKS file blocks from sb_lblock on;
+ * empty if sb_pblock is 0 */
+typedef struct s5_bmap_entry {
+        uint32_t                sb_ino;
+        uint32_t                sb_lblock;
+        uint32_t                sb_pblock;      /* the indirect block */
+} s5_bmap_entry_t;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs {
         blockdev_t              *s5f_bdev;
         s5_super_t              *s5f_super;
-        kmutex_t                s5f_mutex;
+        kmutex_t                s5f_inode_mutex;  /* inode free list */
+        kmutex_t                s5f_block_mutex;  /* free block bitmap */
         fs_t                    *s5f_fs;
+        /* Where to look for a free block when a file has no block
+         * to allocate next to: just past the last one allocated */
+        uint32_t                s5f_alloc_rotor;
+        /* Recently used indirect blocks, indexed by a hash of inode
+         * and the first file block each maps; see s5_seek_to_block */
+        s5_bmap_entry_t         s5f_bmap[S5_BMAP_CACHE_SIZE];
 } s5fs_t;
 
 int s5fs_mount(struct fs *fs);
@@ -10,6 +10,7 @@
 
 struct fs;
 struct vnode;
+struct s5_dirent;
 
 int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid);
 void s5_free_inode(struct vnode *vnode);
@@ -27,7 +28,11 @@ int s5_link(struct vnode *parent, struct vnode *child,
             const char *name, size_t namelen);
 int s5_find_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_remove_dirent(struct vnode *vnode, const char *name, size_t namelen);
+int s5_read_dirent(struct vnode *vnode, off_t offset, struct s5_dirent *d);
+int s5_dir_entries(struct vnode *vnode);
 int s5_seek_to_block(struct vnode *vnode, off_t seekptr, int alloc);
+int s5_block_run(struct vnode *vnode, off_t seekptr, uint32_t max,
+                 uint32_t *nblocks);
 int s5_inode_blocks(struct vnode *vnode);
 
 #define VNODE_TO_S5FS(vn)       ( (s5fs_t *)((vn)->vn_fs->fs_i))
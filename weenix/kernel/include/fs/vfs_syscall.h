@@ -7,12 +7,18 @@
 #include "fs/open.h"
 #include "fs/stat.h"
 
+struct iovec;
+
 /* return 0 or error */
 int do_close(int fd);
 /* return bytes or error */
 int do_read(int fd, void *buf, size_t nbytes);
 /* return bytes or error */
 int do_write(int fd, const void *buf, size_t nbytes);
+/* return bytes or error; off is -1 to use and advance f_pos */
+int do_readv(int fd, const struct iovec *iov, int iovcnt, off_t off);
+/* return bytes or error; off is -1 to use and advance f_pos */
+int do_writev(int fd, const struct iovec *iov, int iovcnt, off_t off);
 /* return new fd or error */
 int do_dup(int fd);
 /* return new fd or error */
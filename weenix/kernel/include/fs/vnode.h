@@ -13,6 +13,7 @@
 #include "drivers/bytedev.h"
 #include "util/list.h"
 #include "proc/kmutex.h"
+#include "proc/krwlock.h"
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
@@ -125,6 +126,15 @@ typedef struct vnode_ops {
          * 'pagebuf'.
          */
         int (*fillpage)(struct vnode *vnode, off_t offset, void *pagebuf);
+        /*
+         * Optional; may be NULL. Like fillpage, but reads 'npages'
+         * consecutive pages, starting with the one containing
+         * 'offset', into the buffers in 'pagebufs', so that the
+         * underlying fs can read blocks which are next to each other
+         * on disk with a single request.
+         */
+        int (*fillpages)(struct vnode *vnode, off_t offset, void **pagebufs,
+                         int npages);
         /*
          * A hook; an attempt is being made to dirty the page
          * belonging to 'vnode' that contains 'offset'. (If the
@@ -142,6 +152,16 @@ typedef struct vnode_ops {
          * containing 'offset'.
          */
         int (*cleanpage)(struct vnode *vnode, off_t offset, void *pagebuf);
+        /*
+         * Optional; may be NULL. Like cleanpage, but writes 'npages'
+         * consecutive pages, starting with the one containing
+         * 'offset', from the buffers in 'pagebufs', so that the
+         * underlying fs can write blocks which are next to each other
+         * on disk with a single request. Every page has been through
+         * dirtypage, so none of them is sparse.
+         */
+        int (*cleanpages)(struct vnode *vnode, off_t offset, void **pagebufs,
+                          int npages);
 } vnode_ops_t;
 
 
@@ -215,10 +235,11 @@ typedef struct vnode {
         off_t              vn_len;
 
         /*
-         * A mutex used to synchronize reads and writes. This is only used by
-         * the underlying filesystem implementation.
+         * Synchronizes access to the data of regular files: held shared
+         * by reads and exclusive by writes and truncations, around the
+         * calls to the read and write vnode operations.
          */
-        kmutex_t           vn_mutex;
+        krwlock_t          vn_rwlock;
 
         /*
          * A generic pointer which the file system can use to store any extra
@@ -249,6 +270,9 @@ typedef struct vnode {
 
         /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
         list_link_t        vn_link;        /* link on system vnode list */
+        list_link_t        vn_hash_link;   /* link on its (fs, vno) hash chain */
+        list_link_t        vn_lru_link;    /* link on the unreferenced vnode
+                                              cache, while refcount is 0 */
         int                vn_flags;       /* VN_BUSY */
         ktqueue_t          vn_waitq;       /* queue of threads waiting for vnode
                                               to become not busy */
@@ -284,6 +308,12 @@ typedef struct vnode {
  *               that we define as follows:
  *                 - (1) actively-referenced: (vn_refcount > vn_nrespages > 0)
  *                 - (2) passively-referenced: (vn_refcount == vn_nrespages > 0)
+ *             - A third state, (3) cached: (vn_refcount == vn_nrespages == 0),
+ *               is that of a vnode still linked in its fs which nothing
+ *               references any more. It is kept in core until it is one
+ *               of more than VNODE_CACHE_MAX such vnodes and the least
+ *               recently used, so that a vget() soon after does not have
+ *               to read it in again.
  *
  */
 
@@ -309,9 +339,11 @@ void vref(vnode_t *vn);
 /*
  *     This function decrements the reference count on this vnode.
  *
- *     If, as a result of this, vn_refcount reaches zero, the underlying
- *     fs's 'delete_vnode' entry point will be called and the vnode will be
- *     freed.
+ *     If, as a result of this, vn_refcount reaches zero, the vnode is
+ *     kept in core as cached if query_vnode says it is still linked in the
+ *     filesystem. Otherwise, or when it is evicted from the cache, the
+ *     underlying fs's 'delete_vnode' entry point will be called and the
+ *     vnode will be freed.
  *
  *     If, as a result of this, vn_refcount reaches vn_respages and
  *     vn_nrespages is > 0 (meaning only passive references exist) and
@@ -344,7 +376,8 @@ int vfs_is_in_use(struct fs *fs);
 
 /*
  *         Clean and uncache all resident pages of all vnodes belonging to
- *         the specified fs.
+ *         the specified fs, then free the unreferenced vnodes of the fs
+ *         kept in core (see vput()).
  */
 void vnode_flush_all(struct fs *fs);
 
@@ -354,6 +387,12 @@ void vnode_flush_all(struct fs *fs);
  */
 int vnode_inuse(struct fs *fs);
 
+/*
+ *         Frees the unreferenced vnodes of the specified fs kept in core
+ *         (see vput()). Must be called before the fs is unmounted.
+ */
+void vnode_uncache(struct fs *fs);
+
 
 /* Diagnostic: */
 /*
@@ -89,3 +89,12 @@ static inline void cpuid(int request, uint32_t *a, uint32_t *d)
 {
         __asm__ volatile("cpuid":"=a"(*a), "=d"(*d):"0"(request));
 }
+
+/* Reads the time-stamp counter (see CPUID_FEAT_EDX_TSC). Used for
+ * rough cycle counts in the kernel's microbenchmarks. */
+static inline uint64_t rdtsc(void)
+{
+        uint64_t ret;
+        __asm__ volatile("rdtsc":"=A"(ret));
+        return ret;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "util/list.h"
+#include "util/radix.h"
 
 struct pframe;
 typedef struct mmobj_ops mmobj_ops_t;
@@ -15,6 +16,7 @@ typedef struct mmobj {
          */
         int                 mmo_nrespages;
         list_t              mmo_respages;
+        radix_tree_t        mmo_pagetree;   /* resident pages keyed by pagenum */
         /*
          * For shadow objects, the mmo_bottom_obj member of the union should point
          * to the bottommost object in the shadow chain. For non-shadow objects, the
@@ -67,6 +69,17 @@ struct mmobj_ops {
          */
         int (*fillpage)(mmobj_t *o, struct pframe *pf);
 
+        /*
+         * Optional; may be NULL. Like fillpage, but fills npages page
+         * frames at once. The pages in pf have consecutive page numbers
+         * in increasing order, so an object backed by a device can read
+         * them with a single request.
+         * This may block.
+         * Return 0 on success and -errno otherwise, in which case none of
+         * the pages are considered filled.
+         */
+        int (*fillpages)(mmobj_t *o, struct pframe **pf, int npages);
+
         /* A hook; called when a request is made to dirty a non-dirty page.
          * Perform any necessary actions that must take place in order for it
          * to be possible to dirty (write to) the provided page. (For example,
@@ -86,6 +99,17 @@ struct mmobj_ops {
          * Return 0 on success and -errno otherwise.
          */
         int (*cleanpage)(mmobj_t *o, struct pframe *pf);
+
+        /*
+         * Optional; may be NULL. Like cleanpage, but writes back npages
+         * page frames at once. The pages in pf have consecutive page
+         * numbers in increasing order, so an object backed by a device
+         * can write them with a single request.
+         * This may block.
+         * Return 0 on success and -errno otherwise, in which case none of
+         * the pages are considered clean.
+         */
+        int (*cleanpages)(mmobj_t *o, struct pframe **pf, int npages);
 };
 
 
@@ -99,6 +123,7 @@ static inline void mmobj_init(mmobj_t *o, mmobj_ops_t *ops)
         (o)->mmo_refcount = 0;
         (o)->mmo_nrespages = 0;
         list_init(&(o)->mmo_respages);
+        radix_tree_init(&(o)->mmo_pagetree);
         list_init(&(o)->mmo_un.mmo_vmas);
         (o)->mmo_shadowed = NULL;
 }
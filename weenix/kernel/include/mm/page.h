@@ -39,6 +39,17 @@ void page_add_range(uintptr_t start, uintptr_t end);
 void *page_alloc(void);
 void  page_free(void *addr);
 
+/* Allocates one page filled with zeroes, to be freed with
+ * page_free. Pages zeroed ahead of time by page_zero_idle are
+ * used when available so that the caller does not pay for the
+ * memset. page_zeroed_count returns how many such pages there
+ * are. page_zero_idle zeroes one more page (returning 1) if
+ * the pool is not full and memory is not low, and should be
+ * called only when the system is otherwise idle. */
+void    *page_alloc_zeroed(void);
+uint32_t page_zeroed_count(void);
+int      page_zero_idle(void);
+
 /* These functions allocate and free a page-aligned
  * block of memory which are npages pages in length.
  * A call to page_alloc_n will allocate a block, to free
@@ -48,7 +59,19 @@ void  page_free(void *addr);
 void *page_alloc_n(uint32_t npages);
 void  page_free_n(void *start, uint32_t npages);
 
+/* Every allocated page may be tagged with an opaque owner
+ * pointer. page_set_owner tags (or, given NULL, untags) the
+ * npages pages starting at addr, and page_owner returns the
+ * tag of the page containing addr. Pages start out untagged;
+ * whoever tags a block must untag it before freeing it. */
+void  page_set_owner(void *addr, uint32_t npages, void *owner);
+void *page_owner(const void *addr);
+
 /* Returns the number of free pages remaining in the
  * system. Note that calls to page_alloc_n(npages) may
  * fail even if page_free_count() >= npages. */
 uint32_t page_free_count();
+
+/* Prints free block counts by order and the latency of
+ * page allocations and frees into buf. */
+size_t page_info(const void *arg, char *buf, size_t osize);
@@ -54,6 +54,14 @@ int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, ui
  * be page aligned. Note that the TLB is not flushed by this function. */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
+/* Returns whether the hardware has set the accessed bit of the page table
+ * entry for the given virtual page in the given page directory since it
+ * was last cleared, and clears it. Returns 0 if there is no mapping. As
+ * with pt_unmap, vaddr must be page aligned in the user address space, and
+ * the TLB is not flushed by this function; until it is, accesses through a
+ * cached translation will not set the bit again. */
+int pt_test_and_clear_accessed(pagedir_t *pd, uintptr_t vaddr);
+
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
  * the addresses must be page aligned in the user address space */
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
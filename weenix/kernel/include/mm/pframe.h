@@ -11,6 +11,7 @@ struct mmobj;
 
 #define PF_BUSY                 0x01
 #define PF_DIRTY                0x02
+#define PF_REFERENCED           0x04
 
 #define pframe_is_busy(pf)          ((pf)->pf_flags & PF_BUSY)
 #define pframe_set_busy(pf)         do { (pf)->pf_flags |= PF_BUSY; } while (0)
@@ -20,6 +21,19 @@ struct mmobj;
 #define pframe_set_dirty(pf)        do { (pf)->pf_flags |= PF_DIRTY; } while (0)
 #define pframe_clear_dirty(pf)      do { (pf)->pf_flags &= ~PF_DIRTY; } while (0)
 
+#define pframe_is_referenced(pf)    ((pf)->pf_flags & PF_REFERENCED)
+#define pframe_set_referenced(pf)   do { (pf)->pf_flags |= PF_REFERENCED; } while (0)
+#define pframe_clear_referenced(pf) do { (pf)->pf_flags &= ~PF_REFERENCED; } while (0)
+
+/* Most pages written back in one go by pframe_clean_range, or read in
+ * by pframe_prefetch; a run of pages with consecutive page numbers is
+ * handed to the object's cleanpages or fillpages operation, if it has
+ * one, as a single request. */
+#define PFRAME_CLUSTER_MAX          16
+
+/* Largest page number, for passing whole objects to the range functions */
+#define PFRAME_MAX_PAGENUM          0xffffffffU
+
 #define pframe_is_pinned(pf)        ((pf)->pf_pincount)
 #define pframe_is_free(pf)          (!(pf)->pf_obj)
 
@@ -38,7 +52,7 @@ typedef struct pframe {
         void               *pf_addr;
 
         /* Private: */
-        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY */
+        uint8_t             pf_flags;    /* PF_DIRTY, PF_BUSY, PF_REFERENCED */
         ktqueue_t           pf_waitq;    /* wait on this if page is busy */
         int                 pf_pincount;
         list_link_t         pf_link;     /* link on {free,allocated,pinned}_list */
@@ -55,16 +69,26 @@ void pframe_shutdown(void);
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+int pframe_prefetch(struct mmobj *o, uint32_t pagenum, int npages);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result);
-void pframe_migrate(pframe_t *pf, mmobj_t *dest);
+int pframe_migrate(pframe_t *pf, mmobj_t *dest);
 
 void pframe_pin(pframe_t *pf);
 void pframe_unpin(pframe_t *pf);
 
 int  pframe_dirty(pframe_t *pf);
 int  pframe_clean(pframe_t *pf);
+int  pframe_clean_cluster(pframe_t **pfs, int npages);
 void pframe_free(pframe_t *pf);
 
 void pframe_clean_all(void);
+int  pframe_clean_range(struct mmobj *o, uint32_t lopage, uint32_t hipage);
+void pframe_free_range(struct mmobj *o, uint32_t lopage, uint32_t hipage);
+void pframe_balance_dirty(struct mmobj *o);
 
 void pframe_remove_from_pts(pframe_t *pf);
+
+void pframe_fill_zeroes(pframe_t *pf);
+
+uint32_t pframe_hash_bench(int nframes, int niters, uint32_t *nvisited);
+size_t pframe_hash_info(const void *arg, char *buf, size_t osize);
@@ -19,8 +19,24 @@
  */
 typedef struct slab_allocator slab_allocator_t;
 
+/* Cache line size assumed by the allocator. Slabs are colored in
+ * steps of (at least) this size, see slab_allocator_create_aligned. */
+#define SLAB_CACHE_LINE_SIZE    64
+
 slab_allocator_t *slab_allocator_create(const char *name, size_t size);
+
+/* Like slab_allocator_create, but every object returned by the allocator
+ * starts on an align byte boundary. align must be a power of two; pass
+ * SLAB_CACHE_LINE_SIZE to keep hot structures from straddling lines. */
+slab_allocator_t *slab_allocator_create_aligned(const char *name, size_t size,
+                                                size_t align);
 int slab_allocators_reclaim(int target);
 
 void *slab_obj_alloc(slab_allocator_t *allocator);
 void slab_obj_free(slab_allocator_t *allocator, void *obj);
+
+/*
+ * Prints per-allocator statistics for the magazine layer in front of
+ * the slabs (magazine size, depot occupancy, hit rates) into buf.
+ */
+size_t slab_allocators_info(const void *arg, char *buf, size_t osize);
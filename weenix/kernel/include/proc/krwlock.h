@@ -0,0 +1,59 @@
+#pragma once
+
+#include "proc/sched.h"
+
+/*
+ * A readers-writer lock: any number of readers or a single writer may
+ * hold it. Once a writer is waiting, new readers wait behind it, and when
+ * a writer lets go every reader waiting by then gets in before the next
+ * writer, so that neither side starves the other.
+ */
+typedef struct krwlock {
+        ktqueue_t       krw_rdq;        /* readers waiting */
+        ktqueue_t       krw_wrq;        /* writers waiting */
+        int             krw_readers;    /* readers holding the lock */
+        struct kthread *krw_writer;     /* writer holding the lock */
+} krwlock_t;
+
+/**
+ * Initializes the fields of the specified krwlock_t.
+ *
+ * @param rw the lock to initialize
+ */
+void krwlock_init(krwlock_t *rw);
+
+/**
+ * Locks the specified lock for reading, shared with other readers.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant
+ *
+ * @param rw the lock to lock
+ */
+void krwlock_read_lock(krwlock_t *rw);
+
+/**
+ * Locks the specified lock for writing, excluding everyone else.
+ *
+ * Note: This function may block.
+ *
+ * Note: These locks are not re-entrant
+ *
+ * @param rw the lock to lock
+ */
+void krwlock_write_lock(krwlock_t *rw);
+
+/**
+ * Unlocks the specified lock, held for reading.
+ *
+ * @param rw the lock to unlock
+ */
+void krwlock_read_unlock(krwlock_t *rw);
+
+/**
+ * Unlocks the specified lock, held for writing.
+ *
+ * @param rw the lock to unlock
+ */
+void krwlock_write_unlock(krwlock_t *rw);
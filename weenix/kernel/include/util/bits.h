@@ -19,3 +19,23 @@ bit_check(const void *addr, uintptr_t bit)
         return (*map & (1 << (bit & 0x1f)));
 }
 
+
+/* Returns the index of the least significant set bit in word, which
+ * must not be zero. */
+static inline int
+bit_ffs(uint32_t word)
+{
+        uint32_t ret;
+        __asm__("bsfl %1,%0" : "=r"(ret) : "rm"(word));
+        return (int)ret;
+}
+
+/* Returns the index of the most significant set bit in word, which
+ * must not be zero. */
+static inline int
+bit_fls(uint32_t word)
+{
+        uint32_t ret;
+        __asm__("bsrl %1,%0" : "=r"(ret) : "rm"(word));
+        return (int)ret;
+}
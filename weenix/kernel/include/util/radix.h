@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * A radix tree mapping 32-bit keys to non-NULL pointers. Each level of
+ * the tree resolves RADIX_SHIFT bits of the key, and the tree is only
+ * as tall as the largest key requires, so lookups cost a few pointer
+ * dereferences and walking a range of keys only visits the nodes which
+ * cover that range. Nodes are allocated from a slab allocator; nothing
+ * here blocks.
+ */
+
+#define RADIX_SHIFT     6
+#define RADIX_SLOTS     (1 << RADIX_SHIFT)
+
+struct radix_node;
+
+typedef struct radix_tree {
+        struct radix_node  *rt_root;
+        int                 rt_height;    /* 0 if the tree is empty */
+} radix_tree_t;
+
+#define radix_tree_empty(rt)    (NULL == (rt)->rt_root)
+
+void radix_tree_init(radix_tree_t *rt);
+
+/* Maps key to item, which must not be NULL. There must not already be
+ * an item for key. Returns 0 on success or -ENOMEM. */
+int radix_tree_insert(radix_tree_t *rt, uint32_t key, void *item);
+
+/* Returns the item for key, or NULL if there is none. */
+void *radix_tree_lookup(radix_tree_t *rt, uint32_t key);
+
+/* Removes and returns the item for key, or NULL if there is none. */
+void *radix_tree_remove(radix_tree_t *rt, uint32_t key);
+
+/* Stores up to max items whose keys are >= first in items, in order of
+ * increasing key, and returns how many were stored. To continue a walk,
+ * call again with first set to one past the key of the last item. */
+int radix_tree_gang_lookup(radix_tree_t *rt, uint32_t first, void **items, int max);
@@ -49,6 +49,7 @@
 #include "fs/vfs_syscall.h"
 #include "fs/fcntl.h"
 #include "fs/stat.h"
+#include "fs/readahead.h"
 
 #include "test/kshell/kshell.h"
 
@@ -230,6 +231,7 @@ idleproc_run(int arg1, void *arg2)
         /* Here you need to make the null, zero, and tty devices using mknod */
         /* You can't do this until you have VFS, check the include/drivers/dev.h
          * file for macros with the device ID's you will need to pass to mknod */
+        do_mknod("/dev/iostat", S_IFCHR, MEM_IOSTAT_DEVID);
 #endif
 
         /* Finally, enable interrupts (we want to make sure interrupts
@@ -248,6 +250,9 @@ idleproc_run(int arg1, void *arg2)
 
 
 #ifdef __VFS__
+        /* Stop reading ahead before the files go away */
+        readahead_shutdown();
+
         /* Shutdown the vfs: */
         dbg_print("weenix: vfs shutdown...\n");
         vput(curproc->p_cwd);
@@ -10,9 +10,12 @@
 #include "util/list.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/printf.h"
 
 #include "vm/shadowd.h"
 
+#include "main/cpuid.h"
+
 #include "proc/sched.h"
 
 GDB_DEFINE_HOOK(page_alloc, void *addr, int npages)
@@ -24,11 +27,51 @@ static uintptr_t page_freecount;
 struct pagegroup {
         list_t       pg_freelist[PAGE_NSIZES];
         void        *pg_map[PAGE_NSIZES];
+        void       **pg_owner;
         uintptr_t    pg_baseaddr;
         uintptr_t    pg_endaddr;
+        int          pg_index;     /* index in pagegroups */
         list_link_t  pg_link;
 };
 
+/*
+ * Summary of which free lists are non-empty, so that finding a free
+ * block of a given order (or the smallest larger one) is a bit scan
+ * rather than a walk over every group. Bit order of page_order_summary
+ * is set iff some group has a free block of that order, and bit i of
+ * page_order_groups[order] is set iff pagegroups[i] has one.
+ */
+#define PAGEGROUP_MAX   32
+
+static struct pagegroup *pagegroups[PAGEGROUP_MAX];
+static int npagegroups;
+static uint32_t page_order_summary;
+static uint32_t page_order_groups[PAGE_NSIZES];
+
+/* Latency counters reported by page_info(), in cycles. */
+struct page_latency {
+        uint32_t     pl_count;
+        uint64_t     pl_cycles;
+        uint32_t     pl_max;
+};
+
+static struct page_latency page_alloc_latency;
+static struct page_latency page_free_latency;
+
+/*
+ * Pages zeroed ahead of time by the idle loop (see page_zero_idle), so
+ * that page_alloc_zeroed does not have to zero them on the fault path.
+ * These pages are allocated as far as the buddy allocator is concerned,
+ * but they are handed back to it before we would run out of memory.
+ */
+#define PAGE_ZEROED_TARGET      64  /* number of pages to keep zeroed */
+#define PAGE_ZEROED_RESERVE    256  /* never zero into the last free pages */
+
+static list_t page_zeroed_list;
+static uint32_t page_nzeroed;
+static uint32_t page_zeroed_hits;
+static uint32_t page_zeroed_misses;
+
 struct freepage {
         list_link_t fp_link;
 };
@@ -62,6 +105,12 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
                 memset(group->pg_map[order], 0, count);
         }
 
+        /* one owner pointer per page, see page_set_owner() */
+        end -= npages * sizeof(void *);
+        end &= ~(uintptr_t)(sizeof(void *) - 1);
+        group->pg_owner = (void **)end;
+        memset(group->pg_owner, 0, npages * sizeof(void *));
+
         /* discard the remainder of the page being used for
          * mappings and read just npages */
         end = (uintptr_t)PAGE_ALIGN_DOWN(end);
@@ -90,6 +139,34 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
         return group;
 }
 
+/**
+ * Brings the free block summary up to date after the given group's
+ * free list of the given order has been modified.
+ */
+static inline void
+_pagegroup_summarize(struct pagegroup *group, int order)
+{
+        if (list_empty(&group->pg_freelist[order])) {
+                page_order_groups[order] &= ~(1 << group->pg_index);
+                if (0 == page_order_groups[order])
+                        page_order_summary &= ~(1 << order);
+        } else {
+                page_order_groups[order] |= 1 << group->pg_index;
+                page_order_summary |= 1 << order;
+        }
+}
+
+static inline void
+_page_latency_add(struct page_latency *pl, uint64_t start)
+{
+        uint32_t cycles = (uint32_t)(rdtsc() - start);
+
+        pl->pl_count++;
+        pl->pl_cycles += cycles;
+        if (cycles > pl->pl_max)
+                pl->pl_max = cycles;
+}
+
 static struct pagegroup *
 _pagegroup_from_address(uintptr_t addr)
 {
@@ -106,6 +183,11 @@ page_init()
 {
         list_init(&pagegroup_list);
         page_freecount = 0;
+        npagegroups = 0;
+        page_order_summary = 0;
+        memset(page_order_groups, 0, sizeof(page_order_groups));
+        list_init(&page_zeroed_list);
+        page_nzeroed = 0;
 }
 
 void
@@ -117,8 +199,21 @@ page_add_range(uintptr_t start, uintptr_t end)
         start = (uintptr_t) PAGE_ALIGN_DOWN(start);
         end = (uintptr_t) PAGE_ALIGN_DOWN(end);
 
+        if (PAGEGROUP_MAX == npagegroups) {
+                dbg(DBG_MM, "WARNING: too many page groups, discarding 0x%08x to 0x%08x\n",
+                    start, end);
+                return;
+        }
+
         struct pagegroup *group = _pagegroup_create(start, end);
         if (group->pg_baseaddr < group->pg_endaddr) {
+                int order;
+
+                group->pg_index = npagegroups++;
+                pagegroups[group->pg_index] = group;
+                for (order = 0; order < PAGE_NSIZES; ++order)
+                        _pagegroup_summarize(group, order);
+
                 list_insert_tail(&pagegroup_list, &group->pg_link);
                 page_freecount += ADDR_TO_PN(group->pg_endaddr - group->pg_baseaddr);
         }
@@ -171,9 +266,32 @@ __page_split(struct pagegroup *group, uint32_t order)
         uintptr_t buddy = (target + ((1 << (order - 1)) << PAGE_SHIFT));
         list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)target)->fp_link);
         list_insert_head(&group->pg_freelist[order - 1], &((struct freepage *)buddy)->fp_link);
+        _pagegroup_summarize(group, order);
+        _pagegroup_summarize(group, order - 1);
         dbg(DBG_PAGEALLOC, "split 0x%.8x (%u) into 0x%.8x and 0x%.8x\n", target, order, target, buddy);
 }
 
+static void _page_free_order(void *addr, int order);
+
+/**
+ * Returns every pre-zeroed page to the buddy allocator.
+ * @return the number of pages released
+ */
+static int
+_page_zeroed_release(void)
+{
+        int npages = 0;
+
+        while (!list_empty(&page_zeroed_list)) {
+                struct freepage *fp = list_head(&page_zeroed_list, struct freepage, fp_link);
+                list_remove(&fp->fp_link);
+                page_nzeroed--;
+                _page_free_order(fp, 0);
+                npages++;
+        }
+        return npages;
+}
+
 /**
  * Finds a block of pages strictly bigger than a block of the given order and
  * splits it into blocks of the given order. Used, for example, when the user
@@ -192,24 +310,33 @@ _page_split(int order)
         uint32_t num_retrys = 0;
 #endif
         int norder;
+        uint32_t larger;
 
         do {
                 /* Find the first free block of greater size than requested. */
-                for (norder = order + 1; norder < PAGE_NSIZES; norder++) {
+                larger = page_order_summary & ~((2 << order) - 1);
+                if (0 != larger) {
                         struct pagegroup *group;
-                        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                                if (!list_empty(&group->pg_freelist[norder])) {
-                                        while (norder > order) {
-                                                __page_split(group, norder);
-                                                --norder;
-                                        }
-                                        KASSERT(!list_empty(&group->pg_freelist[order]));
-                                        return group;
-                                }
-                        } list_iterate_end();
+
+                        norder = bit_ffs(larger);
+                        group = pagegroups[bit_ffs(page_order_groups[norder])];
+                        while (norder > order) {
+                                __page_split(group, norder);
+                                --norder;
+                        }
+                        KASSERT(!list_empty(&group->pg_freelist[order]));
+                        return group;
                 }
 
                 dbg(DBG_PAGEALLOC, "WARNING, cannot allocate order=%u\n", order);
+
+                /* Pre-zeroed pages are only an optimization, give them
+                 * back before resorting to anything more drastic. This
+                 * does not count as one of our retries. */
+                if (0 < _page_zeroed_release()) {
+                        num_retrys++;
+                        continue;
+                }
                 /* We have run out of kernel memory. Lets try and collapse some
                    shadow trees, and then retry */
 #ifdef __SHADOWD__
@@ -237,21 +364,25 @@ _page_alloc_order(uint32_t order)
 {
         uintptr_t addr;
         struct pagegroup *group;
+        uint64_t start = rdtsc();
 
-        list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                if (!list_empty(&group->pg_freelist[order]))
-                        goto found;
-        } list_iterate_end();
+        if (page_order_summary & (1 << order)) {
+                group = pagegroups[bit_ffs(page_order_groups[order])];
+                KASSERT(!list_empty(&group->pg_freelist[order]));
+                goto found;
+        }
 
         if (NULL != (group = _page_split(order))) {
                 KASSERT(!list_empty(&group->pg_freelist[order]));
                 goto found;
         }
+        _page_latency_add(&page_alloc_latency, start);
         return NULL;
 
 found:
         addr = (uintptr_t)list_head(&group->pg_freelist[order], struct freepage, fp_link);
         list_remove_head(&group->pg_freelist[order]);
+        _pagegroup_summarize(group, order);
         if (PAGE_NSIZES - 1 > order)
                 bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, addr));
 
@@ -266,6 +397,7 @@ found:
 #endif /* MM_POISON */
 
         page_freecount -= (1 << order);
+        _page_latency_add(&page_alloc_latency, start);
         return (void *) addr;
 }
 
@@ -287,6 +419,8 @@ __page_join(struct pagegroup *group, int order, uintptr_t addr)
                 addr = MIN(addr, buddy);
                 ++order;
                 list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+                _pagegroup_summarize(group, order - 1);
+                _pagegroup_summarize(group, order);
 
                 if (PAGE_NSIZES - 1 > order)
                         bit_flip(group->pg_map[order + 1], _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr));
@@ -303,6 +437,8 @@ __page_join(struct pagegroup *group, int order, uintptr_t addr)
 static void
 _page_free_order(void *addr, int order)
 {
+        uint64_t start = rdtsc();
+
 #ifdef MM_POISON
         /*
          * Wipe the pages with a special bit-pattern, so that invalid
@@ -316,6 +452,7 @@ _page_free_order(void *addr, int order)
                 return;
 
         list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+        _pagegroup_summarize(group, order);
         page_freecount += (1 << order);
 
         if (PAGE_NSIZES - 1 > order) {
@@ -326,6 +463,7 @@ _page_free_order(void *addr, int order)
 
         dbg(DBG_MM, "page_free: freed %d pages (addr 0x%p); %u pages currently free\n",
             (1 << order), addr, page_freecount);
+        _page_latency_add(&page_free_latency, start);
 }
 
 /*
@@ -392,10 +530,172 @@ page_free_n(void *start, uint32_t npages)
 }
 
 /*
- * @return the number of free pages in the kmem system
+ * Records owner as the owner of the npages pages starting at addr, or
+ * clears the record if owner is NULL. The slab allocator uses this to
+ * find the allocator an object came from given only its address.
+ * @param addr the page-aligned start of the block
+ * @param npages the number of pages in the block
+ * @param owner the new owner of the pages
+ */
+void
+page_set_owner(void *addr, uint32_t npages, void *owner)
+{
+        struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+        uintptr_t index;
+
+        KASSERT(PAGE_ALIGNED(addr));
+        KASSERT(NULL != group);
+        KASSERT((uintptr_t)addr + (npages << PAGE_SHIFT) <= group->pg_endaddr);
+
+        index = ((uintptr_t)addr - group->pg_baseaddr) >> PAGE_SHIFT;
+        while (npages-- > 0)
+                group->pg_owner[index++] = owner;
+}
+
+/*
+ * @param addr any address within an allocated page
+ * @return the owner last given to page_set_owner() for the page
+ * containing addr, or NULL if there is none
+ */
+void *
+page_owner(const void *addr)
+{
+        struct pagegroup *group = _pagegroup_from_address((uintptr_t)addr);
+
+        if (NULL == group)
+                return NULL;
+        return group->pg_owner[((uintptr_t)addr - group->pg_baseaddr) >> PAGE_SHIFT];
+}
+
+/*
+ * Allocate one page of memory filled with zeroes. If the idle loop has
+ * zeroed pages ahead of time one of those is used, otherwise the page
+ * is zeroed here.
+ * @return the address of the page
+ */
+void *
+page_alloc_zeroed(void)
+{
+        void *addr;
+
+        if (!list_empty(&page_zeroed_list)) {
+                struct freepage *fp = list_head(&page_zeroed_list, struct freepage, fp_link);
+                list_remove(&fp->fp_link);
+                page_nzeroed--;
+                page_zeroed_hits++;
+
+                /* the link was the only thing written since zeroing */
+                fp->fp_link.l_next = NULL;
+                fp->fp_link.l_prev = NULL;
+                addr = fp;
+        } else {
+                page_zeroed_misses++;
+                if (NULL == (addr = _page_alloc_order(0)))
+                        return NULL;
+                memset(addr, 0, PAGE_SIZE);
+        }
+
+        GDB_CALL_HOOK(page_alloc, addr, 1);
+        return addr;
+}
+
+/*
+ * @return the number of pre-zeroed pages page_alloc_zeroed can
+ * currently hand out without zeroing
+ */
+uint32_t
+page_zeroed_count()
+{
+        return page_nzeroed;
+}
+
+/*
+ * Zeroes one free page for later use by page_alloc_zeroed, unless
+ * enough pages are already zeroed or free memory is low. Meant to be
+ * called when there is nothing better to do. Must not be called from
+ * interrupt context.
+ * @return 1 if a page was zeroed, 0 if there was nothing to do
+ */
+int
+page_zero_idle(void)
+{
+        struct freepage *fp;
+
+        if (page_nzeroed >= PAGE_ZEROED_TARGET
+            || page_freecount <= PAGE_ZEROED_RESERVE)
+                return 0;
+
+        if (NULL == (fp = _page_alloc_order(0)))
+                return 0;
+        memset(fp, 0, PAGE_SIZE);
+
+        list_insert_tail(&page_zeroed_list, &fp->fp_link);
+        page_nzeroed++;
+        return 1;
+}
+
+/*
+ * @return the number of free pages in the kmem system, including
+ * those which have been zeroed ahead of time
  */
 uint32_t
 page_free_count()
 {
-        return page_freecount;
+        return page_freecount + page_nzeroed;
+}
+
+/*
+ * Average of a latency counter. The kernel has no 64-bit division, so
+ * both the total and the count are scaled down until the total fits.
+ */
+static uint32_t
+_page_latency_avg(const struct page_latency *pl)
+{
+        uint64_t cycles = pl->pl_cycles;
+        uint32_t count = pl->pl_count;
+
+        while (cycles >> 32) {
+                cycles >>= 1;
+                count >>= 1;
+        }
+        return count ? (uint32_t)cycles / count : 0;
+}
+
+/*
+ * Debugging information about the page allocator: the number of free
+ * blocks of each order and the latency of allocations and frees.
+ */
+size_t
+page_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        struct pagegroup *group;
+        int order;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "%u pages free in %d groups\n", page_freecount, npagegroups);
+        iprintf(&buf, &size, "%u pages pre-zeroed, %u zeroed allocations served "
+                "from them, %u zeroed on demand\n",
+                page_nzeroed, page_zeroed_hits, page_zeroed_misses);
+        iprintf(&buf, &size, "%5s %7s\n", "ORDER", "BLOCKS");
+        for (order = 0; order < PAGE_NSIZES; ++order) {
+                uint32_t nblocks = 0;
+                list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
+                        list_link_t *link;
+                        for (link = group->pg_freelist[order].l_next;
+                             link != &group->pg_freelist[order]; link = link->l_next)
+                                ++nblocks;
+                } list_iterate_end();
+                iprintf(&buf, &size, "%5d %7u\n", order, nblocks);
+        }
+
+        iprintf(&buf, &size, "%5s %10s %10s %10s\n", "OP", "COUNT", "AVG CYC", "MAX CYC");
+        iprintf(&buf, &size, "%5s %10u %10u %10u\n", "alloc", page_alloc_latency.pl_count,
+                _page_latency_avg(&page_alloc_latency), page_alloc_latency.pl_max);
+        iprintf(&buf, &size, "%5s %10u %10u %10u\n", "free", page_free_latency.pl_count,
+                _page_latency_avg(&page_free_latency), page_free_latency.pl_max);
+
+        return size;
 }
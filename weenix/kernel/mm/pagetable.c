@@ -152,6 +152,26 @@ pt_unmap(pagedir_t *pd, uintptr_t vaddr)
         }
 }
 
+int
+pt_test_and_clear_accessed(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+
+        if (PT_PRESENT & pd->pd_physical[index]) {
+                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+
+                index = vaddr_to_ptindex(vaddr);
+                if (PT_ACCESSED & pt[index]) {
+                        pt[index] &= ~PT_ACCESSED;
+                        return 1;
+                }
+        }
+        return 0;
+}
+
 void
 pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
 {
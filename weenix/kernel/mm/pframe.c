@@ -1,10 +1,13 @@
 #include "globals.h"
 #include "config.h"
 #include "errno.h"
+#include "limits.h"
 
 #include "proc/proc.h"
+#include "proc/kmutex.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 #include "mm/mmobj.h"
@@ -17,6 +20,8 @@
 
 #include "vm/vmmap.h"
 
+#include "main/cpuid.h"
+
 /*
  * In this file, physical pages (as represented by pframes) will be
  * referred to as "pages"
@@ -29,10 +34,10 @@
  *     - (3) pinned
  *
  * (1) Free pages do not contain identifiable data and are readily
- *     available for use. They are not pre-zeroed (at the moment, at least
- *     (but often times, OSs will have their equivalent of Weenix's
- *     idleproc (or another thread/process dedicated to this purpose) zero
- *     unzeroed pages on the free list when the system is otherwise idle)).
+ *     available for use. Most are not zeroed, but when the scheduler has
+ *     nothing to run it zeroes a limited number of them ahead of time
+ *     (see page_zero_idle()). Objects whose pages start out empty get
+ *     those through pframe_fill_zeroes().
  *
  * (2) Allocated pages contain identifiable data.
  *
@@ -55,12 +60,16 @@
  *     - pf_hlink links the page into the appropriate hash chain of the
  *       resident page hashtable
  *     - pf_olink links the page into the appropriate mmobj's list of
- *       resident pages
+ *       resident pages, and the page is also in that mmobj's page tree
+ *       (mmo_pagetree), which keeps the resident pages ordered by page
+ *       number so that a range of the object can be walked without
+ *       looking at pages outside of it
  *
  * When a page is free:
  *     - pf_link links the page into free_list
  *     - pf_hlink does not link the page into any list
- *     - pf_olink does not link the page into any list
+ *     - pf_olink does not link the page into any list, and the page is
+ *       in no page tree
  */
 
 /* Page management structures:
@@ -75,26 +84,88 @@ static int npinned;
 static list_t pinned_list;
 
 /*     The ALLOCATED list: */
-/*       Pages on this list contain useful/actual/real data. This list is
- *       maintained in least-recently-requested (via pframe_get or
- *       pframe_get_resident) (and thus, *roughly/approximately* LRU) order.
+/*       Pages on this list contain useful/actual/real data. The list is
+ *       the face of a two-handed clock (see pageoutd_run): its head is the
+ *       back hand, and pageoutd_front_hand runs ahead of it clearing
+ *       reference bits. Finding a page does not reorder the list, it only
+ *       sets PF_REFERENCED; accesses through user mappings are picked up
+ *       from the PT_ACCESSED bits of the page tables which map the page.
  */
 static int nallocated;
 static list_t alloc_list;
 
+/* Number of pages the front hand runs ahead of the back hand. The
+ * larger it is, the longer a page has to be referenced again before
+ * pageoutd reaches it. */
+#define PAGEOUTD_HAND_SPREAD     64
+static list_link_t *pageoutd_front_hand = NULL;
+
 static slab_allocator_t *pframe_allocator;
 
 /* Used to quickly look up pframes. ALL pages "owned by" some
  * mmobj should be in this hash
- * (object, pagenum) --> list of pframes */
-#define hash_page(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
-                                  % PF_HASH_SIZE)
-static list_t pframe_hash[PF_HASH_SIZE];
+ * (object, pagenum) --> list of pframes
+ *
+ * The hash is multiplicative (Fibonacci hashing): the object is mixed
+ * by multiplying with 2^32 divided by the golden ratio, the page number
+ * is folded in and mixed again, and the top bits select the bucket. So
+ * consecutive pages of neighbouring objects land in unrelated buckets.
+ *
+ * The table has 2^order buckets and doubles whenever there are more
+ * than PF_HASH_LOAD resident pages per bucket. Rather than rehashing
+ * everything at once, the previous table is kept and a few of its
+ * buckets are moved to the new one on every insertion; until it is
+ * empty, lookups search both. */
+#define PF_HASH_GOLDEN           0x9e3779b9U
+#define hash_page(obj, pagenum, order)                                  \
+        ((((((uint32_t)(obj)) * PF_HASH_GOLDEN) ^ ((uint32_t)(pagenum))) \
+          * PF_HASH_GOLDEN) >> (32 - (order)))
+
+/* Buckets of the old table moved per insertion while growing */
+#define PF_HASH_MIGRATE_STEP     4
+
+typedef struct pframe_hashtab {
+        list_t              *pht_buckets;
+        int                  pht_order;
+} pframe_hashtab_t;
+
+static pframe_hashtab_t pframe_hash;       /* where new pages go */
+static pframe_hashtab_t pframe_hash_old;   /* being emptied, if pht_buckets */
+static uint32_t pframe_hash_migrated;      /* buckets already moved from old */
+static int pframe_hash_want_grow = 0;      /* too loaded, see pframe_hash_grow */
+static int pframe_hash_growing = 0;        /* allocating the new table */
+
+/* pframe_clean_all gathers the objects with dirty pages in an open
+ * addressing set of this many slots, and cleans each object in page order.
+ * It is filled to at most half, and any objects which do not fit are left
+ * for another pass. Concurrent callers take turns using it. */
+#define PFRAME_CLEAN_OBJS_ORDER  9
+#define PFRAME_CLEAN_OBJS        (1 << PFRAME_CLEAN_OBJS_ORDER)
+static mmobj_t *pframe_clean_objs[PFRAME_CLEAN_OBJS];
+static kmutex_t pframe_clean_mutex;
 
 /* Related to the Pageout daemon: */
 
+/* Free page watermarks. Allocating a page wakes pageoutd once no more
+ * than nfreepages_low pages are free, and pageoutd then reclaims pages
+ * until nfreepages_high are free. Only pageoutd may allocate pages once
+ * we are down to nfreepages_min; everybody else waits on alloc_waitq, so
+ * that pageoutd always has pages to clean others with. */
 static uint32_t nfreepages_min = 0;
-static uint32_t nfreepages_target = 0;
+static uint32_t nfreepages_low = 0;
+static uint32_t nfreepages_high = 0;
+
+/* Number of dirty pages that are not pinned, i.e. could be written back.
+ * Above ndirty_background pageoutd writes pages back even if there are
+ * enough free pages, and writers help out in proportion to how far over
+ * it we are (see pframe_balance_dirty); above ndirty_limit they also
+ * wait for pageoutd. */
+static int ndirty = 0;
+static int ndirty_background = 0;
+static int ndirty_limit = 0;
+
+/* Most objects pageoutd gathers to write back at a time */
+#define PAGEOUTD_WRITEBACK_OBJS  16
 
 /*   pageoutd sleeps on this queue */
 static proc_t *pageoutd = NULL;
@@ -107,41 +178,218 @@ static ktqueue_t alloc_waitq;
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
+static int pframe_writeback_range(mmobj_t *o, uint32_t lopage, uint32_t hipage, int budget);
 #define pageoutd_wakeup()        (sched_broadcast_on(&pageoutd_waitq))
 #define pageoutd_needed()        \
-	((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
-#define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
+        (((page_free_count() <= nfreepages_low) || (ndirty > ndirty_background)) \
+         && (!list_empty(&alloc_list)))
+#define pageoutd_target_met()    \
+        ((page_free_count() >= nfreepages_high) && (ndirty <= ndirty_background))
+#define pframe_alloc_must_wait() \
+        ((page_free_count() <= nfreepages_min) && (curproc != pageoutd) \
+         && (!list_empty(&alloc_list)))
+
+
+static int
+pframe_hashtab_alloc(pframe_hashtab_t *tab, int order)
+{
+        uint32_t i;
+
+        KASSERT(0 < order && order <= PF_HASH_MAX_ORDER);
+        if (NULL == (tab->pht_buckets = kmalloc(sizeof(list_t) << order)))
+                return -ENOMEM;
+        tab->pht_order = order;
+        for (i = 0; i < (1U << order); ++i)
+                list_init(&tab->pht_buckets[i]);
+        return 0;
+}
+
+static inline list_t *
+pframe_hashtab_chain(pframe_hashtab_t *tab, mmobj_t *o, uint32_t pagenum)
+{
+        return &tab->pht_buckets[hash_page(o, pagenum, tab->pht_order)];
+}
+
+/*
+ * Moves up to nbuckets chains of the old table into the current one,
+ * and frees the old table once it is empty.
+ */
+static void
+pframe_hash_migrate(uint32_t nbuckets)
+{
+        pframe_t *pf;
+
+        if (NULL == pframe_hash_old.pht_buckets)
+                return;
+
+        for (; nbuckets > 0 && pframe_hash_migrated < (1U << pframe_hash_old.pht_order);
+             --nbuckets, ++pframe_hash_migrated) {
+                list_iterate_begin(&pframe_hash_old.pht_buckets[pframe_hash_migrated],
+                                   pf, pframe_t, pf_hlink) {
+                        list_remove(&pf->pf_hlink);
+                        list_insert_head(pframe_hashtab_chain(&pframe_hash, pf->pf_obj,
+                                                              pf->pf_pagenum),
+                                         &pf->pf_hlink);
+                } list_iterate_end();
+        }
+
+        if (pframe_hash_migrated == (1U << pframe_hash_old.pht_order)) {
+                dbg(DBG_PFRAME, "pframe hash now has %u buckets\n",
+                    1U << pframe_hash.pht_order);
+                kfree(pframe_hash_old.pht_buckets);
+                pframe_hash_old.pht_buckets = NULL;
+        }
+}
+
+/*
+ * Adds a page to the resident page hash, first doing a step of any
+ * pending growth. If the table is too loaded this only asks for it to
+ * grow, since allocating the new table may block and pf is not ready
+ * to be found yet; pframe_hash_grow does the rest. Does not block.
+ */
+static void
+pframe_hash_insert(pframe_t *pf)
+{
+        pframe_hash_migrate(PF_HASH_MIGRATE_STEP);
 
+        if (NULL == pframe_hash_old.pht_buckets && !pframe_hash_growing
+            && pframe_hash.pht_order < PF_HASH_MAX_ORDER
+            && (uint32_t)(nallocated + npinned) > ((uint32_t)PF_HASH_LOAD << pframe_hash.pht_order))
+                pframe_hash_want_grow = 1;
+
+        list_insert_head(pframe_hashtab_chain(&pframe_hash, pf->pf_obj, pf->pf_pagenum),
+                         &pf->pf_hlink);
+}
+
+/*
+ * Starts growing the resident page hash if pframe_hash_insert asked for
+ * it. May block allocating the new table; pframe_hash_growing keeps
+ * anybody else from starting to grow it meanwhile, so the table which
+ * becomes the old one is always the current one. If there is no memory
+ * for the new table the hash just stays as it is.
+ */
+static void
+pframe_hash_grow(void)
+{
+        pframe_hashtab_t grown;
+
+        if (!pframe_hash_want_grow || pframe_hash_growing)
+                return;
+        pframe_hash_want_grow = 0;
+        pframe_hash_growing = 1;
+
+        KASSERT(NULL == pframe_hash_old.pht_buckets);
+        if (0 == pframe_hashtab_alloc(&grown, pframe_hash.pht_order + 1)) {
+                pframe_hash_old = pframe_hash;
+                pframe_hash = grown;
+                pframe_hash_migrated = 0;
+        }
+
+        pframe_hash_growing = 0;
+}
+
+/*
+ * Debugging information about the resident page hash: its size, and a
+ * histogram of chain lengths (counting both tables while it grows),
+ * which is what pframe_get_resident pays for.
+ */
+size_t
+pframe_hash_info(const void *arg, char *buf, size_t osize)
+{
+        static const uint32_t limits[] = { 0, 1, 2, 3, 4, 7, 15, 31 };
+#define PF_HASH_NHIST  (sizeof(limits) / sizeof(limits[0]) + 1)
+        uint32_t hist[PF_HASH_NHIST];
+        uint32_t maxlen = 0, nentries = 0, nchains = 0;
+        pframe_hashtab_t *tabs[2];
+        size_t size = osize;
+        uint32_t i, b, t;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        tabs[0] = &pframe_hash;
+        tabs[1] = &pframe_hash_old;
+        memset(hist, 0, sizeof(hist));
+        for (t = 0; t < 2; ++t) {
+                if (NULL == tabs[t]->pht_buckets)
+                        continue;
+                for (b = 0; b < (1U << tabs[t]->pht_order); ++b) {
+                        uint32_t len = 0;
+                        list_link_t *link;
+                        list_t *chain = &tabs[t]->pht_buckets[b];
+
+                        for (link = chain->l_next; link != chain; link = link->l_next)
+                                ++len;
+                        for (i = 0; i < PF_HASH_NHIST - 1 && len > limits[i]; ++i)
+                                ;
+                        hist[i]++;
+                        nentries += len;
+                        nchains++;
+                        if (len > maxlen)
+                                maxlen = len;
+                }
+        }
+
+        iprintf(&buf, &size, "%u pages in %u buckets", nentries, 1U << pframe_hash.pht_order);
+        if (NULL != pframe_hash_old.pht_buckets)
+                iprintf(&buf, &size, " (growing from %u, %u buckets moved)",
+                        1U << pframe_hash_old.pht_order, pframe_hash_migrated);
+        iprintf(&buf, &size, "\nlongest chain %u\n%9s %8s\n", maxlen, "LENGTH", "CHAINS");
+        for (i = 0; i < PF_HASH_NHIST; ++i) {
+                if (0 == i)
+                        iprintf(&buf, &size, "%9u %8u\n", 0, hist[i]);
+                else if (PF_HASH_NHIST - 1 == i)
+                        iprintf(&buf, &size, "%8u+ %8u\n", limits[i - 1] + 1, hist[i]);
+                else if (limits[i - 1] + 1 == limits[i])
+                        iprintf(&buf, &size, "%9u %8u\n", limits[i], hist[i]);
+                else
+                        iprintf(&buf, &size, "%4u-%-4u %8u\n", limits[i - 1] + 1, limits[i], hist[i]);
+        }
+#undef PF_HASH_NHIST
+
+        return size;
+}
 
 /*
  * Initialize the pinned and allocated counts and lists. Then, make a pframe
  * slab allocator. You should also list_init all the lists that make
  * up the pframe_hash. Finally, you need to set things up for pageoutd to
- * run by setting nfreepages_min and nfreepages_target.
+ * run by setting the free page watermarks and dirty page thresholds.
  */
 void
 pframe_init(void)
 {
+        uint32_t npages;
+
         /* initialize page lists: */
         npinned = 0;
         list_init(&pinned_list);
         nallocated = 0;
         list_init(&alloc_list);
 
-        pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
+        pframe_allocator = slab_allocator_create_aligned("pframe", sizeof(pframe_t),
+                                                         SLAB_CACHE_LINE_SIZE);
         KASSERT(NULL != pframe_allocator);
 
         /* initialize pframe_hash: */
-        int i;
-        for (i = 0; i < PF_HASH_SIZE; ++i)
-                list_init(&pframe_hash[i]);
+        if (0 > pframe_hashtab_alloc(&pframe_hash, PF_HASH_MIN_ORDER))
+                panic("not enough memory for the pframe hash");
+        pframe_hash_old.pht_buckets = NULL;
+        pframe_hash_migrated = 0;
 
         /* initialize pageout parameters: */
-        nfreepages_target = page_free_count() >> 1;
-        nfreepages_min = 0;
+        npages = page_free_count();
+        nfreepages_min = MAX(npages >> PAGEOUTD_FREE_MIN_SHIFT, (uint32_t)PFRAME_CLUSTER_MAX);
+        nfreepages_low = MAX(npages >> PAGEOUTD_FREE_LOW_SHIFT, nfreepages_min + 1);
+        nfreepages_high = MAX(npages >> PAGEOUTD_FREE_HIGH_SHIFT, nfreepages_low + 1);
+        ndirty = 0;
+        ndirty_background = (int)(npages >> PAGEOUTD_DIRTY_BG_SHIFT);
+        ndirty_limit = MAX((int)(npages >> PAGEOUTD_DIRTY_LIMIT_SHIFT), ndirty_background + 1);
 
 		/* initialize alloc_waitq */
 		sched_queue_init(&alloc_waitq);
+
+        kmutex_init(&pframe_clean_mutex);
 }
 
 void
@@ -192,22 +440,178 @@ pframe_get_resident(struct mmobj *o, uint32_t pagenum)
         list_t *hashchain;
         pframe_t *pf;
 
-        hashchain = &pframe_hash[hash_page(o, pagenum)];
-        list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
-                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
-                        /* found a page with the specified identity. It is
-                         * up to the caller to recognize/care if the page
-                         * is busy. */
-                        if (!pframe_is_pinned(pf)) {
-                                /* send to back of alloc_list */
-                                list_remove(&pf->pf_link);
-                                list_insert_tail(&alloc_list, &pf->pf_link);
+        hashchain = pframe_hashtab_chain(&pframe_hash, o, pagenum);
+        for (;;) {
+                list_iterate_begin(hashchain, pf, pframe_t, pf_hlink) {
+                        if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum)) {
+                                /* found a page with the specified identity. It is
+                                 * up to the caller to recognize/care if the page
+                                 * is busy. */
+                                pframe_set_referenced(pf);
+                                return pf;
                         }
-                        return pf;
+                } list_iterate_end();
+
+                /* While the hash is growing, the page may not have been
+                 * moved to the new table yet. */
+                if (NULL == pframe_hash_old.pht_buckets
+                    || hashchain != pframe_hashtab_chain(&pframe_hash, o, pagenum))
+                        return NULL;
+                hashchain = pframe_hashtab_chain(&pframe_hash_old, o, pagenum);
+        }
+}
+
+/*
+ * Fills the page of a busy page frame with zeroes, for use by fillpage
+ * operations of objects whose pages start out empty. If a pre-zeroed page
+ * is available it simply replaces the frame's page, so that the zeroing
+ * is not paid for on the fault path. The frame must not be mapped anywhere
+ * yet, which is always the case while it is being filled.
+ *
+ * @param pf the page frame being filled
+ */
+void
+pframe_fill_zeroes(pframe_t *pf)
+{
+        KASSERT(pframe_is_busy(pf));
+        KASSERT(!pframe_is_pinned(pf));
+
+        if (0 < page_zeroed_count()) {
+                void *zeroed = page_alloc_zeroed();
+                KASSERT(NULL != zeroed);
+                page_free(pf->pf_addr);
+                pf->pf_addr = zeroed;
+        } else {
+                memset(pf->pf_addr, 0, PAGE_SIZE);
+        }
+}
+
+/*
+ * Microbenchmark for pframe_hash lookups. Temporarily hashes nframes
+ * placeholder pframes (which own no page and belong to no real mmobj)
+ * and then walks every hash chain niters times, comparing identities
+ * exactly as pframe_get_resident does but never finding a match.
+ * This never blocks, so nobody else can see the placeholders.
+ *
+ * @param nframes number of placeholder pframes to add to the hash
+ * @param niters number of passes over the whole hash
+ * @param nvisited set to the total number of pframes looked at
+ * @return the number of cycles spent walking chains, or 0 if the
+ * placeholders could not be allocated
+ */
+uint32_t
+pframe_hash_bench(int nframes, int niters, uint32_t *nvisited)
+{
+        static char placeholder;
+        mmobj_t *o = (mmobj_t *)&placeholder;
+        list_t frames;
+        pframe_t *pf;
+        uint32_t visited = 0, matched = 0;
+        uint64_t start, end;
+        uint32_t i;
+        int iter, nalloced;
+
+        list_init(&frames);
+        for (nalloced = 0; nalloced < nframes; nalloced++) {
+                if (NULL == (pf = slab_obj_alloc(pframe_allocator)))
+                        break;
+                pf->pf_obj = o;
+                pf->pf_pagenum = nalloced;
+                list_insert_tail(&frames, &pf->pf_link);
+                pframe_hash_insert(pf);
+        }
+
+        start = rdtsc();
+        for (iter = 0; iter < niters; iter++) {
+                for (i = 0; i < (1U << pframe_hash.pht_order); i++) {
+                        list_iterate_begin(&pframe_hash.pht_buckets[i], pf, pframe_t, pf_hlink) {
+                                visited++;
+                                if ((NULL == pf->pf_obj) && (0 == pf->pf_pagenum))
+                                        matched++;
+                        } list_iterate_end();
                 }
+                if (NULL == pframe_hash_old.pht_buckets)
+                        continue;
+                for (i = 0; i < (1U << pframe_hash_old.pht_order); i++) {
+                        list_iterate_begin(&pframe_hash_old.pht_buckets[i], pf, pframe_t, pf_hlink) {
+                                visited++;
+                                if ((NULL == pf->pf_obj) && (0 == pf->pf_pagenum))
+                                        matched++;
+                        } list_iterate_end();
+                }
+        }
+        end = rdtsc();
+
+        list_iterate_begin(&frames, pf, pframe_t, pf_link) {
+                list_remove(&pf->pf_hlink);
+                list_remove(&pf->pf_link);
+                slab_obj_free(pframe_allocator, pf);
         } list_iterate_end();
 
-        return NULL;
+        KASSERT(0 == matched);
+        *nvisited = visited;
+        return (nalloced < nframes) ? 0 : (uint32_t)(end - start);
+}
+
+/*
+ * Returns the link after link on the clock face, skipping over the head of
+ * alloc_list. alloc_list must not be empty.
+ */
+static list_link_t *
+pframe_clock_next(list_link_t *link)
+{
+        link = link->l_next;
+        if (&alloc_list == link)
+                link = link->l_next;
+        return link;
+}
+
+/*
+ * Removes a page from alloc_list, moving the front hand off of it first.
+ */
+static void
+pframe_clock_remove(pframe_t *pf)
+{
+        if (&pf->pf_link == pageoutd_front_hand) {
+                pageoutd_front_hand = pframe_clock_next(pageoutd_front_hand);
+                if (&pf->pf_link == pageoutd_front_hand)
+                        pageoutd_front_hand = NULL;
+        }
+        list_remove(&pf->pf_link);
+}
+
+/*
+ * Returns whether a page has been referenced since this was last called on
+ * it, and clears its reference bits. Besides PF_REFERENCED, which is set
+ * when the page is looked up, this collects the PT_ACCESSED bits of every
+ * mapping of the page, so accesses through user mappings count as well.
+ * This does not block.
+ */
+static int
+pframe_test_and_clear_referenced(pframe_t *pf)
+{
+        int referenced = pframe_is_referenced(pf);
+        vmarea_t *vma;
+
+        pframe_clear_referenced(pf);
+
+        list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
+                if ((pf->pf_pagenum >= vma->vma_off)
+                    && (pf->pf_pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))
+                    && (NULL != vma->vma_vmmap->vmm_proc)) {
+                        pagedir_t *pd = vma->vma_vmmap->vmm_proc->p_pagedir;
+                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
+                        if (pt_test_and_clear_accessed(pd, vaddr)) {
+                                referenced = 1;
+                                /* other address spaces are flushed when
+                                 * they are switched to */
+                                if (pd == pt_get())
+                                        tlb_flush(vaddr);
+                        }
+                }
+        } list_iterate_end();
+
+        return referenced;
 }
 
 /*
@@ -236,6 +640,12 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
                 slab_obj_free(pframe_allocator, pf);
                 return NULL;
         }
+        if (0 > radix_tree_insert(&o->mmo_pagetree, pagenum, pf)) {
+                dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
+                page_free(pf->pf_addr);
+                slab_obj_free(pframe_allocator, pf);
+                return NULL;
+        }
 
         nallocated++;
         list_insert_tail(&alloc_list, &pf->pf_link);
@@ -246,7 +656,7 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
         sched_queue_init(&pf->pf_waitq);
         pf->pf_pincount = 0;
 
-        list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
+        pframe_hash_insert(pf);
 
         o->mmo_ops->ref(o);
         o->mmo_nrespages++;
@@ -297,10 +707,129 @@ pframe_fill(pframe_t *pf)
 int
 pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_get");
+        pframe_t *pf;
+        int ret;
+
+        KASSERT(NULL != o);
+        KASSERT(NULL != result);
+
+        for (;;) {
+                if (NULL != (pf = pframe_get_resident(o, pagenum))) {
+                        if (pframe_is_busy(pf)) {
+                                /* it may be gone once we wake up, look again */
+                                sched_sleep_on(&pf->pf_waitq);
+                                continue;
+                        }
+                        *result = pf;
+                        return 0;
+                }
+
+                if (pframe_alloc_must_wait()) {
+                        dbg(DBG_PFRAME, "waiting for pageoutd, %u pages free\n",
+                            page_free_count());
+                        pageoutd_wakeup();
+                        sched_sleep_on(&alloc_waitq);
+                        continue;
+                }
+
+                /* growing the hash may block, so look again afterwards */
+                if (pframe_hash_want_grow && !pframe_hash_growing) {
+                        pframe_hash_grow();
+                        continue;
+                }
+
+                if (NULL == (pf = pframe_alloc(o, pagenum))) {
+                        *result = NULL;
+                        return -ENOMEM;
+                }
+                break;
+        }
+
+        /* start reclaiming well before anybody has to wait for it */
+        if (pageoutd_needed())
+                pageoutd_wakeup();
+
+        if (0 > (ret = pframe_fill(pf))) {
+                pframe_free(pf);
+                *result = NULL;
+                return ret;
+        }
+
+        *result = pf;
         return 0;
 }
 
+/*
+ * Reads pages [pagenum, pagenum + npages) of o in, if they are not
+ * resident yet, as a hint that they are about to be used. Every missing
+ * page is allocated and marked busy before any of them is filled, and
+ * each run of consecutive missing pages is handed to the object's
+ * fillpages operation, if it has one, as a single request. Otherwise
+ * each page is filled with fillpage.
+ *
+ * Since this is only a hint, it stops rather than waiting for pageoutd
+ * when memory runs low. Pages which could not be filled are freed again.
+ *
+ * This routine may block at the mmobj operation level.
+ *
+ * @param o the parent object of the pages
+ * @param pagenum the page number of the first page
+ * @param npages the number of pages, at most PFRAME_CLUSTER_MAX
+ * @return 0 on success, < 0 on failure
+ */
+int
+pframe_prefetch(struct mmobj *o, uint32_t pagenum, int npages)
+{
+        pframe_t *pfs[PFRAME_CLUSTER_MAX];
+        int i, n, filled, ret = 0, err = 0;
+
+        KASSERT(NULL != o);
+        KASSERT(0 < npages && npages <= PFRAME_CLUSTER_MAX);
+
+        for (i = 0; i < npages && 0 == ret && 0 == err;) {
+                /* Nothing below blocks, so the pages we find missing
+                 * stay missing until we have them all */
+                for (n = 0; i + n < npages; n++) {
+                        if (NULL != pframe_get_resident(o, pagenum + i + n))
+                                break;
+                        if (pframe_alloc_must_wait()
+                            || NULL == (pfs[n] = pframe_alloc(o, pagenum + i + n))) {
+                                err = -ENOMEM;
+                                break;
+                        }
+                        pframe_set_busy(pfs[n]);
+                }
+                if (0 == n) {
+                        i++;
+                        continue;
+                }
+
+                if (pageoutd_needed())
+                        pageoutd_wakeup();
+
+                filled = 0;
+                if (1 < n && NULL != o->mmo_ops->fillpages) {
+                        if (0 == (ret = o->mmo_ops->fillpages(o, pfs, n)))
+                                filled = n;
+                } else {
+                        for (; filled < n; filled++) {
+                                if (0 > (ret = o->mmo_ops->fillpage(o, pfs[filled])))
+                                        break;
+                        }
+                }
+
+                /* As in pframe_get, waiters are woken before a page which
+                 * could not be filled is freed, and look it up again */
+                for (i += n; 0 < n; n--) {
+                        pframe_clear_busy(pfs[n - 1]);
+                        sched_broadcast_on(&pfs[n - 1]->pf_waitq);
+                        if (n > filled)
+                                pframe_free(pfs[n - 1]);
+                }
+        }
+        return (0 == ret) ? err : ret;
+}
+
 int
 pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result)
 {
@@ -317,8 +846,10 @@ pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result
  *
  * @param pf page to be migrated
  * @param dest destination vm object
+ * @return 0 on success, or -ENOMEM if dest's page tree cannot grow to
+ * hold pf, in which case pf stays where it was
  */
-void
+int
 pframe_migrate(pframe_t *pf, mmobj_t *dest)
 {
         KASSERT(!pframe_is_busy(pf));
@@ -329,16 +860,23 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
                 pframe_free(pf);
         } else {
                 mmobj_t *src = pf->pf_obj;
+                if (0 > radix_tree_insert(&dest->mmo_pagetree, pf->pf_pagenum, pf)) {
+                        dbg(DBG_PFRAME, "not enough memory to migrate page %u\n",
+                            pf->pf_pagenum);
+                        return -ENOMEM;
+                }
+                radix_tree_remove(&src->mmo_pagetree, pf->pf_pagenum);
                 pf->pf_obj = dest;
                 list_remove(&pf->pf_hlink);
                 list_remove(&pf->pf_olink);
                 src->mmo_nrespages--;
                 src->mmo_ops->put(src);
-                list_insert_head(&pframe_hash[hash_page(dest, pf->pf_pagenum)], &pf->pf_hlink);
+                pframe_hash_insert(pf);
                 list_insert_head(&dest->mmo_respages, &pf->pf_olink);
                 dest->mmo_nrespages++;
                 dest->mmo_ops->ref(dest);
         }
+        return 0;
 }
 
 /*
@@ -357,7 +895,17 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
 void
 pframe_pin(pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_pin");
+        KASSERT(!pframe_is_free(pf));
+        KASSERT(0 <= pf->pf_pincount);
+
+        if (0 == pf->pf_pincount++) {
+                if (pframe_is_dirty(pf))
+                        ndirty--;
+                pframe_clock_remove(pf);
+                nallocated--;
+                list_insert_tail(&pinned_list, &pf->pf_link);
+                npinned++;
+        }
 }
 
 /*
@@ -373,7 +921,18 @@ pframe_pin(pframe_t *pf)
 void
 pframe_unpin(pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_unpin");
+        KASSERT(!pframe_is_free(pf));
+        KASSERT(0 < pf->pf_pincount);
+
+        if (0 == --pf->pf_pincount) {
+                if (pframe_is_dirty(pf))
+                        ndirty++;
+                list_remove(&pf->pf_link);
+                npinned--;
+                /* just behind the back hand, so it gets a full lap */
+                list_insert_tail(&alloc_list, &pf->pf_link);
+                nallocated++;
+        }
 }
 
 /*
@@ -398,6 +957,8 @@ pframe_dirty(pframe_t *pf)
         pframe_set_busy(pf);
 
         if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf))) {
+                if (!pframe_is_dirty(pf) && !pframe_is_pinned(pf))
+                        ndirty++;
                 pframe_set_dirty(pf);
         }
         pframe_clear_busy(pf);
@@ -406,6 +967,17 @@ pframe_dirty(pframe_t *pf)
         return ret;
 }
 
+/*
+ * Marks a page dirty again after writing it back failed.
+ */
+static void
+pframe_redirty(pframe_t *pf)
+{
+        if (!pframe_is_dirty(pf) && !pframe_is_pinned(pf))
+                ndirty++;
+        pframe_set_dirty(pf);
+}
+
 /*
  * Clean a dirty page by writing it back to disk. Removes the dirty
  * bit of the page and updates the MMU entry.
@@ -418,31 +990,73 @@ pframe_dirty(pframe_t *pf)
 int
 pframe_clean(pframe_t *pf)
 {
-        int ret;
+        return pframe_clean_cluster(&pf, 1);
+}
+
+/*
+ * Clean npages dirty, unpinned, non-busy pages of the same object at once.
+ * Their page numbers must be consecutive and increasing, and if there are
+ * several and the object has a cleanpages operation they are written back
+ * with a single call to it. Otherwise each is written back with cleanpage.
+ *
+ * This routine can block at the mmobj operation level.
+ * @param pfs the pages to clean
+ * @param npages the number of pages
+ * @return 0 on success, -errno on failure
+ */
+int
+pframe_clean_cluster(pframe_t **pfs, int npages)
+{
+        mmobj_t *o = pfs[0]->pf_obj;
+        int i, ret = 0, err;
 
-        KASSERT(pframe_is_dirty(pf) && "Cleaning page that isn't dirty!");
-        KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
+        KASSERT(0 < npages && npages <= PFRAME_CLUSTER_MAX);
 
-        dbg(DBG_PFRAME, "cleaning page %d of obj %p\n", pf->pf_pagenum, pf->pf_obj);
+        for (i = 0; i < npages; i++) {
+                pframe_t *pf = pfs[i];
 
-        /*
-         * Clear the dirty bit *before* we potentially (depending on this
-         * particular object type's 'dirtypage' implementation) block so
-         * that if the page is dirtied again while we're writing it out,
-         * we won't (incorrectly) think the page has been fully cleaned.
-         */
-        pframe_clear_dirty(pf);
+                KASSERT(pframe_is_dirty(pf) && "Cleaning page that isn't dirty!");
+                KASSERT(pf->pf_pincount == 0 && "Cleaning a pinned page!");
+                KASSERT(!pframe_is_busy(pf));
+                KASSERT(o == pf->pf_obj);
+                KASSERT(pfs[0]->pf_pagenum + i == pf->pf_pagenum);
 
-        /* Make sure a future write to the page will fault (and hence dirty it) */
-        tlb_flush((uintptr_t) pf->pf_addr);
-        pframe_remove_from_pts(pf);
+                dbg(DBG_PFRAME, "cleaning page %d of obj %p\n", pf->pf_pagenum, pf->pf_obj);
 
-        pframe_set_busy(pf);
-        if ((ret = pf->pf_obj->mmo_ops->cleanpage(pf->pf_obj, pf)) < 0) {
-                pframe_set_dirty(pf);
+                /*
+                 * Clear the dirty bit *before* we potentially (depending on this
+                 * particular object type's 'dirtypage' implementation) block so
+                 * that if the page is dirtied again while we're writing it out,
+                 * we won't (incorrectly) think the page has been fully cleaned.
+                 */
+                pframe_clear_dirty(pf);
+                ndirty--;
+
+                /* Make sure a future write to the page will fault (and hence dirty it) */
+                tlb_flush((uintptr_t) pf->pf_addr);
+                pframe_remove_from_pts(pf);
+
+                pframe_set_busy(pf);
+        }
+
+        if (1 < npages && NULL != o->mmo_ops->cleanpages) {
+                if (0 > (ret = o->mmo_ops->cleanpages(o, pfs, npages))) {
+                        for (i = 0; i < npages; i++)
+                                pframe_redirty(pfs[i]);
+                }
+        } else {
+                for (i = 0; i < npages; i++) {
+                        if (0 > (err = o->mmo_ops->cleanpage(o, pfs[i]))) {
+                                pframe_redirty(pfs[i]);
+                                ret = err;
+                        }
+                }
+        }
+
+        for (i = 0; i < npages; i++) {
+                pframe_clear_busy(pfs[i]);
+                sched_broadcast_on(&pfs[i]->pf_waitq);
         }
-        pframe_clear_busy(pf);
-        sched_broadcast_on(&pf->pf_waitq);
 
         return ret;
 }
@@ -473,10 +1087,13 @@ pframe_free(pframe_t *pf)
         pframe_remove_from_pts(pf);
 
         list_remove(&pf->pf_hlink);
+        radix_tree_remove(&o->mmo_pagetree, pf->pf_pagenum);
 
+        if (pframe_is_dirty(pf))
+                ndirty--;
         pf->pf_obj = NULL;
         nallocated--;
-        list_remove(&pf->pf_link);
+        pframe_clock_remove(pf);
 
         page_free(pf->pf_addr);
         slab_obj_free(pframe_allocator, pf);
@@ -493,38 +1110,197 @@ pframe_free(pframe_t *pf)
 /*
  * Clean all allocated pages (that is, all pages that are not pinned and
  * not free). This is called by sync(2).
+ *
+ * Rather than cleaning pages in alloc_list order, which would mean starting
+ * over from the head of the list every time we block, one pass over the
+ * list gathers the objects which have dirty pages, and each of those is then
+ * cleaned in page order with pframe_clean_range, so that runs of dirty
+ * pages go out as single requests. Cleaning a file's pages dirties the
+ * pages of the block device below it, so we keep making passes until one
+ * finds nothing to do.
  */
 void
 pframe_clean_all()
 {
         pframe_t *pf;
+        int i, nobjs;
         dbg(DBG_PFRAME, "pframe_clean_all: starting (this may take a while)\n");
 
-        /*
-         * Iterate from head of alloc_list to tail; This is a rough attempt to
-         * sync from least active to most active. Note that every time we block we
-         * need to start the loop over as the "current element" pf may have been
-         * moved or removed in the meantime (our list has no multithreaded
-         * integrity)
-         */
-list_start:
-        list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
-                KASSERT(!pframe_is_pinned(pf));
-                KASSERT(!pframe_is_free(pf));
+        kmutex_lock(&pframe_clean_mutex);
+        do {
+                nobjs = 0;
+                memset(pframe_clean_objs, 0, sizeof(pframe_clean_objs));
+
+                /* This doesn't block, so the list can't change under us */
+                list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
+                        KASSERT(!pframe_is_pinned(pf));
+                        KASSERT(!pframe_is_free(pf));
+                        /* the set is full for this pass; list_iterate
+                         * has no way to stop early */
+                        if (!pframe_is_dirty(pf) || PFRAME_CLEAN_OBJS / 2 == nobjs)
+                                continue;
+                        i = hash_page(pf->pf_obj, 0, PFRAME_CLEAN_OBJS_ORDER);
+                        while (NULL != pframe_clean_objs[i] && pf->pf_obj != pframe_clean_objs[i])
+                                i = (i + 1) % PFRAME_CLEAN_OBJS;
+                        if (NULL == pframe_clean_objs[i]) {
+                                /* hold on to the object while we block */
+                                pf->pf_obj->mmo_ops->ref(pf->pf_obj);
+                                pframe_clean_objs[i] = pf->pf_obj;
+                                nobjs++;
+                        }
+                } list_iterate_end();
+
+                for (i = 0; i < PFRAME_CLEAN_OBJS; i++) {
+                        mmobj_t *o = pframe_clean_objs[i];
+                        if (NULL == o)
+                                continue;
+                        pframe_clean_range(o, 0, PFRAME_MAX_PAGENUM);
+                        o->mmo_ops->put(o);
+                }
+        } while (0 < nobjs);
+        kmutex_unlock(&pframe_clean_mutex);
+
+        /* In theory, this function might never terminate (if new pages are
+         * constantly being dirtied at the same time). That's why the user
+         * shouldn't call sync(2) very much... */
+        dbg(DBG_PFRAME, "pframe_clean_all: completed!\n");
+}
+
+/*
+ * Returns the resident page of o with the lowest page number in
+ * [pagenum, hipage], or NULL if there is no such page.
+ */
+static pframe_t *
+pframe_next_resident(mmobj_t *o, uint32_t pagenum, uint32_t hipage)
+{
+        pframe_t *pf;
+
+        if (pagenum > hipage
+            || 0 == radix_tree_gang_lookup(&o->mmo_pagetree, pagenum, (void **)&pf, 1))
+                return NULL;
+        return (pf->pf_pagenum <= hipage) ? pf : NULL;
+}
+
+/*
+ * Clean the dirty, unpinned pages of o whose page numbers lie in
+ * [lopage, hipage], in increasing page order, handing each run of dirty
+ * pages to pframe_clean_cluster at once. Only the pages in the range
+ * are visited, so flushing part of a large file costs no more than the
+ * number of resident pages in that part. Pass 0 and PFRAME_MAX_PAGENUM to
+ * clean the whole object.
+ *
+ * Since cleaning blocks, we look the next page up in the page tree after
+ * every page rather than holding on to pframes across a sleep. Unlike
+ * pframe_clean_all, a page which is dirtied again behind us is left for
+ * the next call, so this always terminates.
+ *
+ * @return the number of pages cleaned or waited for, so that callers which
+ * are iterating over something else know whether we blocked, or the last
+ * error from pframe_clean
+ */
+int
+pframe_clean_range(mmobj_t *o, uint32_t lopage, uint32_t hipage)
+{
+        return pframe_writeback_range(o, lopage, hipage, INT_MAX);
+}
+
+/*
+ * pframe_clean_range, but stops once it has cleaned at least budget pages.
+ */
+static int
+pframe_writeback_range(mmobj_t *o, uint32_t lopage, uint32_t hipage, int budget)
+{
+        pframe_t *pf, *cluster[PFRAME_CLUSTER_MAX];
+        uint32_t pagenum = lopage;
+        int n, nblocked = 0, err = 0, ret;
+
+        while (0 < budget && NULL != (pf = pframe_next_resident(o, pagenum, hipage))) {
+                pagenum = pf->pf_pagenum;
                 if (pframe_is_busy(pf)) {
+                        /* pf might be gone once we wake up, look it up again */
                         sched_sleep_on(&pf->pf_waitq);
-                        goto list_start;
+                        nblocked++;
+                        continue;
                 }
-                if (pframe_is_dirty(pf)) {
-                        pframe_clean(pf);
-                        goto list_start;
+                if (pframe_is_dirty(pf) && !pframe_is_pinned(pf)) {
+                        /* gather the run of dirty pages which starts here */
+                        cluster[0] = pf;
+                        for (n = 1; n < PFRAME_CLUSTER_MAX && (uint32_t)n <= hipage - pagenum; n++) {
+                                pf = radix_tree_lookup(&o->mmo_pagetree, pagenum + n);
+                                if (NULL == pf || !pframe_is_dirty(pf)
+                                    || pframe_is_pinned(pf) || pframe_is_busy(pf))
+                                        break;
+                                cluster[n] = pf;
+                        }
+                        if (0 > (ret = pframe_clean_cluster(cluster, n)))
+                                err = ret;
+                        nblocked += n;
+                        budget -= n;
+                        pagenum += n - 1;
                 }
-        } list_iterate_end();
+                if (pagenum++ == hipage)
+                        break;
+        }
 
-        /* In theory, this function might never terminate (if new pages are
-         * constantly being added at the same time). That's why the user shouldn't
-         * call sync(2) very much... */
-        dbg(DBG_PFRAME, "pframe_clean_all: completed!\n");
+        return err ? err : nblocked;
+}
+
+/*
+ * Called after writing to o. If there are more dirty pages than
+ * ndirty_background, wake up pageoutd to write some back, and write back
+ * some of o's dirty pages ourselves: none right at the threshold, up to
+ * PFRAME_CLUSTER_MAX at ndirty_limit, and at least that many beyond it, so
+ * that a writer which keeps dirtying pages faster than the disk takes them
+ * is slowed down to the disk's pace. Past ndirty_limit, also wait for
+ * pageoutd to finish a round. The caller must hold a reference to o, and
+ * no locks which writing back o's pages could need.
+ */
+void
+pframe_balance_dirty(mmobj_t *o)
+{
+        int nr;
+
+        if (ndirty <= ndirty_background || curproc == pageoutd)
+                return;
+
+        pageoutd_wakeup();
+
+        nr = ((ndirty - ndirty_background) * PFRAME_CLUSTER_MAX)
+             / (ndirty_limit - ndirty_background);
+        if (0 < nr)
+                pframe_writeback_range(o, 0, PFRAME_MAX_PAGENUM, nr);
+
+        /* the writeback above may have blocked, letting pageoutd go
+         * back to sleep, so wake it again with nothing in between */
+        if (ndirty > ndirty_limit) {
+                dbg(DBG_PFRAME, "throttling writer, %d pages dirty\n", ndirty);
+                pageoutd_wakeup();
+                sched_sleep_on(&alloc_waitq);
+        }
+}
+
+/*
+ * Free every resident page of o whose page number lies in [lopage, hipage],
+ * waiting for busy pages first. None of these pages may be pinned, and
+ * dirty pages are not cleaned (see pframe_free). The caller must hold a
+ * reference to o so that freeing the last page does not destroy it.
+ */
+void
+pframe_free_range(mmobj_t *o, uint32_t lopage, uint32_t hipage)
+{
+        pframe_t *pf;
+        uint32_t pagenum = lopage;
+
+        while (NULL != (pf = pframe_next_resident(o, pagenum, hipage))) {
+                pagenum = pf->pf_pagenum;
+                if (pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                        continue;
+                }
+                pframe_free(pf);
+                if (pagenum++ == hipage)
+                        break;
+        }
 }
 
 /* Remove a page frame from the page tables of all processes that map it
@@ -589,11 +1365,53 @@ pageoutd_exit()
 }
 
 /*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
- * page is busy before yanking it. If the page you select is dirty, make sure
- * to clean it before yanking it. Finally, go back to sleep after having paged
- * out the appropriate page.
+ * Background writeback: gather up to PAGEOUTD_WRITEBACK_OBJS objects with
+ * dirty pages, starting from the back hand (so roughly the ones which have
+ * been dirty the longest), and write their dirty pages back in page order
+ * until we are back under ndirty_background.
+ *
+ * @return the number of dirty pages written back
+ */
+static int
+pageoutd_writeback(void)
+{
+        mmobj_t *objs[PAGEOUTD_WRITEBACK_OBJS];
+        pframe_t *pf;
+        int i, nobjs = 0, nstart = ndirty;
+
+        list_iterate_begin(&alloc_list, pf, pframe_t, pf_link) {
+                /* once objs is full, skip the rest; list_iterate has no
+                 * way to stop early */
+                if (!pframe_is_dirty(pf) || PAGEOUTD_WRITEBACK_OBJS == nobjs)
+                        continue;
+                for (i = 0; i < nobjs && objs[i] != pf->pf_obj; i++)
+                        ;
+                if (i == nobjs) {
+                        /* hold on to the object while we block */
+                        pf->pf_obj->mmo_ops->ref(pf->pf_obj);
+                        objs[nobjs++] = pf->pf_obj;
+                }
+        } list_iterate_end();
+
+        for (i = 0; i < nobjs; i++) {
+                if (ndirty > ndirty_background)
+                        pframe_writeback_range(objs[i], 0, PFRAME_MAX_PAGENUM,
+                                               ndirty - ndirty_background);
+                objs[i]->mmo_ops->put(objs[i]);
+        }
+
+        return nstart - ndirty;
+}
+
+/*
+ * The pageout daemon runs a two-handed clock over alloc_list. Each step the
+ * front hand, PAGEOUTD_HAND_SPREAD pages ahead, clears the reference bits of
+ * the page under it, and the back hand looks at the head of the list. If
+ * that page has been referenced since the front hand passed it, it gets a
+ * second chance and is moved to the tail; otherwise it is cleaned if it is
+ * dirty and reclaimed once it is clean. Busy pages are waited for. Once
+ * nfreepages_high pages are free, if there are still too many dirty pages
+ * write some back (see pageoutd_writeback), and then go back to sleep.
  * Both arguments unused.
  */
 static void *
@@ -603,17 +1421,46 @@ pageoutd_run(int arg1, void *arg2)
                 KASSERT(nallocated >= 0);
                 while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
                         pframe_t *pf;
+                        int i;
+
+                        if (page_free_count() >= nfreepages_high) {
+                                /* only here because of dirty pages; give up
+                                 * if none of them can be written back */
+                                if (0 >= pageoutd_writeback())
+                                        break;
+                                continue;
+                        }
 
-                        /* obtain least-recently-requested page: */
+                        if (NULL == pageoutd_front_hand) {
+                                pageoutd_front_hand = alloc_list.l_next;
+                                for (i = 0; i < PAGEOUTD_HAND_SPREAD; i++)
+                                        pageoutd_front_hand = pframe_clock_next(pageoutd_front_hand);
+                        }
+                        pf = list_item(pageoutd_front_hand, pframe_t, pf_link);
+                        pageoutd_front_hand = pframe_clock_next(pageoutd_front_hand);
+                        pframe_test_and_clear_referenced(pf);
+
+                        /* the page under the back hand: */
                         pf = list_head(&alloc_list, pframe_t, pf_link);
 
                         if (pframe_is_busy(pf)) {
                                 sched_sleep_on(&pf->pf_waitq);
+                        } else if (pframe_test_and_clear_referenced(pf)) {
+                                list_remove(&pf->pf_link);
+                                list_insert_tail(&alloc_list, &pf->pf_link);
                         } else if (pframe_is_dirty(pf)) {
-                                pframe_clean(pf);
+                                /* write back the run of dirty pages after
+                                 * it along with it */
+                                mmobj_t *o = pf->pf_obj;
+                                uint32_t hipage = pf->pf_pagenum + (PFRAME_CLUSTER_MAX - 1);
+                                if (hipage < pf->pf_pagenum)
+                                        hipage = PFRAME_MAX_PAGENUM;
+                                o->mmo_ops->ref(o);
+                                pframe_clean_range(o, pf->pf_pagenum, hipage);
+                                o->mmo_ops->put(o);
                         } else {
-                                /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
+                                /* it's not busy, it's clean, and it hasn't
+                                 * been referenced for a while; reclaim it: */
                                 pframe_free(pf);
                         }
                 }
@@ -623,16 +1470,18 @@ pageoutd_run(int arg1, void *arg2)
 
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Falling asleep\n");
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
+                    "nfreepages_high=|%d| "
 					"nfreepages_min=|%d| "
-					"page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
+					"page_free_count=|%d| "
+					"ndirty=|%d|\n", nfreepages_high, nfreepages_min, page_free_count(), ndirty);
                 if (sched_cancellable_sleep_on(&pageoutd_waitq))
                         kthread_exit((void *)0);
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Waking up\n");
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
+                    "nfreepages_high=|%d| "
 					"nfreepages_min=|%d| "
-					"page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
+					"page_free_count=|%d| "
+					"ndirty=|%d|\n", nfreepages_high, nfreepages_min, page_free_count(), ndirty);
         }
         return NULL;
 }
@@ -11,6 +11,7 @@
  * kernels!
  */
 
+#include "kernel.h"
 #include "types.h"
 
 #include "mm/mm.h"
@@ -20,6 +21,8 @@
 #include "util/gdb.h"
 #include "util/string.h"
 #include "util/debug.h"
+#include "util/list.h"
+#include "util/printf.h"
 
 #ifdef SLAB_REDZONE
 #define front_rz(obj)           (*(uintptr_t*)(obj))
@@ -38,19 +41,62 @@
 #endif
 
 struct slab {
-        struct slab             *s_next;       /* link on list of slabs */
+        list_link_t              s_link;       /* link on full/partial/empty list */
         int                      s_inuse;      /* number of allocated objs */
+        int                      s_color;      /* offset of first obj from s_addr */
         void                    *s_free;       /* head of obj free list */
         void                    *s_addr;       /* start address */
 };
 
+/*
+ * A magazine is a small stack of allocated-but-unused objects sitting
+ * in front of the slab layer (see Bonwick & Adams, "Magazines and
+ * Vmem", USENIX 2001). Each allocator keeps a "loaded" and a "previous"
+ * magazine, standing in for the per-CPU pair, and a depot of full and
+ * empty magazines behind them. As long as one of these can satisfy a
+ * request, alloc and free are a handful of instructions regardless of
+ * how many slabs the allocator owns.
+ */
+#define SLAB_MAGAZINE_MAX_ROUNDS        30
+
+/* Objects bigger than this are not worth hoarding in magazines. */
+#define SLAB_MAGAZINE_MAX_OBJSIZE       PAGE_SIZE
+
+struct slab_magazine {
+        struct slab_magazine    *m_next;        /* link on depot list */
+        int                      m_rounds;      /* number of cached objs */
+        void                    *m_objs[SLAB_MAGAZINE_MAX_ROUNDS];
+};
+
 struct slab_allocator {
         struct slab_allocator   *sa_next;       /* link on list of slab allocators */
         const char              *sa_name;       /* user-provided name */
         size_t                   sa_objsize;    /* object size */
-        struct slab             *sa_slabs;      /* head of slab list */
+        list_t                   sa_full;       /* slabs with no free objs */
+        list_t                   sa_partial;    /* slabs with some free objs */
+        list_t                   sa_empty;      /* slabs with no allocated objs */
         int                      sa_order;      /* npages = (1 << order) */
         int                      sa_slab_nobjs; /* number of objs per slab */
+
+        size_t                   sa_align;      /* object alignment, 0 if none */
+        int                      sa_color_base; /* offset of first obj in a slab */
+        int                      sa_color_step; /* distance between slab colors */
+        int                      sa_color_max;  /* largest color that fits */
+        int                      sa_color_next; /* color of the next new slab */
+
+        int                      sa_mag_size;   /* rounds per magazine, 0 if none */
+        struct slab_magazine    *sa_mag_loaded; /* magazine we alloc/free from */
+        struct slab_magazine    *sa_mag_prev;   /* previously loaded magazine */
+        struct slab_magazine    *sa_depot_full; /* depot list of full magazines */
+        struct slab_magazine    *sa_depot_empty;/* depot list of empty magazines */
+        int                      sa_depot_nfull;
+        int                      sa_depot_nempty;
+
+        /* Magazine layer statistics */
+        uint32_t                 sa_alloc_hits;  /* allocs served by a magazine */
+        uint32_t                 sa_alloc_misses;/* allocs that went to the slabs */
+        uint32_t                 sa_free_hits;   /* frees absorbed by a magazine */
+        uint32_t                 sa_free_misses; /* frees that went to the slabs */
 };
 
 struct slab_bufctl {
@@ -82,6 +128,9 @@ static struct slab_allocator *slab_allocators = NULL;
 /* Special case - allocator for allocation of slab_allocator objects. */
 static struct slab_allocator slab_allocator_allocator;
 
+/* Special case - allocator for magazines, which has no magazines itself. */
+static struct slab_allocator slab_magazine_allocator;
+
 /*
  * This constant defines how many orders of magnitude (in page block
  * sizes) we'll search for an optimal slab size (past the smallest
@@ -89,29 +138,34 @@ static struct slab_allocator slab_allocator_allocator;
  */
 #define SLAB_MAX_ORDER                  5
 
+/*
+ * In the following, offset is the number of bytes before the first
+ * object which must be skipped to get aligned objects (see
+ * sa_color_base).
+ */
 static size_t
-_slab_size(size_t objsize, size_t nobjs)
+_slab_size(size_t objsize, size_t offset, size_t nobjs)
 {
-        return (nobjs * (objsize + sizeof(struct slab_bufctl))
+        return (offset + nobjs * (objsize + sizeof(struct slab_bufctl))
                 + sizeof(struct slab));
 }
 
 static int
-_slab_nobjs(size_t objsize, size_t order)
+_slab_nobjs(size_t objsize, size_t offset, size_t order)
 {
-        return (((PAGE_SIZE << order) - sizeof(struct slab))
+        return (((PAGE_SIZE << order) - sizeof(struct slab) - offset)
                 / (objsize + sizeof(struct slab_bufctl)));
 }
 
 static int
-_slab_waste(size_t objsize, int order)
+_slab_waste(size_t objsize, size_t offset, int order)
 {
         /* Waste is defined as the amount of unused space in the page
          * block, that is the number of bytes in the page block minus
          * the optimal slab size for that particular block size.
          */
         return ((PAGE_SIZE << order)
-                - _slab_size(objsize, _slab_nobjs(objsize, order)));
+                - _slab_size(objsize, offset, _slab_nobjs(objsize, offset, order)));
 }
 
 static void
@@ -125,7 +179,7 @@ _calc_slab_size(struct slab_allocator *allocator)
         int waste;
 
         /* Find the minimum page block size that this slab requires. */
-        minsize = _slab_size(allocator->sa_objsize, 1);
+        minsize = _slab_size(allocator->sa_objsize, allocator->sa_color_base, 1);
         for (minorder = 0; minorder < PAGE_NSIZES; minorder++)
                 if ((int)(PAGE_SIZE << minorder) >= minsize)
                         break;
@@ -134,7 +188,7 @@ _calc_slab_size(struct slab_allocator *allocator)
 
         /* Start the search with the minimum block size for this slab. */
         best_order = minorder;
-        best_waste = _slab_waste(allocator->sa_objsize, minorder);
+        best_waste = _slab_waste(allocator->sa_objsize, allocator->sa_color_base, minorder);
 
         dbg(DBG_MM, "calc_slab_size: minorder %d, waste %d\n", minorder, best_waste);
 
@@ -143,7 +197,7 @@ _calc_slab_size(struct slab_allocator *allocator)
          * of pages per slab.
          */
         for (order = minorder + 1; order < SLAB_MAX_ORDER; order++) {
-                if ((waste = _slab_waste(allocator->sa_objsize, order)) < best_waste) {
+                if ((waste = _slab_waste(allocator->sa_objsize, allocator->sa_color_base, order)) < best_waste) {
                         best_waste = waste;
                         best_order = order;
                         dbg(DBG_MM, "calc_slab_size: replacing with order %d, waste %d\n",
@@ -154,12 +208,26 @@ _calc_slab_size(struct slab_allocator *allocator)
         /* Finally, the best page block size wins.
         */
         allocator->sa_order = best_order;
-        allocator->sa_slab_nobjs = _slab_nobjs(allocator->sa_objsize, best_order);
+        allocator->sa_slab_nobjs = _slab_nobjs(allocator->sa_objsize,
+                                               allocator->sa_color_base, best_order);
+
+        /* Rather than leaving the waste at the end of every slab, use it
+         * to start each new slab's objects a little further in, so that
+         * the same field of objects in different slabs falls in different
+         * cache sets. Colors must preserve the object alignment. */
+        allocator->sa_color_step = MAX(allocator->sa_align, SLAB_CACHE_LINE_SIZE);
+        allocator->sa_color_max = allocator->sa_color_base
+                                  + (best_waste / allocator->sa_color_step)
+                                  * allocator->sa_color_step;
+        allocator->sa_color_next = allocator->sa_color_base;
 }
 
 static void
-_allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
+_allocator_init(struct slab_allocator *allocator, const char *name, size_t size,
+                size_t align)
 {
+        KASSERT(0 == (align & (align - 1)) && "alignment must be a power of two");
+
 #ifdef SLAB_REDZONE
         /*
          * Add space for the front and rear red-zones.
@@ -170,11 +238,48 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
         if (!name)
                 name = "<unnamed>";
 
+        /*
+         * To keep every object aligned, pad objects so that the distance
+         * from one to the next is a multiple of the alignment, and skip
+         * enough bytes at the start of the slab that the first object
+         * (past its red-zone, if any) is aligned.
+         */
+        allocator->sa_align = align;
+        allocator->sa_color_base = 0;
+        if (align > 0) {
+                size = ((size + sizeof(struct slab_bufctl) + align - 1) & ~(align - 1))
+                       - sizeof(struct slab_bufctl);
+#ifdef SLAB_REDZONE
+                allocator->sa_color_base = (align - sizeof(SLAB_REDZONE)) & (align - 1);
+#endif
+        }
+
         allocator->sa_name = name;
         allocator->sa_objsize = size;
-        allocator->sa_slabs = NULL;
+        list_init(&allocator->sa_full);
+        list_init(&allocator->sa_partial);
+        list_init(&allocator->sa_empty);
         _calc_slab_size(allocator);
 
+        /* Size the magazines at roughly one slab's worth of objects,
+         * so that a full magazine never pins more than a slab or so. */
+        if (allocator == &slab_magazine_allocator
+            || size > SLAB_MAGAZINE_MAX_OBJSIZE)
+                allocator->sa_mag_size = 0;
+        else
+                allocator->sa_mag_size = MIN(SLAB_MAGAZINE_MAX_ROUNDS,
+                                             allocator->sa_slab_nobjs);
+        allocator->sa_mag_loaded = NULL;
+        allocator->sa_mag_prev = NULL;
+        allocator->sa_depot_full = NULL;
+        allocator->sa_depot_empty = NULL;
+        allocator->sa_depot_nfull = 0;
+        allocator->sa_depot_nempty = 0;
+        allocator->sa_alloc_hits = 0;
+        allocator->sa_alloc_misses = 0;
+        allocator->sa_free_hits = 0;
+        allocator->sa_free_misses = 0;
+
         /* Add cache to global cache list. */
         allocator->sa_next = slab_allocators;
         slab_allocators = allocator;
@@ -184,17 +289,27 @@ _allocator_init(struct slab_allocator *allocator, const char *name, size_t size)
         dbgq(DBG_MM, "  Object Size:   %d\n", allocator->sa_objsize);
         dbgq(DBG_MM, "  Order:         %d\n", allocator->sa_order);
         dbgq(DBG_MM, "  Slab Capacity: %d\n", allocator->sa_slab_nobjs);
+        dbgq(DBG_MM, "  Alignment:     %d\n", allocator->sa_align);
+        dbgq(DBG_MM, "  Colors:        %d\n",
+             (allocator->sa_color_max - allocator->sa_color_base)
+             / allocator->sa_color_step + 1);
+        dbgq(DBG_MM, "  Magazine Size: %d\n", allocator->sa_mag_size);
 }
 
 struct slab_allocator *
 slab_allocator_create(const char *name, size_t size) {
+        return slab_allocator_create_aligned(name, size, 0);
+}
+
+struct slab_allocator *
+slab_allocator_create_aligned(const char *name, size_t size, size_t align) {
         struct slab_allocator *allocator;
 
         allocator = (struct slab_allocator *) slab_obj_alloc(&slab_allocator_allocator);
         if (!allocator)
                 return NULL;
 
-        _allocator_init(allocator, name, size);
+        _allocator_init(allocator, name, size, align);
         return allocator;
 }
 
@@ -204,7 +319,9 @@ _slab_allocator_grow(struct slab_allocator *allocator)
 {
         void *addr;
         void *obj;
+        void *first;
         int ii, npages;
+        int color;
         struct slab *slab;
 
         npages = 1 << allocator->sa_order;
@@ -212,8 +329,15 @@ _slab_allocator_grow(struct slab_allocator *allocator)
         if (!addr)
                 return 0;
 
+        /* Pick this slab's color. */
+        color = allocator->sa_color_next;
+        allocator->sa_color_next += allocator->sa_color_step;
+        if (allocator->sa_color_next > allocator->sa_color_max)
+                allocator->sa_color_next = allocator->sa_color_base;
+        first = (void *)((uintptr_t)addr + color);
+
         /* Initialize each bufctl to be free and point to the next object. */
-        obj = addr;
+        obj = first;
         for (ii = 0; ii < (allocator->sa_slab_nobjs - 1); ii++) {
 #ifdef SLAB_CHECK_FREE
                 obj_bufctl(allocator, obj)->sb_free = 1;
@@ -232,14 +356,15 @@ _slab_allocator_grow(struct slab_allocator *allocator)
 
         /*
          * The first object in the slab will be the head of the free
-         * list and the start address of the slab.
+         * list, the page block itself is the start address of the slab.
          */
-        slab->s_free = addr;
+        slab->s_free = first;
         slab->s_addr = addr;
+        slab->s_color = color;
         slab->s_inuse = 0;
 
         /* Initialize objects. */
-        obj = addr;
+        obj = first;
         for (ii = 0; ii < allocator->sa_slab_nobjs; ii++) {
 #ifdef SLAB_REDZONE
                 front_rz(obj) = SLAB_REDZONE;
@@ -249,31 +374,47 @@ _slab_allocator_grow(struct slab_allocator *allocator)
         }
 
         dbg(DBG_MM, "Growing cache \"%s\" (0x%p), new slab 0x%p "
-            "(%d pages)\n", allocator->sa_name, allocator, slab,
-            1 << allocator->sa_order);
+            "(%d pages, color %d)\n", allocator->sa_name, allocator, slab,
+            1 << allocator->sa_order, color);
 
         /* Place this slab into the cache. */
-        slab->s_next = allocator->sa_slabs;
-        allocator->sa_slabs = slab;
+        list_insert_head(&allocator->sa_empty, &slab->s_link);
+        page_set_owner(addr, npages, allocator);
 
         return 1;
 }
 
-void *
-slab_obj_alloc(struct slab_allocator *allocator)
+/*
+ * Takes an object out of one of the allocator's slabs, growing the
+ * allocator if every slab is full. Partially used slabs are preferred
+ * over empty ones so that empty slabs stay reclaimable. The object's
+ * bufctl is left pointing back at its slab. Returns NULL if no memory
+ * is available.
+ */
+static void *
+_slab_obj_get(struct slab_allocator *allocator)
 {
         struct slab *slab;
         void *obj;
+        int retried = 0;
 
         /* Find a slab with a free object. */
         for (;;) {
-                slab = allocator->sa_slabs;
-                while (slab && (slab->s_inuse == allocator->sa_slab_nobjs))
-                        slab = slab->s_next;
-                if (slab && (slab->s_inuse < allocator->sa_slab_nobjs))
+                if (!list_empty(&allocator->sa_partial)) {
+                        slab = list_head(&allocator->sa_partial, struct slab, s_link);
                         break;
-                if (!_slab_allocator_grow(allocator))
-                        return NULL;
+                }
+                if (!list_empty(&allocator->sa_empty)) {
+                        slab = list_head(&allocator->sa_empty, struct slab, s_link);
+                        break;
+                }
+                if (!_slab_allocator_grow(allocator)) {
+                        /* Growing may have reclaimed, which drains the
+                         * magazines back into our slabs; look once more. */
+                        if (retried)
+                                return NULL;
+                        retried = 1;
+                }
         }
 
         /*
@@ -284,15 +425,200 @@ slab_obj_alloc(struct slab_allocator *allocator)
         obj = slab->s_free;
         slab->s_free = obj_bufctl(allocator, obj)->sb_next;
         obj_bufctl(allocator, obj)->sb_slab = slab;
-#ifdef SLAB_CHECK_FREE
-        obj_bufctl(allocator, obj)->sb_free = 0;
-#endif
 
-        slab->s_inuse++;
+        KASSERT(slab->s_inuse < allocator->sa_slab_nobjs);
+        if (++slab->s_inuse == allocator->sa_slab_nobjs) {
+                list_remove(&slab->s_link);
+                list_insert_head(&allocator->sa_full, &slab->s_link);
+        } else if (1 == slab->s_inuse) {
+                list_remove(&slab->s_link);
+                list_insert_head(&allocator->sa_partial, &slab->s_link);
+        }
 
         dbg(DBG_MM, "Allocated object 0x%p from \"%s\" (0x%p), "
             "slab 0x%p, inuse %d\n", obj, allocator->sa_name,
-            allocator, allocator, slab->s_inuse);
+            allocator, slab, slab->s_inuse);
+
+        return obj;
+}
+
+/*
+ * Places an object obtained from _slab_obj_get back on its slab's free
+ * list.
+ */
+static void
+_slab_obj_put(struct slab_allocator *allocator, void *obj)
+{
+        struct slab *slab;
+
+        slab = obj_bufctl(allocator, obj)->sb_slab;
+
+        /* Place this object back on the slab's free list. */
+        obj_bufctl(allocator, obj)->sb_next = slab->s_free;
+        slab->s_free = obj;
+
+        KASSERT(slab->s_inuse > 0);
+        if (--slab->s_inuse == 0) {
+                list_remove(&slab->s_link);
+                list_insert_head(&allocator->sa_empty, &slab->s_link);
+        } else if (allocator->sa_slab_nobjs - 1 == slab->s_inuse) {
+                list_remove(&slab->s_link);
+                list_insert_head(&allocator->sa_partial, &slab->s_link);
+        }
+
+        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
+            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+}
+
+#define SWAP_MAGAZINES(allocator)                                       \
+        do {                                                            \
+                struct slab_magazine *__tmp = (allocator)->sa_mag_loaded; \
+                (allocator)->sa_mag_loaded = (allocator)->sa_mag_prev;  \
+                (allocator)->sa_mag_prev = __tmp;                       \
+        } while (0)
+
+/*
+ * Pops an object from the allocator's magazines, reloading from the
+ * depot if both the loaded and previous magazines are empty. Returns
+ * NULL if the magazine layer has nothing cached.
+ */
+static void *
+_slab_magazine_get(struct slab_allocator *allocator)
+{
+        struct slab_magazine *mag;
+
+        if (NULL == (mag = allocator->sa_mag_loaded))
+                return NULL;
+
+        if (0 == mag->m_rounds) {
+                if (NULL != allocator->sa_mag_prev
+                    && 0 < allocator->sa_mag_prev->m_rounds) {
+                        SWAP_MAGAZINES(allocator);
+                } else if (NULL != allocator->sa_depot_full) {
+                        /* Return the empty previous magazine to the depot and
+                         * load a full one in its place. */
+                        if (NULL != allocator->sa_mag_prev) {
+                                allocator->sa_mag_prev->m_next = allocator->sa_depot_empty;
+                                allocator->sa_depot_empty = allocator->sa_mag_prev;
+                                allocator->sa_depot_nempty++;
+                        }
+                        allocator->sa_mag_prev = mag;
+                        allocator->sa_mag_loaded = allocator->sa_depot_full;
+                        allocator->sa_depot_full = allocator->sa_depot_full->m_next;
+                        allocator->sa_depot_nfull--;
+                } else {
+                        return NULL;
+                }
+                mag = allocator->sa_mag_loaded;
+        }
+
+        KASSERT(0 < mag->m_rounds);
+        return mag->m_objs[--mag->m_rounds];
+}
+
+/*
+ * Pushes an object into the allocator's magazines. If both the loaded
+ * and previous magazines are full the previous one is handed to the
+ * depot and an empty magazine takes its place. Returns 1 if the object
+ * was cached, 0 if it must be returned to its slab.
+ */
+static int
+_slab_magazine_put(struct slab_allocator *allocator, void *obj)
+{
+        struct slab_magazine *mag;
+
+        if (0 == allocator->sa_mag_size)
+                return 0;
+
+        for (;;) {
+                mag = allocator->sa_mag_loaded;
+                if (NULL != mag && mag->m_rounds < allocator->sa_mag_size) {
+                        mag->m_objs[mag->m_rounds++] = obj;
+                        return 1;
+                }
+
+                if (NULL != allocator->sa_mag_prev
+                    && 0 == allocator->sa_mag_prev->m_rounds) {
+                        SWAP_MAGAZINES(allocator);
+                        continue;
+                }
+
+                if (NULL != allocator->sa_depot_empty) {
+                        /* Hand the full previous magazine to the depot and
+                         * load an empty one. */
+                        if (NULL != allocator->sa_mag_prev) {
+                                allocator->sa_mag_prev->m_next = allocator->sa_depot_full;
+                                allocator->sa_depot_full = allocator->sa_mag_prev;
+                                allocator->sa_depot_nfull++;
+                        }
+                        allocator->sa_mag_prev = mag;
+                        allocator->sa_mag_loaded = allocator->sa_depot_empty;
+                        allocator->sa_depot_empty = allocator->sa_depot_empty->m_next;
+                        allocator->sa_depot_nempty--;
+                        continue;
+                }
+
+                /* Nothing empty anywhere; make a new magazine. This may
+                 * reclaim memory and so rearrange our magazines, which is
+                 * why we start over rather than using it directly. */
+                if (NULL == (mag = slab_obj_alloc(&slab_magazine_allocator)))
+                        return 0;
+                mag->m_rounds = 0;
+                mag->m_next = allocator->sa_depot_empty;
+                allocator->sa_depot_empty = mag;
+                allocator->sa_depot_nempty++;
+        }
+}
+
+/*
+ * Returns every object cached in a magazine to its slab and frees the
+ * depot's magazines. The loaded and previous magazines are kept (but
+ * emptied) since they will be needed again immediately.
+ */
+static void
+_slab_magazines_drain(struct slab_allocator *allocator)
+{
+        struct slab_magazine *mag;
+
+        if (NULL != (mag = allocator->sa_mag_loaded)) {
+                while (mag->m_rounds > 0)
+                        _slab_obj_put(allocator, mag->m_objs[--mag->m_rounds]);
+        }
+        if (NULL != (mag = allocator->sa_mag_prev)) {
+                while (mag->m_rounds > 0)
+                        _slab_obj_put(allocator, mag->m_objs[--mag->m_rounds]);
+        }
+
+        while (NULL != (mag = allocator->sa_depot_full)) {
+                allocator->sa_depot_full = mag->m_next;
+                while (mag->m_rounds > 0)
+                        _slab_obj_put(allocator, mag->m_objs[--mag->m_rounds]);
+                slab_obj_free(&slab_magazine_allocator, mag);
+        }
+        while (NULL != (mag = allocator->sa_depot_empty)) {
+                allocator->sa_depot_empty = mag->m_next;
+                slab_obj_free(&slab_magazine_allocator, mag);
+        }
+        allocator->sa_depot_nfull = 0;
+        allocator->sa_depot_nempty = 0;
+}
+
+void *
+slab_obj_alloc(struct slab_allocator *allocator)
+{
+        void *obj;
+
+        if (NULL != (obj = _slab_magazine_get(allocator))) {
+                allocator->sa_alloc_hits++;
+        } else {
+                allocator->sa_alloc_misses++;
+                if (NULL == (obj = _slab_obj_get(allocator)))
+                        return NULL;
+        }
+
+#ifdef SLAB_CHECK_FREE
+        obj_bufctl(allocator, obj)->sb_free = 0;
+#endif
 
 #ifdef SLAB_REDZONE
         VERIFY_REDZONES(allocator, obj);
@@ -310,7 +636,6 @@ slab_obj_alloc(struct slab_allocator *allocator)
 void
 slab_obj_free(struct slab_allocator *allocator, void *obj)
 {
-        struct slab *slab;
         GDB_CALL_HOOK(slab_obj_free, obj, allocator);
 
 #ifdef SLAB_REDZONE
@@ -321,20 +646,18 @@ slab_obj_free(struct slab_allocator *allocator, void *obj)
 #endif
 
 #ifdef SLAB_CHECK_FREE
+        /* Objects sitting in a magazine count as free here, so double
+         * frees are still caught even though they never reach a slab. */
         KASSERT(!obj_bufctl(allocator, obj)->sb_free && "INVALID FREE!");
         obj_bufctl(allocator, obj)->sb_free = 1;
 #endif
 
-        slab = obj_bufctl(allocator, obj)->sb_slab;
-
-        /* Place this object back on the slab's free list. */
-        obj_bufctl(allocator, obj)->sb_next = slab->s_free;
-        slab->s_free = obj;
-
-        slab->s_inuse--;
-
-        dbg(DBG_MM, "Freed object 0x%p from \"%s\" (0x%p), slab 0x%p, inuse %d\n",
-            obj, allocator->sa_name, allocator, slab, slab->s_inuse);
+        if (_slab_magazine_put(allocator, obj)) {
+                allocator->sa_free_hits++;
+        } else {
+                allocator->sa_free_misses++;
+                _slab_obj_put(allocator, obj);
+        }
 }
 
 /*
@@ -350,49 +673,66 @@ slab_allocators_reclaim(int target)
         int npages_freed = 0, npages;
 
         struct slab_allocator *a;
-        struct slab *s, **prev;
+        struct slab *s;
 
-        /* Go through all caches */
+        /* Return everything cached in magazines to the slabs first so
+         * that the slabs holding those objects can become empty. This
+         * must finish before any slab is freed since draining frees
+         * magazines back into their own allocator. */
+        for (a = slab_allocators; NULL != a; a = a->sa_next)
+                _slab_magazines_drain(a);
+
+        /* Go through all caches, freeing their empty slabs */
         for (a = slab_allocators; NULL != a; a = a->sa_next) {
-                prev = &(a->sa_slabs);
-                s = a->sa_slabs;
-                while (NULL != s) {
-                        struct slab *next = s->s_next;
-                        if (0 == s->s_inuse) {
-                                /* Free Slab */
-                                (*prev) = next;
-                                npages = 1 << a->sa_order;
-
-                                page_free_n(s->s_addr, npages);
-                                npages_freed += npages;
-                        } else {
-                                prev = &(s->s_next);
-                        }
+                npages = 1 << a->sa_order;
+                while (!list_empty(&a->sa_empty)) {
+                        s = list_head(&a->sa_empty, struct slab, s_link);
+                        KASSERT(0 == s->s_inuse);
+                        list_remove(&s->s_link);
+
+                        /* Free Slab */
+                        page_set_owner(s->s_addr, npages, NULL);
+                        page_free_n(s->s_addr, npages);
+                        npages_freed += npages;
+
                         /* Check if target was met */
                         if ((target > 0) && (npages_freed >= target)) {
                                 return npages_freed;
                         }
-                        s = next;
                 }
         }
         return npages_freed;
 }
 
-#define KMALLOC_SIZE_MIN_ORDER  (6)
-#define KMALLOC_SIZE_MAX_ORDER  (18)
+/*
+ * kmalloc size classes. Between 64 bytes and one page there is a class
+ * halfway between each pair of powers of two, which keeps the worst case
+ * internal fragmentation for small requests (strings, tty buffers, path
+ * names) at about a third rather than a half. Above one page only powers
+ * of two are provided. kmalloc_allocator_names, kmalloc_small_class and
+ * kmalloc_large_class must be kept consistent with this list.
+ */
+static const size_t kmalloc_sizes[] = {
+        64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072,
+        4096, 8192, 16384, 32768, 65536, 131072, 262144
+};
 
-static struct slab_allocator *kmalloc_allocators[KMALLOC_SIZE_MAX_ORDER - KMALLOC_SIZE_MIN_ORDER + 1];
+#define KMALLOC_NCLASSES        (sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]))
+#define KMALLOC_MAX_SIZE        (262144)
 
-/* Note that kmem_cache_names should be modified to remain consistent
- * with KMALLOC_SIZE_MIN_ORDER ... KMALLOC_SIZE_MAX_ORDER.
- */
 static const char *kmalloc_allocator_names[] = {
         "size-64",
+        "size-96",
         "size-128",
+        "size-192",
         "size-256",
+        "size-384",
         "size-512",
+        "size-768",
         "size-1024",
+        "size-1536",
         "size-2048",
+        "size-3072",
         "size-4096",
         "size-8192",
         "size-16384",
@@ -402,37 +742,77 @@ static const char *kmalloc_allocator_names[] = {
         "size-262144"
 };
 
+/*
+ * Size to class lookup tables, so that finding the allocator for a
+ * request is a single load. Requests of up to one page are looked up
+ * in 32 byte steps, larger ones in page sized steps.
+ */
+#define KMALLOC_SMALL_SHIFT     5
+#define KMALLOC_SMALL_MAX       PAGE_SIZE
+#define KMALLOC_LARGE_SHIFT     PAGE_SHIFT
+
+static const uint8_t kmalloc_small_class[(KMALLOC_SMALL_MAX >> KMALLOC_SMALL_SHIFT) + 1] = {
+         0,  0,  0,  1,  2,  3,  3,  4,  4,  5,  5,  5,  5,  6,  6,  6,
+         6,  7,  7,  7,  7,  7,  7,  7,  7,  8,  8,  8,  8,  8,  8,  8,
+         8,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,  9,
+         9, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+        10, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+        11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+        11, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+        12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12, 12,
+        12
+};
+
+static const uint8_t kmalloc_large_class[(KMALLOC_MAX_SIZE >> KMALLOC_LARGE_SHIFT) + 1] = {
+         0, 12, 13, 14, 14, 15, 15, 15, 15, 16, 16, 16, 16, 16, 16, 16,
+        16, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17, 17,
+        17, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
+        18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
+        18
+};
+
+static struct slab_allocator *kmalloc_allocators[KMALLOC_NCLASSES];
+
+/* Running totals of bytes asked of kmalloc and bytes it handed out,
+ * reported by slab_allocators_info as internal fragmentation. */
+static uint32_t kmalloc_requested_bytes;
+static uint32_t kmalloc_allocated_bytes;
+
+static inline int
+_kmalloc_class(size_t size)
+{
+        if (size <= KMALLOC_SMALL_MAX)
+                return kmalloc_small_class[(size + (1 << KMALLOC_SMALL_SHIFT) - 1)
+                                           >> KMALLOC_SMALL_SHIFT];
+        else
+                return kmalloc_large_class[(size + (1 << KMALLOC_LARGE_SHIFT) - 1)
+                                           >> KMALLOC_LARGE_SHIFT];
+}
+
 void *
 kmalloc(size_t size)
 {
-        int order;
-        struct slab_allocator **cs;
+        int class;
         void *addr;
 
-        size += sizeof(struct slab_allocator *);
+        if (size > KMALLOC_MAX_SIZE)
+                panic("size bigger than maxorder %ld\n", (unsigned long) size);
 
-        /*
-         * Find the first power of two bucket bigger than the
-         * requested size, and allocate from it.
-         */
-        cs = kmalloc_allocators;
-        for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
-                if ((size_t)(1 << order) >= size) {
-                        addr = slab_obj_alloc(*cs);
-                        if (!addr) {
-                                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
-                                return NULL;
-                        }
+        class = _kmalloc_class(size);
+        KASSERT(kmalloc_sizes[class] >= size);
+
+        addr = slab_obj_alloc(kmalloc_allocators[class]);
+        if (!addr) {
+                dbg(DBG_MM, "WARNING: kmalloc out of memory\n");
+                return NULL;
+        }
 #ifdef MM_POISON
-                        memset(addr, MM_POISON_ALLOC, size);
+        memset(addr, MM_POISON_ALLOC, size);
 #endif /* MM_POISON */
-                        *((struct slab_allocator **)addr) = *cs;
-                        return (void *)(((struct slab_allocator **)addr) + 1);
-                }
-        }
 
-        panic("size bigger than maxorder %ld\n", (unsigned long) size);
-        return NULL;
+        kmalloc_requested_bytes += size;
+        kmalloc_allocated_bytes += kmalloc_sizes[class];
+        return addr;
 }
 
 __attribute__((used)) static void *
@@ -447,8 +827,10 @@ malloc(size_t size)
 void
 kfree(void *addr)
 {
-        addr = (void *)(((struct slab_allocator **)addr) - 1);
-        struct slab_allocator *sa = *(struct slab_allocator **)addr;
+        /* There is no header, the page the object lives in knows which
+         * allocator it belongs to. */
+        struct slab_allocator *sa = page_owner(addr);
+        KASSERT(NULL != sa && "kfree of address not from kmalloc");
 
 #ifdef MM_POISON
         /* If poisoning is enabled, wipe the memory given in
@@ -473,22 +855,61 @@ free(void *addr)
         kfree(addr);
 }
 
+/*
+ * Debugging information about the magazine layer of every allocator:
+ * magazine size, depot occupancy and the percentage of allocations and
+ * frees which never had to touch a slab. Also reports how much of what
+ * kmalloc has handed out was lost to rounding up to a size class.
+ */
+size_t
+slab_allocators_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+        struct slab_allocator *a;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "%-16s %7s %4s %5s %5s %10s %4s %10s %4s\n",
+                "NAME", "OBJSIZE", "MAG", "FULL", "EMPTY",
+                "ALLOCS", "HIT%", "FREES", "HIT%");
+
+        for (a = slab_allocators; NULL != a; a = a->sa_next) {
+                uint32_t allocs = a->sa_alloc_hits + a->sa_alloc_misses;
+                uint32_t frees = a->sa_free_hits + a->sa_free_misses;
+
+                iprintf(&buf, &size, "%-16s %7u %4d %5d %5d %10u %3u%% %10u %3u%%\n",
+                        a->sa_name, a->sa_objsize, a->sa_mag_size,
+                        a->sa_depot_nfull, a->sa_depot_nempty,
+                        allocs, allocs ? (a->sa_alloc_hits * 100) / allocs : 0,
+                        frees, frees ? (a->sa_free_hits * 100) / frees : 0);
+        }
+
+        iprintf(&buf, &size, "kmalloc: %u bytes requested, %u bytes allocated, "
+                "%u%% internal fragmentation\n",
+                kmalloc_requested_bytes, kmalloc_allocated_bytes,
+                (kmalloc_allocated_bytes >= 100)
+                ? (kmalloc_allocated_bytes - kmalloc_requested_bytes)
+                / (kmalloc_allocated_bytes / 100) : 0);
+
+        return size;
+}
+
 void
 slab_init()
 {
-        int order;
-        struct slab_allocator **cs;
+        unsigned int class;
 
         /* Special case initialization of the kmem_cache_t cache. */
-        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator));
+        _allocator_init(&slab_allocator_allocator, "slab_allocators", sizeof(struct slab_allocator), 0);
+        _allocator_init(&slab_magazine_allocator, "slab_magazines", sizeof(struct slab_magazine), 0);
 
         /*
-         * Allocate the power of two buckets for generic
+         * Allocate the size class buckets for generic
          * kmalloc/kfree.
          */
-        cs = kmalloc_allocators;
-        for (order = KMALLOC_SIZE_MIN_ORDER; order <= KMALLOC_SIZE_MAX_ORDER; order++, cs++) {
-                if (NULL == (*cs = slab_allocator_create(kmalloc_allocator_names[order - KMALLOC_SIZE_MIN_ORDER], (1 << order)))) {
+        for (class = 0; class < KMALLOC_NCLASSES; class++) {
+                if (NULL == (kmalloc_allocators[class] = slab_allocator_create(kmalloc_allocator_names[class], kmalloc_sizes[class]))) {
                         panic("Couldn't create kmalloc allocators!\n");
                 }
         }
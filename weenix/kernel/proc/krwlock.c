@@ -0,0 +1,74 @@
+#include "globals.h"
+
+#include "util/debug.h"
+
+#include "proc/kthread.h"
+#include "proc/krwlock.h"
+
+/*
+ * Like mutexes, readers-writer locks are only ever locked or unlocked
+ * from a thread context.
+ *
+ * The lock is handed over on unlock: a thread woken up from one of the
+ * wait queues already holds the lock, so it never has to check again.
+ */
+
+void
+krwlock_init(krwlock_t *rw)
+{
+        sched_queue_init(&rw->krw_rdq);
+        sched_queue_init(&rw->krw_wrq);
+        rw->krw_readers = 0;
+        rw->krw_writer = NULL;
+}
+
+void
+krwlock_read_lock(krwlock_t *rw)
+{
+        KASSERT(curthr && (curthr != rw->krw_writer));
+
+        if (NULL != rw->krw_writer || !sched_queue_empty(&rw->krw_wrq)) {
+                /* counted among the readers by whoever wakes us */
+                sched_sleep_on(&rw->krw_rdq);
+                KASSERT(NULL == rw->krw_writer && 0 < rw->krw_readers);
+                return;
+        }
+        rw->krw_readers++;
+}
+
+void
+krwlock_write_lock(krwlock_t *rw)
+{
+        KASSERT(curthr && (curthr != rw->krw_writer));
+
+        if (NULL != rw->krw_writer || 0 < rw->krw_readers) {
+                sched_sleep_on(&rw->krw_wrq);
+                KASSERT(curthr == rw->krw_writer);
+                return;
+        }
+        rw->krw_writer = curthr;
+}
+
+void
+krwlock_read_unlock(krwlock_t *rw)
+{
+        KASSERT(curthr && (NULL == rw->krw_writer) && (0 < rw->krw_readers));
+
+        if (0 == --rw->krw_readers && !sched_queue_empty(&rw->krw_wrq))
+                rw->krw_writer = sched_wakeup_on(&rw->krw_wrq);
+}
+
+void
+krwlock_write_unlock(krwlock_t *rw)
+{
+        KASSERT(curthr && (curthr == rw->krw_writer));
+
+        rw->krw_writer = NULL;
+        if (!sched_queue_empty(&rw->krw_rdq)) {
+                /* let in every reader which waited for us */
+                rw->krw_readers = rw->krw_rdq.tq_size;
+                sched_broadcast_on(&rw->krw_rdq);
+        } else if (!sched_queue_empty(&rw->krw_wrq)) {
+                rw->krw_writer = sched_wakeup_on(&rw->krw_wrq);
+        }
+}
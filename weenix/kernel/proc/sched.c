@@ -21,6 +21,8 @@ The most difficult of these functions to get correct is sched_switch, although w
 #include "proc/sched.h"
 #include "proc/kthread.h"
 
+#include "mm/page.h"
+
 #include "util/init.h"
 #include "util/debug.h"
 
@@ -268,8 +270,12 @@ sched_switch(void)
                 }
                 */
                 dbg(DBG_CORE,"Run queue is empty\n");
+                /* Nothing to run, so zero a free page for later
+                 * page_alloc_zeroed calls. Only sleep until the next
+                 * interrupt once there is nothing left to zero. */
                 intr_setipl(IPL_LOW);
-                intr_wait();
+                if (!page_zero_idle())
+                        intr_wait();
                 intr_setipl(IPL_HIGH); 
                 new=ktqueue_dequeue(&kt_runq);
         }
@@ -5,15 +5,27 @@
 #include "priv.h"
 
 #ifdef __VFS__
+#include "fs/dcache.h"
 #include "fs/fcntl.h"
 #include "fs/file.h"
+#include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
 #endif
 
+#include "drivers/blockdev.h"
+#include "drivers/dev.h"
+
+#include "main/cpuid.h"
+
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
 #include "test/kshell/io.h"
 
 #include "util/debug.h"
+#include "util/printf.h"
 #include "util/string.h"
 
 int kshell_help(kshell_t *ksh, int argc, char **argv)
@@ -60,6 +72,197 @@ int kshell_echo(kshell_t *ksh, int argc, char **argv)
         return 0;
 }
 
+/*
+ * Runs one of the kernel's *_info debugging functions into a scratch
+ * page and writes the result to the shell.
+ */
+static int kshell_print_info(kshell_t *ksh,
+                             size_t (*info)(const void *, char *, size_t),
+                             const void *arg)
+{
+        char *buf;
+        size_t left;
+        int ret;
+
+        if (NULL == (buf = (char *)page_alloc())) {
+                kprintf(ksh, "Out of memory\n");
+                return -ENOMEM;
+        }
+
+        left = info(arg, buf, PAGE_SIZE);
+        ret = kshell_write_all(ksh, buf, PAGE_SIZE - left);
+
+        page_free(buf);
+        return ret < 0 ? ret : 0;
+}
+
+int kshell_slabstat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: slabstat\n");
+                return 0;
+        }
+
+        return kshell_print_info(ksh, slab_allocators_info, NULL);
+}
+
+int kshell_pagestat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: pagestat\n");
+                return 0;
+        }
+
+        return kshell_print_info(ksh, page_info, NULL);
+}
+
+int kshell_pfhashstat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: pfhashstat\n");
+                return 0;
+        }
+
+        return kshell_print_info(ksh, pframe_hash_info, NULL);
+}
+
+int kshell_iostat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: iostat\n");
+                return 0;
+        }
+
+        return kshell_print_info(ksh, blockdev_info, NULL);
+}
+
+int kshell_pfhashbench(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        int nframes = 1024, niters = 100;
+        uint32_t cycles, visited;
+
+        if (argc > 3
+            || (argc > 1 && 1 != sscanf(argv[1], "%d", &nframes))
+            || (argc > 2 && 1 != sscanf(argv[2], "%d", &niters))
+            || nframes < 0 || niters <= 0) {
+                kprintf(ksh, "Usage: pfhashbench [nframes [iterations]]\n");
+                return 0;
+        }
+
+        if (0 == (cycles = pframe_hash_bench(nframes, niters, &visited))) {
+                kprintf(ksh, "pfhashbench: out of memory\n");
+                return -ENOMEM;
+        }
+
+        kprintf(ksh, "walked %u pframes in %u cycles (%u cycles/pframe)\n",
+                visited, cycles, visited ? cycles / visited : 0);
+        return 0;
+}
+
+/*
+ * Reads the same range of blocks of disk0 with a command per block and
+ * scattered over separate pages with read_blockv, which the disk driver
+ * turns into as few commands as it can. Whichever pass runs second finds
+ * the blocks in the drive's cache, so the passes alternate which goes
+ * first over several rounds, and the totals are reported.
+ */
+#define DISKBENCH_MAX_BLOCKS 256
+
+static int
+diskbench_single(blockdev_t *bd, char **bufs, int start, int nblocks,
+                 uint64_t *cycles)
+{
+        uint64_t t0 = rdtsc();
+        int j, ret = 0;
+
+        for (j = 0; j < nblocks && 0 <= ret; j++)
+                ret = bd->bd_ops->read_block(bd, bufs[j], start + j, 1);
+        *cycles += rdtsc() - t0;
+        return ret;
+}
+
+static int
+diskbench_scattered(blockdev_t *bd, char **bufs, int start, int nblocks,
+                    uint64_t *cycles)
+{
+        uint64_t t0 = rdtsc();
+        int ret;
+
+        ret = bd->bd_ops->read_blockv(bd, bufs, start, nblocks);
+        *cycles += rdtsc() - t0;
+        return ret;
+}
+
+int kshell_diskbench(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        int nblocks = 32, start = 0, rounds = 4, i, r, ret = 0;
+        char *bufs[DISKBENCH_MAX_BLOCKS];
+        blockdev_t *bd;
+        uint64_t single = 0, scattered = 0;
+
+        if (argc > 4
+            || (argc > 1 && 1 != sscanf(argv[1], "%d", &nblocks))
+            || (argc > 2 && 1 != sscanf(argv[2], "%d", &start))
+            || (argc > 3 && 1 != sscanf(argv[3], "%d", &rounds))
+            || nblocks <= 0 || nblocks > DISKBENCH_MAX_BLOCKS || start < 0
+            || rounds <= 0) {
+                kprintf(ksh, "Usage: diskbench [nblocks (at most %d) [first block [rounds]]]\n",
+                        DISKBENCH_MAX_BLOCKS);
+                return 0;
+        }
+        if (NULL == (bd = blockdev_lookup(MKDEVID(DISK_MAJOR, 0)))
+            || NULL == bd->bd_ops->read_blockv) {
+                kprintf(ksh, "diskbench: no disk0, or it cannot scatter reads\n");
+                return -ENODEV;
+        }
+
+        for (i = 0; i < nblocks; i++) {
+                if (NULL == (bufs[i] = page_alloc())) {
+                        kprintf(ksh, "diskbench: out of memory\n");
+                        ret = -ENOMEM;
+                        goto out;
+                }
+        }
+
+        for (r = 0; r < rounds && 0 <= ret; r++) {
+                if (r & 1) {
+                        ret = diskbench_scattered(bd, bufs, start, nblocks, &scattered);
+                        if (0 <= ret)
+                                ret = diskbench_single(bd, bufs, start, nblocks, &single);
+                } else {
+                        ret = diskbench_single(bd, bufs, start, nblocks, &single);
+                        if (0 <= ret)
+                                ret = diskbench_scattered(bd, bufs, start, nblocks, &scattered);
+                }
+        }
+
+        if (0 > ret) {
+                kprintf(ksh, "diskbench: read failed: %d\n", ret);
+        } else {
+                kprintf(ksh, "%d blocks from block %d, %d rounds, in Kcycles:\n",
+                        nblocks, start, rounds);
+                kprintf(ksh, "  one block per read: %u\n", (uint32_t)(single >> 10));
+                kprintf(ksh, "  scattered reads:    %u\n", (uint32_t)(scattered >> 10));
+        }
+
+out:
+        while (--i >= 0)
+                page_free(bufs[i]);
+        return ret;
+}
+
 #ifdef __VFS__
 int kshell_cat(kshell_t *ksh, int argc, char **argv)
 {
@@ -320,4 +523,55 @@ int kshell_stat(kshell_t *ksh, int argc, char **argv)
 
         return exit_val;
 }
+
+/*
+ * Resolves a path over and over through open_namev(), the way open() and
+ * stat() do, and reports the cost of each resolution.
+ */
+int kshell_namevbench(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        int niters = 1000, i, ret = 0;
+        uint64_t t0, t1;
+        uint32_t kcycles;
+        vnode_t *vn;
+
+        if (argc < 2 || argc > 3
+            || (argc > 2 && 1 != sscanf(argv[2], "%d", &niters))
+            || niters <= 0) {
+                kprintf(ksh, "Usage: namevbench <path> [iterations]\n");
+                return 0;
+        }
+
+        t0 = rdtsc();
+        for (i = 0; i < niters && 0 == ret; i++) {
+                if (0 == (ret = open_namev(argv[1], 0, &vn, NULL)))
+                        vput(vn);
+        }
+        t1 = rdtsc();
+
+        if (0 != ret) {
+                kprintf(ksh, "namevbench: %s: %d\n", argv[1], ret);
+                return ret;
+        }
+        kcycles = (uint32_t)((t1 - t0) >> 10);
+        kprintf(ksh, "%d resolutions of %s in %u Kcycles (%u cycles each)\n",
+                niters, argv[1], kcycles,
+                (kcycles < (1U << 22)) ? (kcycles << 10) / niters
+                                       : (kcycles / niters) << 10);
+        return 0;
+}
+
+int kshell_dcachestat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+
+        if (argc != 1) {
+                kprintf(ksh, "Usage: dcachestat\n");
+                return 0;
+        }
+
+        return kshell_print_info(ksh, dcache_info, NULL);
+}
 #endif
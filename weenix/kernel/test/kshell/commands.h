@@ -8,6 +8,12 @@
 KSHELL_CMD(help);
 KSHELL_CMD(exit);
 KSHELL_CMD(echo);
+KSHELL_CMD(slabstat);
+KSHELL_CMD(pfhashbench);
+KSHELL_CMD(pfhashstat);
+KSHELL_CMD(pagestat);
+KSHELL_CMD(diskbench);
+KSHELL_CMD(iostat);
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -17,4 +23,6 @@ KSHELL_CMD(link);
 KSHELL_CMD(rmdir);
 KSHELL_CMD(mkdir);
 KSHELL_CMD(stat);
+KSHELL_CMD(namevbench);
+KSHELL_CMD(dcachestat);
 #endif
@@ -34,6 +34,18 @@ static __attribute__((unused)) void kshell_init()
         kshell_add_command("help", kshell_help,
                            "prints a list of available commands");
         kshell_add_command("echo", kshell_echo, "display a line of text");
+        kshell_add_command("slabstat", kshell_slabstat,
+                           "display slab allocator magazine statistics");
+        kshell_add_command("pfhashbench", kshell_pfhashbench,
+                           "time walks of the pframe hash chains");
+        kshell_add_command("pfhashstat", kshell_pfhashstat,
+                           "display pframe hash chain lengths");
+        kshell_add_command("pagestat", kshell_pagestat,
+                           "display page allocator statistics");
+        kshell_add_command("diskbench", kshell_diskbench,
+                           "time per-block against scattered disk reads");
+        kshell_add_command("iostat", kshell_iostat,
+                           "display block device I/O statistics");
 #ifdef __VFS__
         kshell_add_command("cat", kshell_cat,
                            "concatenate files and print on the standard output");
@@ -46,6 +58,10 @@ static __attribute__((unused)) void kshell_init()
                            "remove empty directories");
         kshell_add_command("mkdir", kshell_mkdir, "make directories");
         kshell_add_command("stat", kshell_stat, "display file status");
+        kshell_add_command("namevbench", kshell_namevbench,
+                           "time repeated resolutions of a path");
+        kshell_add_command("dcachestat", kshell_dcachestat,
+                           "display directory name cache statistics");
 #endif
 
         kshell_add_command("exit", kshell_exit, "exits the shell");
@@ -0,0 +1,199 @@
+#include "kernel.h"
+#include "errno.h"
+
+#include "mm/slab.h"
+
+#include "util/debug.h"
+#include "util/radix.h"
+#include "util/string.h"
+
+typedef struct radix_node {
+        void               *rn_slots[RADIX_SLOTS];
+        int                 rn_count;     /* number of non-NULL slots */
+} radix_node_t;
+
+/* Index of key in a node at the given height (leaves have height 1) */
+#define RADIX_INDEX(key, height) \
+        (((key) >> (RADIX_SHIFT * ((height) - 1))) & (RADIX_SLOTS - 1))
+
+/* Largest key which fits in a tree of the given height */
+#define RADIX_MAXKEY(height) \
+        ((RADIX_SHIFT * (height) >= 32) ? 0xffffffffU \
+         : (1U << (RADIX_SHIFT * (height))) - 1)
+
+static slab_allocator_t *radix_node_allocator = NULL;
+
+static radix_node_t *
+_radix_node_alloc(void)
+{
+        radix_node_t *node;
+
+        /* Created on first use, since trees may be populated before
+         * the init functions run. */
+        if (NULL == radix_node_allocator) {
+                radix_node_allocator = slab_allocator_create("radix_node",
+                                                             sizeof(radix_node_t));
+                KASSERT(NULL != radix_node_allocator);
+        }
+
+        if (NULL != (node = slab_obj_alloc(radix_node_allocator)))
+                memset(node, 0, sizeof(*node));
+        return node;
+}
+
+void
+radix_tree_init(radix_tree_t *rt)
+{
+        rt->rt_root = NULL;
+        rt->rt_height = 0;
+}
+
+static int
+_radix_insert(radix_node_t **slot, int height, uint32_t key, void *item)
+{
+        radix_node_t *node = *slot;
+        int idx = RADIX_INDEX(key, height);
+        int ret = 0;
+
+        if (NULL == node && NULL == (node = _radix_node_alloc()))
+                return -ENOMEM;
+
+        if (1 == height) {
+                KASSERT(NULL == node->rn_slots[idx] && "key already in radix tree");
+                node->rn_slots[idx] = item;
+                node->rn_count++;
+        } else {
+                int fresh = (NULL == node->rn_slots[idx]);
+                ret = _radix_insert((radix_node_t **)&node->rn_slots[idx],
+                                    height - 1, key, item);
+                if (0 == ret && fresh)
+                        node->rn_count++;
+        }
+
+        if (0 == node->rn_count) {
+                /* we just allocated it and the insertion failed */
+                KASSERT(0 > ret);
+                slab_obj_free(radix_node_allocator, node);
+        } else {
+                *slot = node;
+        }
+        return ret;
+}
+
+int
+radix_tree_insert(radix_tree_t *rt, uint32_t key, void *item)
+{
+        KASSERT(NULL != item);
+
+        if (NULL == rt->rt_root) {
+                rt->rt_height = 1;
+                while (key > RADIX_MAXKEY(rt->rt_height))
+                        rt->rt_height++;
+        }
+
+        /* Make the tree tall enough for key by adding new roots above
+         * the current one. */
+        while (key > RADIX_MAXKEY(rt->rt_height)) {
+                radix_node_t *root = _radix_node_alloc();
+                if (NULL == root)
+                        return -ENOMEM;
+                root->rn_slots[0] = rt->rt_root;
+                root->rn_count = 1;
+                rt->rt_root = root;
+                rt->rt_height++;
+        }
+
+        return _radix_insert(&rt->rt_root, rt->rt_height, key, item);
+}
+
+void *
+radix_tree_lookup(radix_tree_t *rt, uint32_t key)
+{
+        radix_node_t *node = rt->rt_root;
+        int height = rt->rt_height;
+
+        if (NULL == node || key > RADIX_MAXKEY(height))
+                return NULL;
+
+        while (height > 1) {
+                if (NULL == (node = node->rn_slots[RADIX_INDEX(key, height)]))
+                        return NULL;
+                height--;
+        }
+        return node->rn_slots[RADIX_INDEX(key, 1)];
+}
+
+static void *
+_radix_remove(radix_node_t **slot, int height, uint32_t key)
+{
+        radix_node_t *node = *slot;
+        int idx = RADIX_INDEX(key, height);
+        void *item;
+
+        if (NULL == node)
+                return NULL;
+
+        if (1 == height) {
+                if (NULL != (item = node->rn_slots[idx])) {
+                        node->rn_slots[idx] = NULL;
+                        node->rn_count--;
+                }
+        } else {
+                item = _radix_remove((radix_node_t **)&node->rn_slots[idx],
+                                     height - 1, key);
+                if (NULL != item && NULL == node->rn_slots[idx])
+                        node->rn_count--;
+        }
+
+        if (0 == node->rn_count) {
+                slab_obj_free(radix_node_allocator, node);
+                *slot = NULL;
+        }
+        return item;
+}
+
+void *
+radix_tree_remove(radix_tree_t *rt, uint32_t key)
+{
+        void *item;
+
+        if (NULL == rt->rt_root || key > RADIX_MAXKEY(rt->rt_height))
+                return NULL;
+
+        item = _radix_remove(&rt->rt_root, rt->rt_height, key);
+        if (NULL == rt->rt_root)
+                rt->rt_height = 0;
+        return item;
+}
+
+/* base is the smallest key covered by node */
+static int
+_radix_gang_lookup(radix_node_t *node, int height, uint32_t base,
+                   uint32_t first, void **items, int max)
+{
+        int shift = RADIX_SHIFT * (height - 1);
+        uint32_t idx;
+        int n = 0;
+
+        idx = (first > base) ? ((first - base) >> shift) : 0;
+        for (; idx < RADIX_SLOTS && n < max; idx++) {
+                void *slot = node->rn_slots[idx];
+                if (NULL == slot)
+                        continue;
+                if (1 == height)
+                        items[n++] = slot;
+                else
+                        n += _radix_gang_lookup(slot, height - 1, base + (idx << shift),
+                                                first, items + n, max - n);
+        }
+        return n;
+}
+
+int
+radix_tree_gang_lookup(radix_tree_t *rt, uint32_t first, void **items, int max)
+{
+        if (NULL == rt->rt_root || first > RADIX_MAXKEY(rt->rt_height) || max <= 0)
+                return 0;
+
+        return _radix_gang_lookup(rt->rt_root, rt->rt_height, 0, first, items, max);
+}
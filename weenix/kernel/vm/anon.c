@@ -91,10 +91,17 @@ anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 
 /* The following three functions should not be difficult. */
 
+/* Anonymous pages start out zeroed; pframe_fill_zeroes takes a page
+ * zeroed by the idle loop when it can. They are pinned since they
+ * have no backing store. */
 static int
 anon_fillpage(mmobj_t *o, pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("VM: anon_fillpage");
+        KASSERT(pframe_is_busy(pf));
+        KASSERT(!pframe_is_pinned(pf));
+
+        pframe_fill_zeroes(pf);
+        pframe_pin(pf);
         return 0;
 }
 
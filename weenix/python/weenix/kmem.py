@@ -22,7 +22,8 @@ class Slab:
 			self._value = val.cast(_slab_type)
 
 	def objs(self, typ=None):
-		next = self._value["s_addr"]
+		next = (self._value["s_addr"].cast(_uintptr_type)
+				+ self._value["s_color"]).cast(_void_type.pointer())
 		for i in xrange(self._alloc["sa_slab_nobjs"]):
 			bufctl = (next.cast(_uintptr_type)
 					  + self._alloc["sa_objsize"]).cast(_bufctl_type.pointer())
@@ -56,11 +57,19 @@ class SlabAllocator:
 	def size(self):
 		return int(self._value["sa_objsize"])
 
-	def slabs(self):
-		next = self._value["sa_slabs"]
-		while (next != 0):
-			yield Slab(self._value, next.dereference())
-			next = next.dereference()["s_next"]
+	def slabs(self, lists=("sa_full", "sa_partial", "sa_empty")):
+		for name in lists:
+			for link in weenix.list.load(self._value[name], "struct slab", "s_link"):
+				yield Slab(self._value, link.item())
+
+	def full_slabs(self):
+		return self.slabs(("sa_full",))
+
+	def partial_slabs(self):
+		return self.slabs(("sa_partial",))
+
+	def empty_slabs(self):
+		return self.slabs(("sa_empty",))
 
 	def objs(self, typ=None):
 		for slab in self.slabs():
@@ -69,7 +78,9 @@ class SlabAllocator:
 
 	def __str__(self):
 		res =  "name:      {0}\n".format(self.name())
-		res += "slabcount: {0}\n".format(len(list(self.slabs())))
+		res += "slabcount: {0} ({1} full, {2} partial, {3} empty)\n".format(
+			len(list(self.slabs())), len(list(self.full_slabs())),
+			len(list(self.partial_slabs())), len(list(self.empty_slabs())))
 		res += "objsize:   {0}\n".format(self.size())
 		res += "objcount:  {0}".format(len(list(self.objs())))
 		return res
@@ -100,4 +111,6 @@ def freepages():
 				freepages[order] += count
 			else:
 				freepages[order] = count
+	# pre-zeroed pages are kept apart from the buddy freelists, one page each
+	freepages[0] = freepages.get(0, 0) + len(weenix.list.load("page_zeroed_list"))
 	return freepages
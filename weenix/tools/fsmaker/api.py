@@ -3,18 +3,22 @@ import math
 import struct
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 5
 S5_BLOCK_SIZE = 4096
+S5_BITS_PER_BLOCK = S5_BLOCK_SIZE * 8
 
 S5_NBLKS_PER_FNODE = 30
-S5_NDIRECT_BLOCKS = 28
-S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
-S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
+S5_NDIRECT_BLOCKS = 26
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE // 4
+S5_INDIRECT_LEVELS = 3
+S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + sum(S5_NIDIRECT_BLOCKS ** l for l in range(1, S5_INDIRECT_LEVELS + 1))
+# the kernel's file offsets are signed 32-bit
+S5_MAX_FILE_SIZE = min(S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE, 2 ** 31 - 1)
 
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
 
-S5_INODE_SIZE = 16 + S5_NDIRECT_BLOCKS * 4
+S5_INODE_SIZE = 12 + (S5_NDIRECT_BLOCKS + S5_INDIRECT_LEVELS) * 4
 S5_INODES_PER_BLOCK = S5_BLOCK_SIZE / S5_INODE_SIZE
 
 S5_TYPE_FREE = 0x0
@@ -24,6 +28,30 @@ S5_TYPE_CHR = 0x4
 S5_TYPE_BLK = 0x8
 S5_TYPES = set([ S5_TYPE_FREE, S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_CHR, S5_TYPE_BLK ])
 
+S5_INODE_EXTENTS = 0x1
+S5_INODE_HASHED = 0x2
+
+# an extent tree node is a header (depth, count) followed by its extents
+# (lblock, pblock, len); the root takes the place of the block pointers
+S5_EXTENT_HEADER_SIZE = 4
+S5_EXTENT_SIZE = 12
+S5_INODE_NEXTENTS = ((S5_NDIRECT_BLOCKS + S5_INDIRECT_LEVELS) * 4 - S5_EXTENT_HEADER_SIZE) // S5_EXTENT_SIZE
+S5_BLOCK_NEXTENTS = (S5_BLOCK_SIZE - S5_EXTENT_HEADER_SIZE) // S5_EXTENT_SIZE
+
+# hashed directories: block 0 is the index root (count, dirents, then
+# (hash, block) entries), the other blocks are leaves (count, then
+# (inode, hash, name) entries sorted by hash)
+S5_HDIRENT_SIZE = S5_NAME_LEN + 8
+S5_DX_ROOT_ENTRIES = (S5_BLOCK_SIZE - 8) // 8
+S5_DX_LEAF_ENTRIES = (S5_BLOCK_SIZE - 4) // S5_HDIRENT_SIZE
+
+def s5_name_hash(name):
+    # FNV-1a, as in the kernel
+    h = 2166136261
+    for c in name:
+        h = ((h ^ ord(c)) * 16777619) & 0xffffffff
+    return h
+
 class S5fsException(Exception):
 
     def __init__(self, msg):
@@ -68,15 +96,11 @@ class Block:
             self._simdisk._simfile.write('\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
-            self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
-            self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
-        else:
-            for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                self.write(i * 4, struct.pack("I", self._simdisk.get_free_block(i)))
-            self.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self._simdisk.get_last_free_block()))
-            self._simdisk.set_last_free_block(self._blockno)
-            self._simdisk.set_nfree(0)
+        if (self._blockno < self._simdisk.get_first_data_block() or self._blockno >= self._simdisk.get_num_blocks()):
+            raise S5fsException("cannot free block {0}, it is not a data block".format(self._blockno))
+        if (not self._simdisk.get_block_used(self._blockno)):
+            raise S5fsException("cannot free block {0}, it is already free".format(self._blockno))
+        self._simdisk.set_block_used(self._blockno, False)
 
 class Dirent:
     
@@ -87,7 +111,7 @@ class Dirent:
         self._offset = offset
 
     def remove(self):
-        self._parent.write(self._offset + 4, '\0')
+        self._parent._remove_dirent(self._offset)
 
 class Inode:
 
@@ -121,11 +145,103 @@ class Inode:
 
     def get_type(self):
         self._simfile.seek(int(self._offset + 8))
-        return struct.unpack("H", self._simfile.read(2))[0]
+        return struct.unpack("B", self._simfile.read(1))[0]
 
     def set_type(self, val):
         self._simfile.seek(int(self._offset + 8))
-        self._simfile.write(struct.pack("H", val))
+        self._simfile.write(struct.pack("B", val))
+
+    def get_flags(self):
+        self._simfile.seek(int(self._offset + 9))
+        return struct.unpack("B", self._simfile.read(1))[0]
+
+    def set_flags(self, val):
+        self._simfile.seek(int(self._offset + 9))
+        self._simfile.write(struct.pack("B", val))
+
+    def is_hashed(self):
+        return (self.get_flags() & S5_INODE_HASHED) != 0
+
+    def _dx_read_root(self):
+        raw = self.read(0, S5_BLOCK_SIZE)
+        count, dirents = struct.unpack("II", raw[:8])
+        index = [struct.unpack("II", raw[8 + i * 8:16 + i * 8]) for i in xrange(count)]
+        return (dirents, index)
+
+    def _dx_write_root(self, dirents, index):
+        raw = struct.pack("II", len(index), dirents)
+        for (h, blockloc) in index:
+            raw += struct.pack("II", h, blockloc)
+        self.write(0, raw.ljust(S5_BLOCK_SIZE, '\0'))
+
+    def _dx_read_leaf(self, blockloc):
+        raw = self.read(blockloc * S5_BLOCK_SIZE, S5_BLOCK_SIZE)
+        entries = []
+        for i in xrange(struct.unpack("I", raw[:4])[0]):
+            off = 4 + i * S5_HDIRENT_SIZE
+            inode, h = struct.unpack("II", raw[off:off + 8])
+            entries.append((inode, h, raw[off + 8:off + S5_HDIRENT_SIZE].split('\0', 1)[0]))
+        return entries
+
+    def _dx_write_leaf(self, blockloc, entries):
+        raw = struct.pack("I", len(entries))
+        for (inode, h, name) in entries:
+            raw += struct.pack("II", inode, h) + name.ljust(S5_NAME_LEN, '\0')
+        self.write(blockloc * S5_BLOCK_SIZE, raw.ljust(S5_BLOCK_SIZE, '\0'))
+
+    def _dx_add(self, inode, name):
+        h = s5_name_hash(name)
+        dirents, index = self._dx_read_root()
+        i = max(j for j in xrange(len(index)) if index[j][0] <= h)
+        entries = self._dx_read_leaf(index[i][1])
+        if (len(entries) == S5_DX_LEAF_ENTRIES):
+            # split near the middle, keeping equal hashes in one leaf
+            splits = [j for j in xrange(1, len(entries)) if entries[j][1] != entries[j - 1][1]]
+            if (len(splits) == 0 or len(index) == S5_DX_ROOT_ENTRIES):
+                raise S5fsException("hashed directory inode {0} is full".format(self._number))
+            split = min(splits, key=lambda j: abs(j - len(entries) // 2))
+            newblock = len(index) + 1
+            self._dx_write_leaf(index[i][1], entries[:split])
+            self._dx_write_leaf(newblock, entries[split:])
+            index.insert(i + 1, (entries[split][1], newblock))
+            if (h >= entries[split][1]):
+                i += 1
+                entries = entries[split:]
+            else:
+                entries = entries[:split]
+        pos = len([e for e in entries if e[1] < h])
+        entries.insert(pos, (inode, h, name))
+        self._dx_write_leaf(index[i][1], entries)
+        self._dx_write_root(dirents + 1, index)
+
+    def _remove_dirent(self, offset):
+        if (self.is_hashed()):
+            blockloc = offset // S5_BLOCK_SIZE
+            entries = self._dx_read_leaf(blockloc)
+            del entries[(offset % S5_BLOCK_SIZE - 4) // S5_HDIRENT_SIZE]
+            self._dx_write_leaf(blockloc, entries)
+            dirents, index = self._dx_read_root()
+            self._dx_write_root(dirents - 1, index)
+        else:
+            self.write(offset + 4, '\0')
+
+    def has_extents(self):
+        return (self.get_flags() & S5_INODE_EXTENTS) != 0
+
+    def _read_extent_node(self, blockno):
+        # returns (depth, [(lblock, pblock, len)...]) for the root when
+        # blockno is None, or for the tree node in block blockno
+        if (blockno == None):
+            self._simfile.seek(int(self._offset + 12))
+            raw = self._simfile.read(S5_EXTENT_HEADER_SIZE + S5_INODE_NEXTENTS * S5_EXTENT_SIZE)
+        else:
+            raw = self._simdisk.get_block(blockno).read(0, S5_BLOCK_SIZE)
+        depth, count = struct.unpack("HH", raw[:S5_EXTENT_HEADER_SIZE])
+        extents = []
+        for i in xrange(count):
+            off = S5_EXTENT_HEADER_SIZE + i * S5_EXTENT_SIZE
+            extents.append(struct.unpack("III", raw[off:off + S5_EXTENT_SIZE]))
+        return (depth, extents)
 
     def get_link_count(self):
         self._simfile.seek(int(self._offset + 10))
@@ -149,12 +265,17 @@ class Inode:
         else:
             raise S5fsException("direct block index {0} greater than max {1}".format(index, S5_NDIRECT_BLOCKS))
 
-    def get_indirect_blockno(self):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+    # level 1 is the single indirect block, 2 the double and 3 the triple
+    def get_indirect_blockno(self, level=1):
+        if (level < 1 or level > S5_INDIRECT_LEVELS):
+            raise S5fsException("indirect block level {0} not between 1 and {1}".format(level, S5_INDIRECT_LEVELS))
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + level - 1)))
         return struct.unpack("I", self._simfile.read(4))[0]
 
-    def set_indirect_blockno(self, val):
-        self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
+    def set_indirect_blockno(self, val, level=1):
+        if (level < 1 or level > S5_INDIRECT_LEVELS):
+            raise S5fsException("indirect block level {0} not between 1 and {1}".format(level, S5_INDIRECT_LEVELS))
+        self._simfile.seek(int(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS + level - 1)))
         self._simfile.write(struct.pack("I", val))
 
     def get_type_str(self, short=False):
@@ -187,14 +308,25 @@ class Inode:
             elif (self.get_type() == S5_TYPE_DIR):
                 res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
             res += "\n"
-            res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
-            for i in xrange(S5_NDIRECT_BLOCKS):
-                res += " {0:5}".format(self.get_direct_blockno(i))
-                if ((i + 1) % 4 == 0):
+            if (self.has_extents()):
+                depth, extents = self._read_extent_node(None)
+                res += "extent tree depth {0}, root entries ({1}):\n".format(depth, len(extents))
+                for e in extents:
+                    if (depth == 0):
+                        res += " blocks {0}-{1} at {2}\n".format(e[0], e[0] + e[2] - 1, e[1])
+                    else:
+                        res += " blocks from {0} in node {1}\n".format(e[0], e[1])
+            else:
+                res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
+                for i in xrange(S5_NDIRECT_BLOCKS):
+                    res += " {0:5}".format(self.get_direct_blockno(i))
+                    if ((i + 1) % 4 == 0):
+                        res += "\n"
+                if (res[-1] != "\n"):
                     res += "\n"
-            if (res[-1] != "\n"):
-                res += "\n"
-            res += "indirect block: {0}\n".format(self.get_indirect_blockno())
+                res += "indirect block: {0}\n".format(self.get_indirect_blockno(1))
+                res += "double indirect block: {0}\n".format(self.get_indirect_blockno(2))
+                res += "triple indirect block: {0}\n".format(self.get_indirect_blockno(3))
         elif (self.get_type() == S5_TYPE_FREE):
             res += "next free: {0}\n".format(self.get_next_free())
         res = res[:-1]
@@ -208,18 +340,9 @@ class Inode:
         size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
         res = ""
         while (size > 0):
-            blockno = math.floor(offset / S5_BLOCK_SIZE)
+            blockno = self._map(offset // S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
             if (blockno == 0):
                 for i in xrange(ammount):
                     res += '\0'
@@ -229,6 +352,83 @@ class Inode:
             size -= ammount
         return res
 
+    def _alloc_zeroed(self, blockloc):
+        block = self._simdisk.alloc_block(self._block_goal(blockloc))
+        block.zero()
+        return block.get_blockno()
+
+    def _map_extent(self, blockloc):
+        blockno = None
+        while (True):
+            depth, extents = self._read_extent_node(blockno)
+            found = None
+            for e in extents:
+                if (e[0] <= blockloc):
+                    found = e
+            if (found == None):
+                return 0
+            if (depth == 0):
+                return found[1] + blockloc - found[0] if blockloc < found[0] + found[2] else 0
+            blockno = found[1]
+
+    def _free_extent_tree(self, blockno):
+        depth, extents = self._read_extent_node(blockno)
+        for e in extents:
+            if (depth == 0):
+                for b in xrange(e[2]):
+                    self._simdisk.get_block(e[1] + b).free()
+            else:
+                self._free_extent_tree(e[1])
+                self._simdisk.get_block(e[1]).free()
+
+    def _map(self, blockloc, alloc=False):
+        # returns the disk block holding block blockloc of the file, or 0 if
+        # it is sparse; with alloc, missing blocks (indirect ones included)
+        # are allocated instead
+        if (self.has_extents()):
+            blockno = self._map_extent(blockloc)
+            if (blockno == 0 and alloc):
+                raise S5fsException("cannot allocate blocks in extent-mapped inode {0}".format(self._number))
+            return blockno
+        if (blockloc < S5_NDIRECT_BLOCKS):
+            blockno = self.get_direct_blockno(blockloc)
+            if (blockno == 0 and alloc):
+                blockno = self._alloc_zeroed(blockloc)
+                self.set_direct_blockno(blockloc, blockno)
+            return blockno
+        # find the tree holding the block, and the block's index in it
+        index = blockloc - S5_NDIRECT_BLOCKS
+        level = 1
+        span = S5_NIDIRECT_BLOCKS
+        while (index >= span):
+            index -= span
+            level += 1
+            span *= S5_NIDIRECT_BLOCKS
+        blockno = self.get_indirect_blockno(level)
+        if (blockno == 0):
+            if (not alloc):
+                return 0
+            blockno = self._alloc_zeroed(blockloc)
+            self.set_indirect_blockno(blockno, level)
+        for depth in xrange(level):
+            span //= S5_NIDIRECT_BLOCKS
+            indirect = self._simdisk.get_block(blockno)
+            slot = (index // span) % S5_NIDIRECT_BLOCKS
+            blockno = struct.unpack("I", indirect.read(slot * 4, 4))[0]
+            if (blockno == 0):
+                if (not alloc):
+                    return 0
+                blockno = self._alloc_zeroed(blockloc)
+                indirect.write(slot * 4, struct.pack("I", blockno))
+        return blockno
+
+    def _block_goal(self, blockloc):
+        # allocate next to the previous block so files stay contiguous
+        if (blockloc == 0):
+            return None
+        prev = self._map(blockloc - 1)
+        return prev + 1 if prev != 0 else None
+
     def write(self, offset, data):
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
@@ -236,30 +436,10 @@ class Inode:
             raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
         remaining = len(data)
         while (remaining > 0):
-            blockloc = math.floor(offset / S5_BLOCK_SIZE)
+            blockloc = offset // S5_BLOCK_SIZE
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
-            else:
-                block = self._simdisk.get_block(blockno)
+            block = self._simdisk.get_block(self._map(blockloc, True))
             if (remaining == ammount):
                 block.write(blockoff, data[-remaining:])
             else:
@@ -270,37 +450,58 @@ class Inode:
             self.set_size(offset)
 
     def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
-        while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
+        # frees every block past the new end of the file
+        keep = (size + S5_BLOCK_SIZE - 1) // S5_BLOCK_SIZE
+        if (self.has_extents()):
+            if (keep < (self.get_size() + S5_BLOCK_SIZE - 1) // S5_BLOCK_SIZE):
+                if (keep != 0):
+                    raise S5fsException("cannot shorten extent-mapped inode {0} other than to 0".format(self._number))
+                self._free_extent_tree(None)
+                self._simfile.seek(int(self._offset + 12))
+                self._simfile.write(struct.pack("HH", 0, 0))
+            self.set_size(size)
+            return
+        for i in xrange(min(keep, S5_NDIRECT_BLOCKS), S5_NDIRECT_BLOCKS):
+            blockno = self.get_direct_blockno(i)
+            if (blockno != 0):
+                self._simdisk.get_block(blockno).free()
+                self.set_direct_blockno(i, 0)
+        first = S5_NDIRECT_BLOCKS
+        span = S5_NIDIRECT_BLOCKS
+        for level in xrange(1, S5_INDIRECT_LEVELS + 1):
+            blockno = self.get_indirect_blockno(level)
+            if (blockno != 0 and keep < first + span and self._truncate_tree(blockno, level, first, span, keep)):
+                self.set_indirect_blockno(0, level)
+            first += span
+            span *= S5_NIDIRECT_BLOCKS
+        self.set_size(size)
+
+    def _truncate_tree(self, blockno, depth, first, span, keep):
+        # frees the blocks from file block keep on in the tree under indirect
+        # block blockno, which maps the span file blocks starting at first;
+        # returns True if nothing was left and blockno was freed as well
+        indirect = self._simdisk.get_block(blockno)
+        entries = struct.unpack("{0}I".format(S5_NIDIRECT_BLOCKS), indirect.read(0, S5_BLOCK_SIZE))
+        sub = span // S5_NIDIRECT_BLOCKS
+        empty = True
+        for i in xrange(S5_NIDIRECT_BLOCKS):
+            if (entries[i] == 0):
+                continue
+            start = first + i * sub
+            if (start + sub <= keep):
+                gone = False
+            elif (depth == 1):
+                self._simdisk.get_block(entries[i]).free()
+                gone = True
             else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
-            curr -= 1
-        while (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_direct_blockno(0)
+                gone = self._truncate_tree(entries[i], depth - 1, start, sub, keep)
+            if (gone):
+                indirect.write(i * 4, struct.pack("I", 0))
             else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-        self.set_size(size)
+                empty = False
+        if (empty):
+            indirect.free()
+        return empty
 
     def _find_dirent(self, name, types=S5_TYPES):
         if (self.get_type() != S5_TYPE_DIR):
@@ -309,6 +510,11 @@ class Inode:
             raise S5fsException("cannot remove directory entry, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
         if (len(name) >= S5_NAME_LEN):
             raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
+        if (self.is_hashed()):
+            for dirent in self.getdents():
+                if (dirent.name == name):
+                    return dirent
+            return None
         for i in xrange(0, self.get_size(), S5_DIRENT_SIZE):
             inode = struct.unpack("I", self.read(i, 4))[0]
             parts = self.read(i + 4, S5_NAME_LEN).split('\0', 1)
@@ -359,6 +565,11 @@ class Inode:
             raise S5fsException("cannot create directory entry, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
         if (len(name) >= S5_NAME_LEN):
             raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
+        if (self.is_hashed()):
+            if (self._find_dirent(name) != None):
+                raise S5fsException("directory already has entry with same name: {0}".format(name))
+            self._dx_add(inode, name)
+            return
         empty = -1
         for i in xrange(0, self.get_size(), S5_DIRENT_SIZE):
             direntname = self.read(i + 4, S5_NAME_LEN).split('\0', 1)[0]
@@ -378,10 +589,12 @@ class Inode:
         try:
             inode.set_type(S5_TYPE_DATA)
             inode.set_size(0)
+            inode.set_flags(0)
             inode.set_link_count(1)
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            for level in xrange(1, S5_INDIRECT_LEVELS + 1):
+                inode.set_indirect_blockno(0, level)
             self._make_dirent(inode.get_number(), name)
             return inode
         except S5fsException as e:
@@ -393,10 +606,12 @@ class Inode:
         try:
             inode.set_type(S5_TYPE_DIR)
             inode.set_size(0)
+            inode.set_flags(0)
             inode.set_link_count(1)
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
-            inode.set_indirect_blockno(0)
+            for level in xrange(1, S5_INDIRECT_LEVELS + 1):
+                inode.set_indirect_blockno(0, level)
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -411,6 +626,11 @@ class Inode:
             raise S5fsException("cannot get dirents from inode of type " + self.get_type_str())
         if (self.get_size() % S5_DIRENT_SIZE != 0):
             raise S5fsException("cannot get dirents, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
+        if (self.is_hashed()):
+            for blockloc in xrange(1, self.get_size() // S5_BLOCK_SIZE):
+                for (i, (inode, h, name)) in enumerate(self._dx_read_leaf(blockloc)):
+                    yield Dirent(self, inode, name, blockloc * S5_BLOCK_SIZE + 4 + i * S5_HDIRENT_SIZE)
+            return
         for i in xrange(0, self.get_size(), S5_DIRENT_SIZE):
             inode = struct.unpack("I", self.read(i, 4))[0]
             name = self.read(i + 4, S5_NAME_LEN)
@@ -462,6 +682,7 @@ class Inode:
         if (self.get_size() != 0):
             self.truncate()
         self.set_type(S5_TYPE_FREE)
+        self.set_flags(0)
         self.set_next_free(self._simdisk.get_free_inode())
         self._simdisk.set_free_inode(self._number)
 
@@ -486,36 +707,6 @@ class Simdisk:
         self._simfile.seek(4)
         self._simfile.write(struct.pack("I", val))
 
-    def get_nfree(self):
-        self._simfile.seek(8)
-        return struct.unpack("I", self._simfile.read(4))[0]
-
-    def set_nfree(self, val):
-        self._simfile.seek(8)
-        self._simfile.write(struct.pack("I", val))
-
-    def get_free_block(self, index):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            return struct.unpack("I", self._simfile.read(4))[0]
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
-
-    def set_free_block(self, index, val):
-        if (index < S5_NBLKS_PER_FNODE - 1):
-            self._simfile.seek(12 + 4 * index)
-            self._simfile.write(struct.pack("I", val))
-        else:
-            raise S5fsException("free block index {0} greater than max {1}".format(index, S5_NBLKS_PER_FNODE - 2))
-
-    def get_last_free_block(self):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
-        return struct.unpack("I", self._simfile.read(4))[0]
-
-    def set_last_free_block(self, val):
-        self._simfile.seek(12 + 4 * (S5_NBLKS_PER_FNODE - 1))
-        self._simfile.write(struct.pack("I", val))
-
     def get_root_inode(self):
         self._simfile.seek(12 + 4 * S5_NBLKS_PER_FNODE)
         return struct.unpack("I", self._simfile.read(4))[0]
@@ -536,6 +727,59 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def get_num_blocks(self):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_num_blocks(self, val):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_block(self):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_block(self, val):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_blocks(self):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_blocks(self, val):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_first_data_block(self):
+        return self.get_bitmap_block() + self.get_bitmap_blocks()
+
+    def _bitmap_byte(self, blockno):
+        return S5_BLOCK_SIZE * self.get_bitmap_block() + blockno / 8
+
+    def get_block_used(self, blockno):
+        self._simfile.seek(self._bitmap_byte(blockno))
+        return 0 != (ord(self._simfile.read(1)) & (1 << (blockno % 8)))
+
+    def set_block_used(self, blockno, used):
+        self._simfile.seek(self._bitmap_byte(blockno))
+        byte = ord(self._simfile.read(1))
+        if (used):
+            byte |= 1 << (blockno % 8)
+        else:
+            byte &= ~(1 << (blockno % 8))
+        self._simfile.seek(self._bitmap_byte(blockno))
+        self._simfile.write(chr(byte))
+
+    def count_free_blocks(self):
+        used = 0
+        start = S5_BLOCK_SIZE * self.get_bitmap_block()
+        nbits = self.get_bitmap_blocks() * S5_BITS_PER_BLOCK
+        self._simfile.seek(start)
+        for c in self._simfile.read(nbits / 8):
+            used += bin(ord(c)).count("1")
+        return nbits - used
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
@@ -543,16 +787,15 @@ class Simdisk:
         res += "num inodes: {0}\n".format(self.get_num_inodes())
         res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
-        res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
-        for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
-            res += "  {0}".format(self.get_free_block(i))
-            if ((i + 1) % 10 == 0):
-                res += "\n"
-        if (res[-1] != "\n"):
-            res += "\n"
-        res += "  last free block: {0}\n".format(self.get_last_free_block())
+        res += "num blocks: {0}\n".format(self.get_num_blocks())
+        res += "bitmap:     blocks {0}-{1}{2}\n".format(self.get_bitmap_block(), self.get_first_data_block() - 1,
+                                                    "" if self.get_bitmap_blocks() == self._bitmap_blocks_for(self.get_num_blocks()) else " (INVALID)")
+        res += "free blocks: {0}\n".format(self.count_free_blocks())
         return res
 
+    def _bitmap_blocks_for(self, blocks):
+        return int((blocks + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK)
+
     def format(self, inodes, size):
         if (inodes < 1):
             raise S5fsException("cannot format disk with {0} inodes, must have at least one".format(inodes))
@@ -560,11 +803,13 @@ class Simdisk:
             raise S5fsException("cannot format disk to size {0} which is not a multiple of the block size {1}".format(size, S5_BLOCK_SIZE))
         blocks = int(size / S5_BLOCK_SIZE)
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
-        if (iblocks + 1 >= blocks):
-            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
-        self._simfile.truncate()
-        self._simfile.seek(size)
-        self._simfile.write("")
+        bblocks = self._bitmap_blocks_for(blocks)
+        if (iblocks + bblocks + 1 >= blocks):
+            raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes and free block bitmap require at least {2} bytes of space".format(size, inodes, (1 + iblocks + bblocks) * S5_BLOCK_SIZE))
+        # Writing nothing past the end does not extend the file, so size
+        # it explicitly, or the disk would end at the last block written
+        self._simfile.truncate(0)
+        self._simfile.truncate(size)
 
         self.set_magic(S5_MAGIC)
         self.set_version(S5_CURRENT_VERSION)
@@ -577,25 +822,26 @@ class Simdisk:
         inode.set_next_free(0xffffffff)
         self.set_free_inode(0)
 
-        self.set_last_free_block(0xffffffff)
-        i = 0
-        for num in xrange(iblocks, blocks):
-            if (i == S5_NBLKS_PER_FNODE - 1):
-                block = self.get_block(num)
-                for j in xrange(S5_NBLKS_PER_FNODE - 1):
-                    block.write(j * 4, struct.pack("I", self.get_free_block(j)))
-                block.write((S5_NBLKS_PER_FNODE - 1) * 4, struct.pack("I", self.get_last_free_block()))
-                self.set_last_free_block(num)
-                i = 0
-            else:
-                self.set_free_block(i, num)
-                i += 1
-        self.set_nfree(i)
+        # the free block list of older versions is unused, and the
+        # bitmap marks the superblock, inodes, bitmap, and everything
+        # past the end of the disk as in use
+        self.set_num_blocks(blocks)
+        self.set_bitmap_block(1 + iblocks)
+        self.set_bitmap_blocks(bblocks)
+        first = self.get_first_data_block()
+        bitmap = bytearray(bblocks * S5_BLOCK_SIZE)
+        for num in xrange(first):
+            bitmap[num / 8] |= 1 << (num % 8)
+        for num in xrange(blocks, bblocks * S5_BITS_PER_BLOCK):
+            bitmap[num / 8] |= 1 << (num % 8)
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_bitmap_block())
+        self._simfile.write(bitmap)
 
         root = self.alloc_inode()
         for i in xrange(S5_NDIRECT_BLOCKS):
             root.set_direct_blockno(i, 0)
-        root.set_indirect_blockno(0)
+        for level in xrange(1, S5_INDIRECT_LEVELS + 1):
+            root.set_indirect_blockno(0, level)
         root.set_type(S5_TYPE_DIR)
         root.set_size(0)
         root.set_link_count(1)
@@ -630,22 +876,40 @@ class Simdisk:
         offset = S5_BLOCK_SIZE * index
         return Block(self, offset, index)
 
-    def alloc_block(self):
-        if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
-            raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
-        if (self.get_nfree() == 0):
-            if (self.get_last_free_block() == 0xffffffff):
-                raise S5fsDiskSpaceException()
-            else:
-                block = self.get_block(self.get_last_free_block())
-                for i in xrange(S5_NBLKS_PER_FNODE - 1):
-                    self.set_free_block(i, struct.unpack("I", block.read(i * 4, 4))[0])
-                self.set_last_free_block(struct.unpack("I", block.read((S5_NBLKS_PER_FNODE - 1) * 4, 4))[0])
-                self.set_nfree(S5_NBLKS_PER_FNODE - 1)
-            return block
-        else:
-            self.set_nfree(self.get_nfree() - 1)
-            return self.get_block(self.get_free_block(self.get_nfree()))
+    def _find_free_block(self, first, end):
+        # first free block in [first, end), or None
+        num = first
+        while (num < end):
+            if (num % 8 == 0 and num + 8 <= end):
+                self._simfile.seek(self._bitmap_byte(num))
+                if (ord(self._simfile.read(1)) == 0xff):
+                    num += 8
+                    continue
+            if (not self.get_block_used(num)):
+                return num
+            num += 1
+        return None
+
+    def alloc_block(self, goal=None):
+        # same policy as the kernel: the goal if it is free, then the rest
+        # of its allocation group, then the following groups
+        first = self.get_first_data_block()
+        blocks = self.get_num_blocks()
+        if (goal == None or goal < first or goal >= blocks):
+            goal = getattr(self, "_rotor", first)
+            if (goal >= blocks):
+                goal = first
+        groupend = min(blocks, goal - goal % S5_BITS_PER_BLOCK + S5_BITS_PER_BLOCK)
+        num = self._find_free_block(goal, groupend)
+        if (num == None):
+            num = self._find_free_block(groupend, blocks)
+        if (num == None):
+            num = self._find_free_block(first, goal)
+        if (num == None):
+            raise S5fsDiskSpaceException()
+        self.set_block_used(num, True)
+        self._rotor = num + 1
+        return self.get_block(num)
 
     def open(self, path, create=False):
         return self.get_inode(self.get_root_inode()).open(path, create=create)
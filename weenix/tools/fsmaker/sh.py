@@ -294,7 +294,7 @@ class FsmakerShell(cmd.Cmd):
                 else:
                     try:
                         print(inode.get_summary())
-                        if (options.indirect and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ]) and inode.get_indirect_blockno() != 0):
+                        if (options.indirect and inode.get_type() in set([ api.S5_TYPE_DATA, api.S5_TYPE_DIR ]) and not inode.has_extents() and inode.get_indirect_blockno() != 0):
                             try:
                                 iblock = self._simdisk.get_block(inode.get_indirect_blockno())
                                 for i in xrange(api.S5_BLOCK_SIZE / 4):
@@ -14,6 +14,7 @@
 #endif
 
 struct dirent;
+struct iovec;
 
 /* User exec-related */
 int     fork(void);
@@ -41,6 +42,10 @@ int     open(const char *filename, int flags, int mode);
 int     close(int fd);
 int     read(int fd, void *buf, size_t nbytes);
 int     write(int fd, const void *buf, size_t nbytes);
+int     readv(int fd, const struct iovec *iov, int iovcnt);
+int     writev(int fd, const struct iovec *iov, int iovcnt);
+int     pread(int fd, void *buf, size_t nbytes, off_t offset);
+int     pwrite(int fd, const void *buf, size_t nbytes, off_t offset);
 off_t   lseek(int fd, off_t offset, int whence);
 int     dup(int fd);
 int     dup2(int ofd, int nfd);
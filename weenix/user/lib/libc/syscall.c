@@ -211,6 +211,52 @@ int write(int fd, const void *buf, size_t nbytes)
         return trap(SYS_write, (uint32_t) &args);
 }
 
+int readv(int fd, const struct iovec *iov, int iovcnt)
+{
+        rwv_args_t args;
+
+        args.fd = fd;
+        args.iov = (struct iovec *) iov;
+        args.iovcnt = iovcnt;
+
+        return trap(SYS_readv, (uint32_t) &args);
+}
+
+int writev(int fd, const struct iovec *iov, int iovcnt)
+{
+        rwv_args_t args;
+
+        args.fd = fd;
+        args.iov = (struct iovec *) iov;
+        args.iovcnt = iovcnt;
+
+        return trap(SYS_writev, (uint32_t) &args);
+}
+
+int pread(int fd, void *buf, size_t nbytes, off_t offset)
+{
+        prw_args_t args;
+
+        args.fd = fd;
+        args.buf = buf;
+        args.nbytes = nbytes;
+        args.offset = offset;
+
+        return trap(SYS_pread, (uint32_t) &args);
+}
+
+int pwrite(int fd, const void *buf, size_t nbytes, off_t offset)
+{
+        prw_args_t args;
+
+        args.fd = fd;
+        args.buf = (void *) buf;
+        args.nbytes = nbytes;
+        args.offset = offset;
+
+        return trap(SYS_pwrite, (uint32_t) &args);
+}
+
 int close(int fd)
 {
         return trap(SYS_close, (uint32_t) fd);